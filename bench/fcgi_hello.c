@@ -0,0 +1,114 @@
+//
+// The smallest useful FastCGI responder, the counterpart of hello.cgi in
+// bench/run.sh: answers "hello <QUERY_STRING>" in plain text. Started by
+// the server as a pool worker, it accepts connections on the listening
+// socket it gets as stdin and serves requests on each until the server
+// hangs up. Run any other way (stdin not a socket) it acts as plain CGI.
+//
+// usage: copy it into the docroot as <name>.fcgi, start the server with -F n
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FCGI_BEGIN_REQUEST (1)
+#define FCGI_END_REQUEST (3)
+#define FCGI_PARAMS (4)
+#define FCGI_STDIN (5)
+#define FCGI_STDOUT (6)
+
+static int read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, (char *)buf + got, len - got);
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+static void put_record(char *buf, size_t *pos, int type, int id,
+                       const char *content, size_t len) {
+    unsigned char h[8] = {1, type, id >> 8, id & 0xff, len >> 8, len & 0xff, 0, 0};
+
+    memcpy(buf + *pos, h, sizeof(h));
+    memcpy(buf + *pos + sizeof(h), content, len);
+    *pos += sizeof(h) + len;
+}
+
+static size_t param_length(const unsigned char **p) {
+    size_t len = *(*p)++;
+
+    if (len & 0x80) {
+        len = (len & 0x7f) << 24 | (*p)[0] << 16 | (*p)[1] << 8 | (*p)[2];
+        *p += 3;
+    }
+    return len;
+}
+
+// QUERY_STRING out of a block of name-value pairs
+static void find_query(const unsigned char *p, const unsigned char *end,
+                       char *query, size_t size) {
+    while (p < end) {
+        size_t nlen = param_length(&p), vlen = param_length(&p);
+        if (p + nlen + vlen > end)
+            return;
+        if (nlen == 12 && memcmp(p, "QUERY_STRING", 12) == 0)
+            snprintf(query, size, "%.*s", (int)vlen, p + nlen);
+        p += nlen + vlen;
+    }
+}
+
+// requests on one connection, until the server closes it
+static void serve(int fd) {
+    unsigned char h[8], content[65536 + 256];
+    char query[1024] = "", body[2048], out[4096];
+    int keep_conn = 0;
+
+    while (read_full(fd, h, sizeof(h)) == 0) {
+        int id = h[2] << 8 | h[3];
+        size_t len = h[4] << 8 | h[5], pos = 0;
+
+        if (read_full(fd, content, len + h[6]) < 0)
+            return;
+        if (h[1] == FCGI_BEGIN_REQUEST) {
+            keep_conn = content[2] & 1;
+            query[0] = '\0';
+        } else if (h[1] == FCGI_PARAMS) {
+            find_query(content, content + len, query, sizeof(query));
+        } else if (h[1] == FCGI_STDIN && len == 0) {
+            // the request is complete: answer it
+            unsigned char end[8] = {0};
+            int n = snprintf(body, sizeof(body),
+                             "Content-Type: text/plain\r\n\r\nhello %s\n", query);
+            put_record(out, &pos, FCGI_STDOUT, id, body, n);
+            put_record(out, &pos, FCGI_STDOUT, id, NULL, 0);
+            put_record(out, &pos, FCGI_END_REQUEST, id, (char *)end, sizeof(end));
+            if (write(fd, out, pos) != (ssize_t)pos || !keep_conn)
+                return;
+        }
+    }
+}
+
+int main(void) {
+    socklen_t len = sizeof(int);
+    int type;
+
+    if (getsockopt(STDIN_FILENO, SOL_SOCKET, SO_TYPE, &type, &len) < 0) {
+        const char *query = getenv("QUERY_STRING");
+        printf("Content-Type: text/plain\r\n\r\nhello %s\n", query ? query : "");
+        return 0;
+    }
+    while (1) {
+        int fd = accept(STDIN_FILENO, NULL, NULL);
+        if (fd < 0)
+            continue;
+        serve(fd);
+        close(fd);
+    }
+}
@@ -0,0 +1,141 @@
+//
+// Hand-off throughput between the accept thread and the workers: the
+// lock-free conn_queue_t against the mutex + two semaphores ring it
+// replaced, with P producers and C consumers moving N items in total
+// through a queue of the given capacity. Items are small integers, cast
+// to the connection pointers the queue carries.
+//
+// usage: queue_bench [producers] [consumers] [capacity] [million_items]
+//
+
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/conn_queue.h"
+
+// the old conn_buffer_t from src/main.c, minus its fixed 1024 cells
+typedef struct {
+    int *buffer;
+    int in;
+    int out;
+    int capacity;
+    pthread_mutex_t mutex;
+    sem_t empty;
+    sem_t full;
+} locked_buffer_t;
+
+static void locked_init(locked_buffer_t *cb, int capacity) {
+    cb->buffer = malloc(capacity * sizeof(int));
+    assert(cb->buffer != NULL);
+    cb->in = 0;
+    cb->out = 0;
+    cb->capacity = capacity;
+    pthread_mutex_init(&cb->mutex, NULL);
+    sem_init(&cb->empty, 0, capacity);
+    sem_init(&cb->full, 0, 0);
+}
+
+static void locked_put(locked_buffer_t *cb, int fd) {
+    sem_wait(&cb->empty);
+    pthread_mutex_lock(&cb->mutex);
+    cb->buffer[cb->in] = fd;
+    cb->in = (cb->in + 1) % cb->capacity;
+    pthread_mutex_unlock(&cb->mutex);
+    sem_post(&cb->full);
+}
+
+static int locked_get(locked_buffer_t *cb) {
+    int fd;
+
+    sem_wait(&cb->full);
+    pthread_mutex_lock(&cb->mutex);
+    fd = cb->buffer[cb->out];
+    cb->out = (cb->out + 1) % cb->capacity;
+    pthread_mutex_unlock(&cb->mutex);
+    sem_post(&cb->empty);
+    return fd;
+}
+
+static locked_buffer_t locked;
+static conn_queue_t queue;
+static int use_queue;
+static long per_producer, per_consumer;
+static long checksum;
+
+static void *producer(void *arg) {
+    for (long i = 0; i < per_producer; i++) {
+        if (use_queue)
+            conn_queue_put(&queue, (struct conn *)(uintptr_t)i);
+        else
+            locked_put(&locked, (int)i);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    long sum = 0;
+
+    for (long i = 0; i < per_consumer; i++)
+        sum += use_queue ? (long)(uintptr_t)conn_queue_get(&queue)
+                         : locked_get(&locked);
+    __atomic_add_fetch(&checksum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int producers, int consumers) {
+    pthread_t threads[producers + consumers];
+    double start = now();
+
+    checksum = 0;
+    for (int i = 0; i < producers; i++)
+        pthread_create(&threads[i], NULL, producer, NULL);
+    for (int i = 0; i < consumers; i++)
+        pthread_create(&threads[producers + i], NULL, consumer, NULL);
+    for (int i = 0; i < producers + consumers; i++)
+        pthread_join(threads[i], NULL);
+
+    // every item came out exactly once
+    assert(checksum == producers * (per_producer * (per_producer - 1) / 2));
+    return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+    int producers = argc > 1 ? atoi(argv[1]) : 1;
+    int consumers = argc > 2 ? atoi(argv[2]) : 4;
+    int capacity = argc > 3 ? atoi(argv[3]) : 64;
+    long items = (argc > 4 ? atol(argv[4]) : 4) * 1000000;
+    double t;
+
+    // round so producers and consumers move the same total
+    per_producer = items / producers / consumers * consumers;
+    per_consumer = per_producer * producers / consumers;
+    items = per_producer * producers;
+
+    printf("%d producers, %d consumers, capacity %d, %ld items\n", producers,
+           consumers, capacity, items);
+    printf("%-22s %12s %12s\n", "queue", "Mitems/s", "ns/item");
+
+    locked_init(&locked, capacity);
+    use_queue = 0;
+    t = run(producers, consumers);
+    printf("%-22s %12.2f %12.1f\n", "mutex + semaphores", items / t / 1e6,
+           t * 1e9 / items);
+
+    conn_queue_init(&queue, capacity);
+    use_queue = 1;
+    t = run(producers, consumers);
+    printf("%-22s %12.2f %12.1f\n", "conn_queue (lock-free)", items / t / 1e6,
+           t * 1e9 / items);
+    return 0;
+}
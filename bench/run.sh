@@ -0,0 +1,159 @@
+#!/bin/sh
+#
+# Loopback regression benchmark, run by `make bench`.
+#
+# Generates docroots (files of 1 KB to 100 MB, a thousand small files, a
+# CGI script and its FastCGI twin, bench/fcgi_hello), starts the server
+# with each of $BENCH_THREADS worker counts and runs ./client against it
+# for every scenario. One line per run goes to bench/out/results.tsv. If
+# bench/baseline.tsv exists, every run is compared with its line there,
+# and a drop in throughput of more than $BENCH_TOLERANCE percent or a
+# rise in p99 latency of more than $BENCH_LATENCY_TOLERANCE percent fails
+# the run.
+#
+# usage: bench/run.sh [--save-baseline]
+#
+# Environment: BENCH_THREADS ("1 2 4"), BENCH_MODES ("pool epoll uring"),
+# BENCH_DURATION (seconds per run, 3), BENCH_CONNECTIONS (16),
+# BENCH_PORT (8199), BENCH_TOLERANCE (10), BENCH_LATENCY_TOLERANCE (50)
+#
+
+set -e
+set -f # URLs are not globs
+cd "$(dirname "$0")/.."
+SAVE=$1
+
+THREADS=${BENCH_THREADS:-"1 2 4"}
+MODES=${BENCH_MODES:-"pool epoll uring"}
+DURATION=${BENCH_DURATION:-3}
+CONNECTIONS=${BENCH_CONNECTIONS:-16}
+PORT=${BENCH_PORT:-8199}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+LATENCY_TOLERANCE=${BENCH_LATENCY_TOLERANCE:-50}
+
+OUT=bench/out
+DOCROOT=$OUT/docroot
+RESULTS=$OUT/results.tsv
+BASELINE=bench/baseline.tsv
+URL=http://127.0.0.1:$PORT
+
+# the docroot is only rebuilt when this script changes
+make_docroot() {
+    [ -f $DOCROOT/.stamp ] && [ $DOCROOT/.stamp -nt "$0" ] && return
+    rm -rf $DOCROOT
+    mkdir -p $DOCROOT/many
+    head -c 1024 /dev/urandom > $DOCROOT/1k.bin
+    head -c 65536 /dev/urandom > $DOCROOT/64k.bin
+    head -c 1048576 /dev/urandom > $DOCROOT/1m.bin
+    head -c 104857600 /dev/urandom > $DOCROOT/100m.bin
+    # compressible text, for the gzip path
+    i=0
+    while [ $i -lt 400 ]; do
+        echo "<p>line $i of a page that compresses well</p>"
+        i=$((i + 1))
+    done > $DOCROOT/page.html
+    # more files than the open-file cache holds by default
+    i=0
+    : > $OUT/many.urls
+    while [ $i -lt 1000 ]; do
+        head -c 2048 /dev/urandom > $DOCROOT/many/$i.bin
+        echo "$URL/many/$i.bin" >> $OUT/many.urls
+        i=$((i + 1))
+    done
+    cat > $DOCROOT/hello.cgi <<'EOF'
+#!/bin/sh
+printf 'Content-Type: text/plain\r\n\r\nhello %s\n' "$QUERY_STRING"
+EOF
+    chmod +x $DOCROOT/hello.cgi
+    touch $DOCROOT/.stamp
+}
+
+# name and client arguments of every scenario, one per line
+SCENARIOS="1k_keepalive       $URL/1k.bin
+1k_pipelined       -p 8 $URL/1k.bin
+1k_no_keepalive    -K $URL/1k.bin
+page_gzip          -H Accept-Encoding:gzip $URL/page.html
+64k                $URL/64k.bin
+1m                 $URL/1m.bin
+100m               -c 2 $URL/100m.bin
+many_files         -f $OUT/many.urls
+cgi                -c 4 $URL/hello.cgi?x=1
+fcgi               -c 4 $URL/hello.fcgi?x=1"
+
+server_pid=
+stop_server() {
+    if [ -n "$server_pid" ]; then
+        kill $server_pid 2>/dev/null || true
+        wait $server_pid 2>/dev/null || true
+    fi
+    server_pid=
+}
+trap stop_server EXIT INT TERM
+
+start_server() {
+    ./server -p $PORT -d $DOCROOT -l /dev/null -F 2 -m $1 -t $2 > $OUT/server.log 2>&1 &
+    server_pid=$!
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        ./client -n 1 -c 1 -t 1 -j $URL/1k.bin 2>/dev/null | grep -q '"requests": 1,' && return
+        sleep 0.2
+    done
+    echo "server did not come up, see $OUT/server.log" >&2
+    exit 1
+}
+
+# pull one number out of the client's JSON line
+field() {
+    echo "$1" | sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p"
+}
+
+# p50 and p99 of one of its latency objects
+percentiles() {
+    echo "$1" | sed -n "s/.*\"$2\": {\"p50\": \([0-9]*\), \"p90\": [0-9]*, \"p99\": \([0-9]*\),.*/\1 \2/p"
+}
+
+mkdir -p $OUT
+make_docroot
+cp bench/fcgi_hello $DOCROOT/hello.fcgi
+printf 'scenario\tmode\tthreads\trps\tp50_us\tp99_us\tcorrected_p99_us\terrors\n' > $RESULTS
+
+for mode in $MODES; do
+    for threads in $THREADS; do
+        start_server $mode $threads
+        echo "$SCENARIOS" | while read name args; do
+            json=$(./client -t 2 -c $CONNECTIONS -d $DURATION -j $args)
+            set -- $(percentiles "$json" latency_us) $(percentiles "$json" corrected_us)
+            line=$(printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s' $name $mode $threads \
+                $(field "$json" rps) $1 $2 $4 $(field "$json" errors))
+            echo "$line" >> $RESULTS
+            echo "$line"
+        done
+        stop_server
+    done
+done
+
+if [ "$SAVE" = "--save-baseline" ]; then
+    cp $RESULTS $BASELINE
+    echo "saved $BASELINE"
+    exit 0
+fi
+[ -f $BASELINE ] || { echo "no $BASELINE to compare with (make bench-baseline)"; exit 0; }
+
+# same scenario, mode and thread count; anything new is just reported
+awk -F '\t' -v tol=$TOLERANCE -v ltol=$LATENCY_TOLERANCE '
+    FNR == 1 { next }
+    NR == FNR { rps[$1 FS $2 FS $3] = $4; p99[$1 FS $2 FS $3] = $6; next }
+    {
+        key = $1 FS $2 FS $3
+        if (!(key in rps)) { printf "%-18s %-6s t=%-3s new\n", $1, $2, $3; next }
+        verdict = "ok"
+        if ($4 < rps[key] * (1 - tol / 100)) verdict = "SLOWER"
+        if ($6 > p99[key] * (1 + ltol / 100) && $6 > 1000) verdict = verdict == "ok" ? "LATENCY" : verdict "+LATENCY"
+        if ($8 > 0) verdict = verdict == "ok" ? "ERRORS" : verdict "+ERRORS"
+        printf "%-18s %-6s t=%-3s %10.0f req/s (%+.1f%%)  p99 %6dus (was %dus)  %s\n",
+               $1, $2, $3, $4, rps[key] ? 100 * ($4 / rps[key] - 1) : 0, $6, p99[key], verdict
+        if (verdict != "ok") failed++
+    }
+    END {
+        if (failed) { print failed " regression(s) against the baseline"; exit 1 }
+        print "no regressions against the baseline"
+    }' $BASELINE $RESULTS
@@ -0,0 +1,142 @@
+//
+// Compare the two ways request_serve_static() can send a file body:
+// open + mmap + write + munmap versus open + sendfile, over a loopback TCP
+// connection, for file sizes from 1 KB up to 1 GB. The crossover is what
+// the server's -f option (sendfile threshold) should be set to.
+//
+// usage: sendfile_bench [max_size_mb] [dir]
+//
+
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB (1024L * 1024L)
+#define BYTES_PER_RUN (512 * MB) // send about this much per measurement
+
+static long received; // bytes drained by the reader thread
+
+static void *reader(void *arg) {
+    int fd = *(int *)arg;
+    char buf[256 * 1024];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        __atomic_add_fetch(&received, n, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        assert(n > 0);
+        p += n;
+        len -= n;
+    }
+}
+
+static void send_mmap(int sock, const char *path, size_t size) {
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    char *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(p != MAP_FAILED);
+    close(fd);
+    write_all(sock, p, size);
+    munmap(p, size);
+}
+
+static void send_sendfile(int sock, const char *path, size_t size) {
+    int fd = open(path, O_RDONLY);
+    off_t off = 0;
+    assert(fd >= 0);
+    while ((size_t)off < size) {
+        ssize_t n = sendfile(sock, fd, &off, size - off);
+        assert(n > 0);
+    }
+    close(fd);
+}
+
+// average microseconds per file sent with fn, waiting until it was all read
+static double run(void (*fn)(int, const char *, size_t), int sock,
+                  const char *path, size_t size, int iters) {
+    long target = __atomic_load_n(&received, __ATOMIC_ACQUIRE) + (long)size * iters;
+    double start = now();
+
+    for (int i = 0; i < iters; i++)
+        fn(sock, path, size);
+    while (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < target)
+        ;
+    return (now() - start) * 1e6 / iters;
+}
+
+static void make_file(const char *path, size_t size) {
+    static char block[MB];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    for (size_t i = 0; i < sizeof(block); i++)
+        block[i] = 'a' + i % 26;
+    for (size_t left = size; left > 0;) {
+        size_t n = left < sizeof(block) ? left : sizeof(block);
+        write_all(fd, block, n);
+        left -= n;
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    long max_size = (argc > 1 ? atol(argv[1]) : 1024) * MB;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t len = sizeof(addr);
+    char path[4096];
+    pthread_t thread;
+
+    // a loopback TCP connection with a thread draining the far end
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(lfd, 1) == 0);
+    assert(getsockname(lfd, (struct sockaddr *)&addr, &len) == 0);
+    int cfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(cfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    int sock = accept(lfd, NULL, NULL);
+    assert(sock >= 0);
+    pthread_create(&thread, NULL, reader, &cfd);
+
+    snprintf(path, sizeof(path), "%s/sendfile_bench.%d", dir, getpid());
+    printf("%10s %12s %12s %12s %12s\n", "size", "mmap us", "sendfile us",
+           "mmap MB/s", "sendfile MB/s");
+
+    for (long size = 1024; size <= max_size; size *= 4) {
+        int iters = BYTES_PER_RUN / size;
+        if (iters < 3)
+            iters = 3;
+        if (iters > 20000)
+            iters = 20000;
+
+        make_file(path, size);
+        send_sendfile(sock, path, size); // warm the page cache
+        double m = run(send_mmap, sock, path, size, iters);
+        double s = run(send_sendfile, sock, path, size, iters);
+        printf("%9ldK %12.1f %12.1f %12.0f %12.0f\n", size / 1024, m, s,
+               size / m, size / s);
+        fflush(stdout);
+        unlink(path);
+    }
+    return 0;
+}
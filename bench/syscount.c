@@ -0,0 +1,155 @@
+//
+// Count the system calls a program makes, over all its threads, to see
+// what an I/O engine costs per request: run the server under it, put a
+// known number of requests through it with the client, stop it with
+// ctrl-C (passed on to the server) and divide. ptrace() slows the server
+// down a lot, so only the counts mean anything, not the timings. Programs
+// the server spawns (CGI, FastCGI) aren't followed.
+//
+// usage: syscount [-n requests] command [args...]
+//
+// e.g.   bench/syscount -n 100000 ./server -m uring -t 1 &
+//        ./client -n 100000 -c 10 8080
+//        kill -INT %1
+//
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_SYSCALL (1024)
+
+static unsigned long counts[MAX_SYSCALL];
+static pid_t child;
+
+// names of the calls that matter for serving requests; others print as
+// numbers
+#define NAME(call) [SYS_##call] = #call
+static const char *names[MAX_SYSCALL] = {
+    NAME(read), NAME(write), NAME(readv), NAME(writev), NAME(recvfrom),
+    NAME(sendto), NAME(recvmsg), NAME(sendmsg), NAME(sendfile), NAME(splice),
+    NAME(pipe2), NAME(accept), NAME(accept4), NAME(close), NAME(shutdown),
+    NAME(openat), NAME(statx), NAME(newfstatat), NAME(fstat), NAME(fcntl),
+    NAME(getpeername), NAME(setsockopt), NAME(mmap), NAME(munmap),
+    NAME(madvise), NAME(futex), NAME(epoll_wait), NAME(epoll_pwait),
+    NAME(epoll_ctl), NAME(io_uring_enter), NAME(io_uring_setup),
+    NAME(io_uring_register), NAME(clock_gettime), NAME(gettid), NAME(getpid),
+    NAME(rt_sigprocmask), NAME(clone), NAME(clone3), NAME(dup), NAME(wait4),
+    NAME(kill), NAME(sched_yield), NAME(inotify_add_watch), NAME(brk),
+    NAME(nanosleep), NAME(poll), NAME(mprotect),
+};
+
+// the server exits on SIGINT; so should we, after it
+static void forward(int sig) {
+    kill(child, sig);
+}
+
+static int by_count(const void *a, const void *b) {
+    unsigned long ca = counts[*(const int *)a], cb = counts[*(const int *)b];
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void report(unsigned long requests) {
+    int order[MAX_SYSCALL];
+    unsigned long total = 0;
+
+    for (int i = 0; i < MAX_SYSCALL; i++) {
+        order[i] = i;
+        total += counts[i];
+    }
+    qsort(order, MAX_SYSCALL, sizeof(int), by_count);
+
+    printf("%-20s %12s", "syscall", "calls");
+    if (requests)
+        printf(" %12s", "per request");
+    printf("\n");
+    for (int i = 0; i < MAX_SYSCALL && counts[order[i]]; i++) {
+        char num[32];
+        const char *name = names[order[i]];
+        if (name == NULL) {
+            snprintf(num, sizeof(num), "syscall %d", order[i]);
+            name = num;
+        }
+        printf("%-20s %12lu", name, counts[order[i]]);
+        if (requests)
+            printf(" %12.2f", (double)counts[order[i]] / requests);
+        printf("\n");
+    }
+    printf("%-20s %12lu", "total", total);
+    if (requests)
+        printf(" %12.2f", (double)total / requests);
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct __ptrace_syscall_info info;
+    unsigned long requests = 0;
+    int opt, status;
+    pid_t tid;
+
+    while ((opt = getopt(argc, argv, "+n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "usage: %s [-n requests] command [args...]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+        requests = strtoul(optarg, NULL, 10);
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-n requests] command [args...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((child = fork()) == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP); // let the parent set its options first
+        execvp(argv[optind], argv + optind);
+        perror(argv[optind]);
+        _exit(127);
+    }
+    if (child < 0 || waitpid(child, &status, 0) < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, forward);
+    signal(SIGTERM, forward);
+    // every thread the server creates is followed, and the server dies
+    // with us
+    ptrace(PTRACE_SETOPTIONS, child, NULL,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
+               PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    while (1) {
+        int sig = 0;
+
+        tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR)
+                continue;
+            break; // no tracees left
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            continue;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY &&
+                info.entry.nr < MAX_SYSCALL)
+                counts[info.entry.nr]++;
+        } else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP) {
+            // a real signal, not a ptrace event or a new thread's first
+            // stop: the tracee gets it
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+
+    report(requests);
+    return EXIT_SUCCESS;
+}
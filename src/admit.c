@@ -0,0 +1,216 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admit.h"
+#include "io_helper.h"
+#include "stats.h"
+
+int admit_max_conns = 0;
+int admit_rate = 0;
+int admit_burst = 0;
+
+// a client address, kept while it has connections open or tokens to regain
+typedef struct admit_client {
+    unsigned char addr[16]; // IPv4 as ::ffff:a.b.c.d
+    unsigned long hash;
+    int conns;
+    double tokens;
+    double stamp; // when tokens was last brought up to date, seconds
+    struct admit_client *next;
+} admit_client_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    admit_client_t *buckets[ADMIT_BUCKETS];
+} __attribute__((aligned(64))) admit_shard_t;
+
+static admit_shard_t *clients; // NULL: no per-client limits
+
+// sent as is: the connection is closed right after
+static const char refusal[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                              "Retry-After: " ADMIT_RETRY_AFTER "\r\n"
+                              "Content-Type: text/plain\r\n"
+                              "Content-Length: 19\r\n"
+                              "Connection: close\r\n"
+                              "\r\n"
+                              "Server is too busy\n";
+
+void admit_init(void) {
+    if (admit_rate > 0 && admit_burst < admit_rate)
+        admit_burst = admit_rate;
+    if (admit_max_conns <= 0 && admit_rate <= 0)
+        return;
+    clients = malloc_or_die(ADMIT_SHARDS * sizeof(admit_shard_t));
+    for (int i = 0; i < ADMIT_SHARDS; i++) {
+        pthread_mutex_init(&clients[i].lock, NULL);
+        memset(clients[i].buckets, 0, sizeof(clients[i].buckets));
+    }
+}
+
+static double admit_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static admit_shard_t *admit_shard(unsigned long hash) {
+    return &clients[hash % ADMIT_SHARDS];
+}
+
+static admit_client_t **admit_bucket(unsigned long hash) {
+    return &admit_shard(hash)->buckets[(hash / ADMIT_SHARDS) % ADMIT_BUCKETS];
+}
+
+// 16-byte key for addr, and its hash
+static unsigned long admit_key(const struct sockaddr *addr,
+                               unsigned char key[16]) {
+    uint64_t a, b, h;
+
+    memset(key, 0, 16);
+    if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    } else {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+    memcpy(&a, key, 8);
+    memcpy(&b, key + 8, 8);
+    h = (a * 0x9e3779b97f4a7c15ULL) ^ (b * 0xc2b2ae3d27d4eb4fULL);
+    return h ^ (h >> 29);
+}
+
+// nothing left to remember: no connections, and a full bucket again
+static int admit_stale(admit_client_t *client, double now) {
+    return client->conns == 0 &&
+           (admit_rate == 0 ||
+            client->tokens + (now - client->stamp) * admit_rate >= admit_burst);
+}
+
+//
+// The entry for key, created if there is none. Stale entries met on the
+// way are dropped, which is what keeps the table from growing with every
+// address ever seen. Called with the shard locked.
+//
+static admit_client_t *admit_find(const unsigned char key[16],
+                                  unsigned long hash, double now) {
+    admit_client_t **link = admit_bucket(hash), *client;
+
+    while ((client = *link) != NULL) {
+        if (memcmp(client->addr, key, 16) == 0)
+            return client;
+        if (admit_stale(client, now)) {
+            *link = client->next;
+            free(client);
+        } else {
+            link = &client->next;
+        }
+    }
+    client = malloc_or_die(sizeof(admit_client_t));
+    memcpy(client->addr, key, 16);
+    client->hash = hash;
+    client->conns = 0;
+    client->tokens = admit_burst;
+    client->stamp = now;
+    client->next = *admit_bucket(hash);
+    *admit_bucket(hash) = client;
+    return client;
+}
+
+int admit_conn(conn_t *conn, const struct sockaddr *addr) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    admit_client_t *client;
+    admit_shard_t *shard;
+    unsigned char key[16];
+    unsigned long hash;
+    int ok;
+
+    if (clients == NULL)
+        return 0;
+    if (addr == NULL) {
+        if (getpeername(conn->fd, (struct sockaddr *)&peer, &len) < 0)
+            return 0;
+        addr = (struct sockaddr *)&peer;
+    }
+    // saves the access log its own getpeername()
+    if (conn->peer[0] == '\0') {
+        const void *src =
+            addr->sa_family == AF_INET6
+                ? (const void *)&((const struct sockaddr_in6 *)addr)->sin6_addr
+                : (const void *)&((const struct sockaddr_in *)addr)->sin_addr;
+        inet_ntop(addr->sa_family, src, conn->peer, sizeof(conn->peer));
+    }
+
+    hash = admit_key(addr, key);
+    shard = admit_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+    client = admit_find(key, hash, admit_now());
+    ok = admit_max_conns == 0 || client->conns < admit_max_conns;
+    if (ok) {
+        client->conns++;
+        conn->client = client;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ok ? 0 : -1;
+}
+
+void admit_release(conn_t *conn) {
+    admit_client_t *client = conn->client, **link;
+    admit_shard_t *shard;
+
+    if (client == NULL)
+        return;
+    conn->client = NULL;
+    shard = admit_shard(client->hash);
+    pthread_mutex_lock(&shard->lock);
+    // without a rate to keep track of, the entry goes with the last
+    // connection; otherwise a later lookup drops it once it is stale
+    if (--client->conns == 0 && admit_rate == 0) {
+        for (link = admit_bucket(client->hash); *link != client;
+             link = &(*link)->next)
+            ;
+        *link = client->next;
+        free(client);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int admit_request(conn_t *conn) {
+    admit_client_t *client = conn->client;
+    admit_shard_t *shard;
+    double now;
+    int ok;
+
+    if (admit_rate == 0 || client == NULL)
+        return 0;
+    shard = admit_shard(client->hash);
+    now = admit_now();
+    pthread_mutex_lock(&shard->lock);
+    client->tokens += (now - client->stamp) * admit_rate;
+    if (client->tokens > admit_burst)
+        client->tokens = admit_burst;
+    client->stamp = now;
+    ok = client->tokens >= 1;
+    if (ok)
+        client->tokens -= 1;
+    pthread_mutex_unlock(&shard->lock);
+    if (!ok)
+        stats_add(STAT_REQUESTS_LIMITED, 1);
+    return ok ? 0 : -1;
+}
+
+void admit_refuse(int fd) {
+    char buf[1024];
+
+    stats_add(STAT_CONNECTIONS_SHED, 1);
+    send(fd, refusal, sizeof(refusal) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    // read what the client already sent, so the close doesn't turn into a
+    // reset that could destroy the 503 before the client has read it
+    for (int i = 0; i < 4 && recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0; i++)
+        ;
+}
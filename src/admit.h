@@ -0,0 +1,45 @@
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <sys/socket.h>
+
+#include "conn.h"
+
+//
+// Admission control, so that overload costs clients a quick 503 rather
+// than a timeout. Connections beyond what the queue holds are answered
+// with a preformatted 503 and closed by the accept path. Per client
+// address there is an optional cap on open connections and an optional
+// token bucket on requests; clients are tracked in a hash table split
+// into ADMIT_SHARDS independently locked shards.
+//
+
+#define ADMIT_SHARDS (64)
+#define ADMIT_BUCKETS (256) // per shard
+#define ADMIT_RETRY_AFTER "1" // seconds, in every 429 and 503
+
+// settable from the command line; 0 disables
+extern int admit_max_conns; // open connections per client address
+extern int admit_rate;      // requests per second per client address
+extern int admit_burst;     // requests above the rate a client may bank
+
+// set up the client table if any limit is on
+void admit_init(void);
+
+//
+// Count a new connection against its client (addr, or the socket's peer
+// if NULL), filling in conn->peer on the way. Returns -1 if the client
+// already has admit_max_conns open; answer with admit_refuse().
+//
+int admit_conn(conn_t *conn, const struct sockaddr *addr);
+
+// the connection is closing (called by conn_free())
+void admit_release(conn_t *conn);
+
+// Take a token for a request; -1 if the client is over its rate
+int admit_request(conn_t *conn);
+
+// Best-effort 503 to a connection that won't be served; doesn't close it
+void admit_refuse(int fd);
+
+#endif // __ADMIT_H__
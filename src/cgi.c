@@ -0,0 +1,343 @@
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "cgi.h"
+#include "io_helper.h"
+#include "log.h"
+#include "stats.h"
+
+#define CGI_EVENTS (64)
+
+int cgi_max_procs = CGI_MAX_PROCS;
+int cgi_timeout = CGI_TIMEOUT;
+
+// which of a job's descriptors an epoll event is about
+enum CgiWatch { CGI_PIPE, CGI_SOCKET, CGI_PIDFD, CGI_WATCHES };
+
+typedef struct cgi_job cgi_job_t;
+
+typedef struct {
+    cgi_job_t *job;
+    int kind;
+} cgi_watch_t;
+
+struct cgi_job {
+    cgi_job_t *next;
+    char *path;
+    pid_t pid;
+    int pidfd;   // -1 without pidfd_open(); reaped by polling then
+    int pipe_fd; // -1 once the output is done with
+    int sock_fd;
+    conn_t *pending; // responses queued ahead of this one, NULL once sent
+    int exited;
+    int killed;
+    time_t deadline;
+    cgi_watch_t watch[CGI_WATCHES];
+
+    // output read from the pipe; buf[off..len) isn't sent yet
+    size_t len;
+    size_t off;
+    char buf[CGI_BUF];
+};
+
+//
+// Jobs are added by the workers and freed by the helper thread, only after
+// a whole batch of events is handled, so no event outlives its job. The
+// helper holds jobs_lock while it handles a batch, and a worker while it
+// registers a job's descriptors; otherwise a job could finish and close
+// them before they are all in the epoll set.
+//
+static cgi_job_t *jobs;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long running;
+static int epfd = -1;
+
+pid_t cgi_spawn(const char *path, char *const envp[], int stdin_fd,
+                int stdout_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    char *argv[] = {(char *)path, NULL};
+    sigset_t none, pipe;
+    pid_t pid;
+    int rc;
+
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    if (stdout_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+    // nothing else of ours: an inherited listener or client socket would
+    // stay open as long as the program runs
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+    // the server ignores SIGPIPE and the calling thread may block signals;
+    // the program should start with neither. Its own process group lets a
+    // timeout kill whatever it started, and keeps ctrl-C away from it.
+    sigemptyset(&none);
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &pipe);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETPGROUP);
+
+    rc = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
+
+// the server's environment with QUERY_STRING set to query, which comes
+// first so cgi_env_free() knows what to free
+static char **cgi_env(const char *query) {
+    extern char **environ;
+    size_t n = 0, len = strlen(query) + sizeof("QUERY_STRING=");
+    char **envp;
+
+    while (environ[n])
+        n++;
+    envp = malloc_or_die((n + 2) * sizeof(char *));
+    envp[0] = malloc_or_die(len);
+    snprintf(envp[0], len, "QUERY_STRING=%s", query);
+    n = 1;
+    for (char **var = environ; *var; var++) {
+        if (strncmp(*var, "QUERY_STRING=", 13) != 0)
+            envp[n++] = *var;
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+static void cgi_env_free(char **envp) {
+    free(envp[0]);
+    free(envp);
+}
+
+static void cgi_watch(cgi_job_t *job, int kind, int fd, unsigned events) {
+    struct epoll_event ev = {.events = events, .data.ptr = &job->watch[kind]};
+
+    job->watch[kind].job = job;
+    job->watch[kind].kind = kind;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        perror("epoll_ctl");
+}
+
+int cgi_run(const char *path, const char *query, conn_t *conn, int sock_fd,
+            const char *head, size_t head_len) {
+    int pipefd[2], err;
+    cgi_job_t *job;
+    char **envp;
+    pid_t pid;
+
+    assert(head_len <= CGI_BUF);
+    if (__atomic_add_fetch(&running, 1, __ATOMIC_RELAXED) >
+        (unsigned long)cgi_max_procs) {
+        __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+        errno = EAGAIN;
+        return -1;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        err = errno;
+        __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+        errno = err;
+        return -1;
+    }
+    envp = cgi_env(query);
+    pid = cgi_spawn(path, envp, -1, pipefd[1]);
+    err = errno;
+    cgi_env_free(envp);
+    close(pipefd[1]);
+    if (pid < 0) {
+        close(pipefd[0]);
+        __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+        errno = err;
+        return -1;
+    }
+
+    job = malloc_or_die(sizeof(cgi_job_t));
+    job->path = strdup(path);
+    job->pid = pid;
+    job->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    job->pipe_fd = pipefd[0];
+    job->sock_fd = sock_fd;
+    job->pending = conn_hand_over(conn, sock_fd);
+    job->exited = 0;
+    job->killed = 0;
+    job->deadline = time(NULL) + cgi_timeout;
+    memcpy(job->buf, head, head_len);
+    job->len = head_len;
+    job->off = 0;
+    fcntl(job->pipe_fd, F_SETFL, O_NONBLOCK);
+    fcntl(job->sock_fd, F_SETFL, fcntl(job->sock_fd, F_GETFL) | O_NONBLOCK);
+
+    // edge-triggered: each side is used until it would block, and the
+    // socket's first EPOLLOUT sends what was pending, then the head
+    pthread_mutex_lock(&jobs_lock);
+    job->next = jobs;
+    jobs = job;
+    cgi_watch(job, CGI_PIPE, job->pipe_fd, EPOLLIN | EPOLLET);
+    cgi_watch(job, CGI_SOCKET, job->sock_fd, EPOLLOUT | EPOLLET);
+    if (job->pidfd >= 0)
+        cgi_watch(job, CGI_PIDFD, job->pidfd, EPOLLIN);
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+//
+// Closing a descriptor only drops it from the epoll set once no process
+// has it open, and the worker may still hold the socket, or a program
+// being spawned right now a copy of all three. So they leave explicitly.
+//
+static void cgi_unwatch(int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+// the output is complete, or nobody is left to read it
+static void cgi_finish(cgi_job_t *job) {
+    if (job->pending) {
+        conn_drop(job->pending);
+        job->pending = NULL;
+    }
+    cgi_unwatch(job->sock_fd);
+    cgi_unwatch(job->pipe_fd);
+    job->pipe_fd = -1;
+}
+
+// copy the program's output to the client until either side would block
+static void cgi_pump(cgi_job_t *job) {
+    ssize_t n;
+
+    if (job->pending && job->pipe_fd >= 0) {
+        int rc = conn_flush(job->pending);
+        if (rc == 0)
+            return; // EPOLLOUT brings us back
+        if (rc < 0) {
+            cgi_finish(job);
+            return;
+        }
+        conn_drop(job->pending);
+        job->pending = NULL;
+    }
+
+    while (job->pipe_fd >= 0) {
+        if (job->off == job->len) {
+            n = read(job->pipe_fd, job->buf, CGI_BUF);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return; // EPOLLIN brings us back
+            if (n <= 0) {
+                cgi_finish(job); // end of output
+                return;
+            }
+            job->len = n;
+            job->off = 0;
+        }
+        n = write(job->sock_fd, job->buf + job->off, job->len - job->off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return; // EPOLLOUT brings us back
+        if (n < 0) {
+            cgi_finish(job); // the program gets EPIPE if it writes on
+            return;
+        }
+        job->off += n;
+    }
+}
+
+static void cgi_reap(cgi_job_t *job) {
+    if (waitpid(job->pid, NULL, WNOHANG) != job->pid)
+        return;
+    job->exited = 1;
+    if (job->pidfd >= 0) {
+        cgi_unwatch(job->pidfd);
+        job->pidfd = -1;
+    }
+}
+
+//
+// Kill the programs that ran out of time, reap those that can't be waited
+// for through a pidfd, and free the jobs that are over: program reaped and
+// output done. Called with jobs_lock held.
+//
+static void cgi_expire(time_t now) {
+    cgi_job_t **link = &jobs, *job;
+
+    while ((job = *link) != NULL) {
+        if (!job->exited && job->pidfd < 0)
+            cgi_reap(job);
+        if (now >= job->deadline && !job->killed &&
+            (!job->exited || job->pipe_fd >= 0)) {
+            logMessage("CGI %s killed after %d seconds", job->path, cgi_timeout);
+            kill(-job->pid, SIGKILL);
+            job->killed = 1;
+            if (job->pipe_fd >= 0)
+                cgi_finish(job);
+        }
+        if (job->exited && job->pipe_fd < 0) {
+            *link = job->next;
+            free(job->path);
+            free(job);
+            __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        link = &job->next;
+    }
+}
+
+static void *cgi_thread(void *arg) {
+    struct epoll_event events[CGI_EVENTS];
+
+    while (1) {
+        // wake up at least once a second for the timeouts
+        int n = epoll_wait(epfd, events, CGI_EVENTS, 1000);
+
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < n; i++) {
+            cgi_watch_t *watch = events[i].data.ptr;
+            if (watch->kind == CGI_PIDFD)
+                cgi_reap(watch->job);
+            else
+                cgi_pump(watch->job);
+        }
+        cgi_expire(time(NULL));
+        pthread_mutex_unlock(&jobs_lock);
+    }
+    return NULL;
+}
+
+unsigned long cgi_running(void) {
+    return __atomic_load_n(&running, __ATOMIC_RELAXED);
+}
+
+void cgi_init(void) {
+    sigset_t all, old;
+    pthread_t thread;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    stats_add_gauge("cgi_processes", "CGI programs running", cgi_running);
+
+    // signals are for the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, cgi_thread, NULL) != 0) {
+        perror("Failed to create CGI thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+}
@@ -0,0 +1,49 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include <sys/types.h>
+
+#include "conn.h"
+
+//
+// CGI programs run without holding a worker or an event loop. A program is
+// started with posix_spawn() (no page tables copied) with a pipe as its
+// stdout, and a helper thread copies the pipe to the client socket while
+// it watches the child through a pidfd. Programs still running after
+// cgi_timeout seconds are killed, together with anything they started.
+//
+
+#define CGI_MAX_PROCS (64)
+#define CGI_TIMEOUT (30)
+#define CGI_BUF (16 * 1024)
+
+// settable from the command line
+extern int cgi_max_procs; // programs running at once; more get a 503
+extern int cgi_timeout;   // seconds a program may take
+
+// start the helper thread
+void cgi_init(void);
+
+//
+// posix_spawn() path, with stdin_fd and stdout_fd (-1: the server's) as its
+// stdin and stdout, default signal handling, a process group of its own and
+// none of the server's other descriptors. Returns the pid, or -1 with errno.
+//
+pid_t cgi_spawn(const char *path, char *const envp[], int stdin_fd,
+                int stdout_fd);
+
+//
+// Run the CGI program path for the client on sock_fd, a dup() of conn's
+// socket: output conn still has queued goes out first, then head (the
+// status line and server headers), then everything the program writes,
+// and sock_fd is closed at the end. Returns -1 with errno EAGAIN if
+// cgi_max_procs programs are already running, or with the spawn error;
+// sock_fd and the queued output are then still the caller's.
+//
+int cgi_run(const char *path, const char *query, conn_t *conn, int sock_fd,
+            const char *head, size_t head_len);
+
+// programs running right now
+unsigned long cgi_running(void);
+
+#endif // __CGI_H__
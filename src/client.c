@@ -1,53 +1,690 @@
 // client.c
+//
+// Load generator in the spirit of wrk: a few threads, each driving its
+// share of the connections through its own epoll loop, and a latency
+// histogram per thread merged at the end.
+//
+// Closed loop by default: every connection sends its next request as soon
+// as a response comes back. Such a client waits whenever the server
+// stalls, so it never measures the requests it didn't send meanwhile
+// (coordinated omission); the report corrects for that afterwards by
+// filling in the samples a steady client would have seen. With -R the
+// requests follow a fixed schedule instead and latency is measured from
+// when each one should have been sent, which needs no correction.
 
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> // for close
+#include <strings.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <time.h>
+#include <unistd.h> // for close
 
-#define BUFFER_SIZE 1024
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <Port>\n", argv[0]);
-        return EXIT_FAILURE;
+#define IN_BUF (64 * 1024)
+#define PIPELINE_MAX (64)
+#define URLS_MAX (4096)
+#define EVENTS_MAX (256)
+
+// latency histogram: 8 buckets per power of two microseconds
+#define SUB_BITS (3)
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS (40 * SUB_BUCKETS)
+
+typedef struct {
+    char *request;
+    size_t len;
+    char *url;
+} target_t;
+
+// One connection: requests written but not yet answered are a FIFO of
+// start times, responses are parsed as they stream in
+typedef struct {
+    int fd;
+    int connecting;
+    int polling_out; // EPOLLOUT is in the interest set
+    int outstanding;
+    int served; // responses on this socket
+    unsigned long long start[PIPELINE_MAX];
+    int first; // oldest outstanding request in start[]
+    unsigned long long next_send; // -R: when the next request is due
+    unsigned long next_target;
+
+    char out[PIPELINE_MAX * 256];
+    size_t out_len;
+    size_t out_pos;
+
+    char in[IN_BUF];
+    size_t in_len;
+    int in_body;
+    long long body_left; // -1: until the server closes
+    int status;
+    int server_closes;
+} lconn_t;
+
+typedef struct {
+    pthread_t thread;
+    int nconns;
+    lconn_t *conns;
+    unsigned long long interval; // -R: us between requests per connection
+    unsigned long hist[BUCKETS];
+    unsigned long completed;
+    unsigned long errors;
+    unsigned long bad_status; // not 2xx or 3xx
+    unsigned long long bytes;
+} worker_t;
+
+static struct addrinfo *server;
+static target_t targets[URLS_MAX];
+static int ntargets;
+static int depth = 1;
+static int keep_alive = 1;
+static char headers[1024]; // extra request headers from -H
+static double rate; // total requests per second, 0 = closed loop
+static long limit;  // total requests, 0 = until the duration is up
+static long issued;
+static unsigned long long deadline;
+static volatile int stopping;
+
+static unsigned long long now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int bucket(unsigned long long usec) {
+    int shift, idx;
+
+    if (usec < SUB_BUCKETS)
+        return usec;
+    shift = 63 - __builtin_clzll(usec) - SUB_BITS;
+    idx = (shift + 1) * SUB_BUCKETS + ((usec >> shift) & (SUB_BUCKETS - 1));
+    return idx < BUCKETS ? idx : BUCKETS - 1;
+}
+
+// largest value that falls into bucket idx
+static unsigned long long bucket_value(int idx) {
+    int shift = idx / SUB_BUCKETS - 1;
+
+    if (shift < 0)
+        return idx;
+    return ((unsigned long long)(SUB_BUCKETS + idx % SUB_BUCKETS + 1) << shift) -
+           1;
+}
+
+// http://host[:port]/path, every URL must name the same server
+static int parse_url(const char *url, char *host, char *port, char **path) {
+    const char *p = url, *slash, *colon;
+
+    if (strncmp(p, "http://", 7) == 0)
+        p += 7;
+    slash = strchr(p, '/');
+    if (slash == NULL)
+        slash = p + strlen(p);
+    colon = memchr(p, ':', slash - p);
+    if (colon) {
+        snprintf(host, 256, "%.*s", (int)(colon - p), p);
+        snprintf(port, 16, "%.*s", (int)(slash - colon - 1), colon + 1);
+    } else {
+        snprintf(host, 256, "%.*s", (int)(slash - p), p);
+        strcpy(port, "80");
     }
+    *path = strdup(*slash ? slash : "/");
+    return host[0] != '\0';
+}
 
-    int port = atoi(argv[1]);
+static void add_target(const char *url) {
+    char host[256], port[16], *path;
+    static char first[300];
+    char this[300];
+    target_t *t;
 
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (ntargets == URLS_MAX) {
+        fprintf(stderr, "Error: more than %d URLs\n", URLS_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (!parse_url(url, host, port, &path)) {
+        fprintf(stderr, "Error: bad URL %s\n", url);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(this, sizeof(this), "%s:%s", host, port);
+    if (ntargets == 0) {
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        int err = getaddrinfo(host, port, &hints, &server);
+        if (err != 0) {
+            fprintf(stderr, "Error: %s: %s\n", host, gai_strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        strcpy(first, this);
+    } else if (strcmp(first, this) != 0) {
+        fprintf(stderr, "Error: %s is not on %s\n", url, first);
+        exit(EXIT_FAILURE);
+    }
+
+    t = &targets[ntargets++];
+    t->url = strdup(url);
+    t->len = asprintf(&t->request,
+                      "GET %s HTTP/1.1\r\n"
+                      "Host: %s\r\n"
+                      "%s%s\r\n",
+                      path, this, headers,
+                      keep_alive ? "" : "Connection: close\r\n");
+    if (t->len + 1 > sizeof(((lconn_t *)0)->out) / PIPELINE_MAX) {
+        fprintf(stderr, "Error: URL too long: %s\n", url);
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+}
+
+static void add_targets_from(const char *file) {
+    char line[2048];
+    FILE *f = fopen(file, "r");
+
+    if (f == NULL) {
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#')
+            add_target(line);
+    }
+    fclose(f);
+}
+
+static void conn_open(int epfd, lconn_t *c) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    int one = 1;
+
+    c->fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, server->ai_addr, server->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    c->connecting = 1;
+    c->polling_out = 1;
+    c->outstanding = 0;
+    c->served = 0;
+    c->first = 0;
+    c->out_len = c->out_pos = 0;
+    c->in_len = 0;
+    c->in_body = 0;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+//
+// Replace the socket. Requests it still owed us count as failed, unless
+// the server announced the close: then they were never going to be
+// answered and are simply issued again.
+//
+static void conn_reopen(int epfd, worker_t *w, lconn_t *c, int failed) {
+    if (failed)
+        w->errors += c->outstanding;
+    else if (limit)
+        __atomic_sub_fetch(&issued, c->outstanding, __ATOMIC_RELAXED);
+    close(c->fd);
+    conn_open(epfd, c);
+}
+
+static int take_request(void) {
+    if (stopping)
+        return 0;
+    return limit == 0 || __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED) < limit;
+}
+
+// queue as many requests as the pipeline depth (and the schedule) allow
+static void conn_fill(worker_t *w, lconn_t *c, unsigned long long now) {
+    int max = keep_alive ? depth : 1;
 
-    int client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        fprintf(stderr, "Error: Unable to create socket\n");
-        return EXIT_FAILURE;
+    if (!keep_alive && c->served > 0)
+        return; // the server closes this one, we open the next
+    while (c->outstanding < max) {
+        if (w->interval && now < c->next_send)
+            break;
+        if (!take_request()) {
+            if (limit)
+                stopping = 1;
+            break;
+        }
+        target_t *t = &targets[c->next_target++ % ntargets];
+        if (c->out_pos == c->out_len)
+            c->out_pos = c->out_len = 0;
+        memcpy(c->out + c->out_len, t->request, t->len);
+        c->out_len += t->len;
+        // a scheduled request is late from the moment it was due
+        c->start[(c->first + c->outstanding) % PIPELINE_MAX] =
+            w->interval ? c->next_send : now;
+        c->outstanding++;
+        c->next_send += w->interval;
     }
+}
 
-    if (connect(client_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        fprintf(stderr, "Error: Connection failed\n");
-        return EXIT_FAILURE;
+// write what is queued; EPOLLOUT is only asked for while some is left
+static int conn_send(int epfd, lconn_t *c) {
+    int pending;
+
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                return -1;
+            break;
+        }
+        c->out_pos += n;
+    }
+    pending = c->out_pos < c->out_len;
+    if (pending != c->polling_out) {
+        struct epoll_event ev = {.events = EPOLLIN | (pending ? EPOLLOUT : 0),
+                                 .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->polling_out = pending;
+    }
+    return 0;
+}
+
+static void record(worker_t *w, lconn_t *c, unsigned long long now) {
+    unsigned long long start = c->start[c->first];
+
+    c->first = (c->first + 1) % PIPELINE_MAX;
+    c->outstanding--;
+    c->served++;
+    w->completed++;
+    if (c->status < 200 || c->status >= 400)
+        w->bad_status++;
+    w->hist[bucket(now > start ? now - start : 0)]++;
+}
+
+//
+// Consume responses from the input buffer. Returns 1 when the socket has
+// to be replaced (the server said it closes it), 0 to go on.
+//
+static int conn_parse(worker_t *w, lconn_t *c, unsigned long long now) {
+    size_t pos = 0;
+    int reopen = 0;
+
+    while (pos < c->in_len && !reopen) {
+        if (!c->in_body) {
+            char *end = memmem(c->in + pos, c->in_len - pos, "\r\n\r\n", 4);
+            char *cl;
+            if (end == NULL)
+                break;
+            *end = '\0';
+            c->status = 0;
+            sscanf(c->in + pos, "HTTP/%*s %d", &c->status);
+            cl = strcasestr(c->in + pos, "\r\nContent-Length:");
+            c->body_left = cl ? atoll(cl + 17) : -1;
+            if (c->status == 204 || c->status == 304)
+                c->body_left = 0;
+            c->server_closes = strcasestr(c->in + pos, "\r\nConnection: close") != NULL;
+            c->in_body = 1;
+            pos = end + 4 - c->in;
+        }
+        if (c->body_left < 0) {
+            pos = c->in_len; // ends when the server closes
+            break;
+        }
+        size_t take = c->in_len - pos < (size_t)c->body_left ? c->in_len - pos
+                                                             : c->body_left;
+        pos += take;
+        c->body_left -= take;
+        if (c->body_left == 0) {
+            c->in_body = 0;
+            record(w, c, now);
+            reopen = c->server_closes || !keep_alive;
+        }
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    if (c->in_len == IN_BUF && !c->in_body)
+        return -1; // header block larger than the buffer
+    return reopen;
+}
+
+static void conn_event(int epfd, worker_t *w, lconn_t *c, uint32_t events,
+                       unsigned long long now) {
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            w->errors++;
+            if (err == ECONNREFUSED)
+                usleep(10000); // don't spin on a server that isn't there
+            conn_reopen(epfd, w, c, 1);
+            return;
+        }
+        c->connecting = 0;
+        c->next_send = c->next_send > now ? c->next_send : now;
+    }
+
+    if (events & EPOLLIN) {
+        ssize_t n;
+        while ((n = recv(c->fd, c->in + c->in_len, IN_BUF - c->in_len, 0)) > 0) {
+            int rc;
+            w->bytes += n;
+            c->in_len += n;
+            rc = conn_parse(w, c, now);
+            if (rc != 0) {
+                if (rc < 0)
+                    w->errors++;
+                conn_reopen(epfd, w, c, rc < 0);
+                return;
+            }
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+            // a body that runs until the server closes is complete now
+            if (c->in_body && c->body_left < 0 && c->outstanding > 0) {
+                c->in_body = 0;
+                record(w, c, now);
+            } else if (n < 0 || c->outstanding > 0) {
+                w->errors++;
+            }
+            conn_reopen(epfd, w, c, 1);
+            return;
+        }
+    }
+
+    conn_fill(w, c, now);
+    if (conn_send(epfd, c) < 0) {
+        w->errors++;
+        conn_reopen(epfd, w, c, 1);
+    }
+}
+
+static int epoll_wait_us(int epfd, struct epoll_event *events,
+                         unsigned long long usec) {
+    struct timespec ts = {usec / 1000000, usec % 1000000 * 1000};
+    static int no_pwait2;
+    int n;
+
+    if (!no_pwait2) {
+        n = epoll_pwait2(epfd, events, EVENTS_MAX, &ts, NULL);
+        if (n >= 0 || errno != ENOSYS)
+            return n;
+        no_pwait2 = 1; // before Linux 5.11: millisecond timeouts only
+    }
+    return epoll_wait(epfd, events, EVENTS_MAX, (usec + 999) / 1000);
+}
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[EVENTS_MAX];
+    int epfd = epoll_create1(0);
+    unsigned long long now = now_us();
+
+    for (int i = 0; i < w->nconns; i++) {
+        // spread the schedules over one interval, not all at once
+        w->conns[i].next_send = now + w->interval * i / w->nconns;
+        w->conns[i].next_target = i;
+        conn_open(epfd, &w->conns[i]);
+    }
+
+    while (1) {
+        unsigned long long wake;
+        int n;
+
+        now = now_us();
+        if (now >= deadline)
+            stopping = 1;
+        if (stopping) {
+            int busy = 0;
+            for (int i = 0; i < w->nconns; i++)
+                busy |= w->conns[i].outstanding > 0;
+            if (!busy || now >= deadline)
+                break;
+        }
+        // sleep until the next scheduled request is due, to the microsecond
+        wake = now + 100000;
+        for (int i = 0; w->interval && i < w->nconns; i++) {
+            if (w->conns[i].next_send < wake)
+                wake = w->conns[i].next_send;
+        }
+        wake = wake > now ? wake - now : 0;
+        n = epoll_wait_us(epfd, events, wake);
+        now = now_us();
+        for (int i = 0; i < n; i++)
+            conn_event(epfd, w, events[i].data.ptr, events[i].events, now);
+
+        // scheduled requests fall due without any socket event
+        if (w->interval) {
+            for (int i = 0; i < w->nconns; i++) {
+                lconn_t *c = &w->conns[i];
+                if (!c->connecting && now >= c->next_send) {
+                    conn_fill(w, c, now);
+                    if (conn_send(epfd, c) < 0) {
+                        w->errors++;
+                        conn_reopen(epfd, w, c, 1);
+                    }
+                }
+            }
+        }
+    }
+    for (int i = 0; i < w->nconns; i++)
+        close(w->conns[i].fd);
+    close(epfd);
+    return NULL;
+}
+
+static unsigned long long percentile(unsigned long *hist, double fraction) {
+    unsigned long count = 0, seen = 0, rank;
+
+    for (int i = 0; i < BUCKETS; i++)
+        count += hist[i];
+    if (count == 0)
+        return 0;
+    rank = (unsigned long)(count * fraction);
+    if (rank >= count)
+        rank = count - 1;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            return bucket_value(i);
+    }
+    return 0;
+}
+
+//
+// What a client sending every `interval` us would have seen: a response
+// that took v means the requests due at v - interval, v - 2 * interval, ...
+// waited too, each that much less. This is HdrHistogram's correction.
+//
+static void correct(unsigned long *hist, unsigned long *out,
+                    unsigned long long interval) {
+    memcpy(out, hist, BUCKETS * sizeof(unsigned long));
+    if (interval == 0)
+        return;
+    for (int i = 0; i < BUCKETS; i++) {
+        if (hist[i] == 0)
+            continue;
+        for (long long missing = (long long)bucket_value(i) - interval;
+             missing >= (long long)interval; missing -= interval)
+            out[bucket(missing)] += hist[i];
+    }
+}
+
+static void print_latency(const char *label, unsigned long *hist, int json) {
+    static const double points[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    static const char *names[] = {"p50", "p90", "p99", "p999", "max"};
+
+    if (json) {
+        printf("\"%s\": {", label);
+        for (int i = 0; i < 5; i++)
+            printf("%s\"%s\": %llu", i ? ", " : "", names[i],
+                   percentile(hist, points[i]));
+        printf("}");
+        return;
+    }
+    printf("  %-10s", label);
+    for (int i = 0; i < 5; i++) {
+        unsigned long long us = percentile(hist, points[i]);
+        if (us >= 10000)
+            printf(" %8.2fms", us / 1000.0);
+        else
+            printf(" %8lluus", us);
+    }
+    printf("\n");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-c connections] [-d seconds | -n requests]\n"
+            "       [-p pipeline] [-R rate] [-K] [-j] [-H header] [-f url_file] <url>...\n",
+            prog);
+    fprintf(stderr,
+            "  threads: Threads driving the connections (default: 2)\n"
+            "  connections: Connections kept open (default: 10)\n"
+            "  seconds: How long to run (default: 10)\n"
+            "  requests: Stop after this many requests instead\n"
+            "  pipeline: Requests in flight per connection (default: 1)\n"
+            "  rate: Requests per second over all connections, sent on a fixed\n"
+            "        schedule (default: as fast as responses come back)\n"
+            "  -K: a new connection for every request\n"
+            "  -j: print the results as one line of JSON\n"
+            "  header: Extra request header, e.g. -H 'Accept-Encoding: gzip'\n"
+            "  url_file: URLs to request, one per line, taken in turn\n"
+            "  url: http://host:port/path, or just a port for http://127.0.0.1:port/\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 2, connections = 10, json = 0, c;
+    double duration = 10;
+    char *url_file = NULL;
+    worker_t *workers;
+    unsigned long hist[BUCKETS] = {0}, fixed[BUCKETS];
+    unsigned long completed = 0, errors = 0, bad_status = 0, samples = 0;
+    unsigned long long bytes = 0, sum = 0, start, elapsed;
+
+    while ((c = getopt(argc, argv, "c:d:f:H:jKn:p:R:t:")) != -1)
+        switch (c) {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'f':
+            url_file = optarg;
+            break;
+        case 'H':
+            if (strlen(headers) + strlen(optarg) + 3 > sizeof(headers))
+                usage(argv[0]);
+            strcat(headers, optarg);
+            strcat(headers, "\r\n");
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'K':
+            keep_alive = 0;
+            break;
+        case 'n':
+            limit = atol(optarg);
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+
+    if (url_file)
+        add_targets_from(url_file);
+    for (int i = optind; i < argc; i++) {
+        char url[64];
+        if (strspn(argv[i], "0123456789") == strlen(argv[i])) {
+            snprintf(url, sizeof(url), "http://127.0.0.1:%s/", argv[i]);
+            add_target(url);
+        } else {
+            add_target(argv[i]);
+        }
+    }
+    if (ntargets == 0 || threads < 1 || connections < threads || depth < 1 ||
+        depth > PIPELINE_MAX)
+        usage(argv[0]);
+
+    workers = calloc(threads, sizeof(worker_t));
+    start = now_us();
+    deadline = limit ? (unsigned long long)-1 : start + duration * 1e6;
+    for (int i = 0; i < threads; i++) {
+        worker_t *w = &workers[i];
+        w->nconns = connections / threads + (i < connections % threads);
+        w->conns = calloc(w->nconns, sizeof(lconn_t));
+        if (rate > 0)
+            w->interval = 1e6 * connections / rate;
+        if (w->conns == NULL || pthread_create(&w->thread, NULL, worker, w) != 0) {
+            perror("Failed to start worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        for (int b = 0; b < BUCKETS; b++)
+            hist[b] += w->hist[b];
+        completed += w->completed;
+        errors += w->errors;
+        bad_status += w->bad_status;
+        bytes += w->bytes;
     }
+    elapsed = now_us() - start;
 
-    char request[BUFFER_SIZE];
-    snprintf(request, BUFFER_SIZE, "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n");
-    if (send(client_socket, request, strnlen(request, BUFFER_SIZE), 0) < 0) {
-        fprintf(stderr, "Error: Unable to send request\n");
-        return EXIT_FAILURE;
+    // closed loop: a steady client would have sent about once per mean
+    // response time, which is the interval the correction assumes
+    for (int b = 0; b < BUCKETS; b++) {
+        samples += hist[b];
+        sum += hist[b] * bucket_value(b);
     }
+    correct(hist, fixed, rate > 0 || samples == 0 ? 0 : sum / samples);
 
-    char response[BUFFER_SIZE];
-    int bytes_received;
-    while ((bytes_received = recv(client_socket, response, BUFFER_SIZE - 1, 0)) > 0) {
-        response[bytes_received] = '\0';
-        printf("%s", response);
+    if (json) {
+        printf("{\"requests\": %lu, \"seconds\": %.3f, \"rps\": %.1f, "
+               "\"mb_per_sec\": %.2f, \"errors\": %lu, \"non_2xx_3xx\": %lu, ",
+               completed, elapsed / 1e6, completed * 1e6 / elapsed,
+               bytes / (elapsed / 1e6) / 1e6, errors, bad_status);
+        print_latency("latency_us", hist, 1);
+        printf(", ");
+        print_latency("corrected_us", fixed, 1);
+        printf("}\n");
+        return EXIT_SUCCESS;
     }
 
-    close(client_socket);
+    printf("%s test @ %s%s\n", limit ? "Request-limited" : "Timed",
+           targets[0].url, ntargets > 1 ? " (and more)" : "");
+    printf("  %d threads and %d connections, pipeline %d%s\n", threads,
+           connections, depth, keep_alive ? "" : ", no keep-alive");
+    if (rate > 0)
+        printf("  fixed rate of %.0f requests/sec\n", rate);
+    printf("  %lu requests in %.2fs, %.2f MB read\n", completed, elapsed / 1e6,
+           bytes / 1e6);
+    if (errors || bad_status)
+        printf("  errors: %lu, non-2xx/3xx responses: %lu\n", errors, bad_status);
+    printf("Requests/sec: %10.2f\n", completed * 1e6 / elapsed);
+    printf("Transfer/sec: %10.2f MB\n", bytes / (elapsed / 1e6) / 1e6);
+    printf("Latency       %10s %10s %10s %10s %10s\n", "p50", "p90", "p99",
+           "p99.9", "max");
+    print_latency(rate > 0 ? "scheduled" : "measured", hist, 0);
+    if (rate == 0)
+        print_latency("corrected", fixed, 0);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,574 @@
+#include <stdarg.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include "admit.h"
+#include "conn.h"
+#include "io_helper.h"
+#include "scan.h"
+#include "stats.h"
+
+//
+// Per-connection buffering shared by the thread pool and the event loop.
+// Requests are parsed out of conn->in, responses are queued as chunks and
+// pushed out by conn_flush(), which works on blocking and non-blocking
+// sockets alike.
+//
+
+int conn_max_requests = CONN_MAX_REQUESTS;
+int conn_idle_timeout = CONN_IDLE_TIMEOUT;
+
+static void conn_init(conn_t *conn, int fd) {
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->http11 = 0;
+    conn->keep_alive = 0;
+    conn->requests = 0;
+    conn->status = 0;
+    conn->shared = 0;
+    conn->evented = 0;
+    conn->out_total = 0;
+    conn->peer[0] = '\0';
+    conn->client = NULL;
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->last_active = 0;
+    conn->in_start = 0;
+    conn->in_len = 0;
+    conn->arena = NULL;
+    conn->arena_used = 0;
+    conn->scan_pos = 0;
+    conn->hdr_end = 0;
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_cap = 0;
+    conn->chunks = NULL;
+    conn->nchunks = 0;
+    conn->chunk_cap = 0;
+    conn->chunk_pos = 0;
+    conn->chunk_sent = 0;
+    conn->use_splice = 0;
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    conn->pipe_len = 0;
+    conn->ring_ops = 0;
+    conn->ring_flags = 0;
+    conn->backlog = NULL;
+    conn->backlog_len = 0;
+    conn->ring_msg = NULL;
+}
+
+conn_t *conn_new(int fd) {
+    conn_t *conn = malloc_or_die(sizeof(conn_t));
+
+    conn_init(conn, fd);
+    stats_add(STAT_CONNECTIONS, 1);
+    return conn;
+}
+
+// let go of whatever backs a chunk once it is sent (or abandoned)
+static void conn_release_chunk(conn_chunk_t *chunk) {
+    if (chunk->release) {
+        chunk->release(chunk->release_arg);
+    } else if (chunk->map) {
+        munmap_or_die(chunk->map, chunk->len);
+    } else if (chunk->file_fd >= 0) {
+        close(chunk->file_fd);
+    }
+}
+
+// let go of the output queue, sent or not
+static void conn_free_output(conn_t *conn) {
+    for (int i = conn->chunk_pos; i < conn->nchunks; i++)
+        conn_release_chunk(&conn->chunks[i]);
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    free(conn->out);
+    free(conn->chunks);
+}
+
+void conn_free(conn_t *conn) {
+    conn_free_output(conn);
+    close(conn->fd);
+    admit_release(conn);
+    stats_add(STAT_CONNECTIONS_CLOSED, 1);
+    free(conn->backlog);
+    free(conn->arena);
+    free(conn->ring_msg);
+    free(conn);
+}
+
+// the client's address as text, for the access log
+const char *conn_peer(conn_t *conn) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (conn->peer[0] != '\0')
+        return conn->peer;
+    if (getpeername(conn->fd, (struct sockaddr *)&addr, &len) < 0) {
+        strcpy(conn->peer, "-");
+    } else if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr,
+                  conn->peer, sizeof(conn->peer));
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr,
+                  conn->peer, sizeof(conn->peer));
+    }
+    return conn->peer;
+}
+
+//
+// Move past the request just handled, keeping whatever the client already
+// sent after it. Calling it again before the next request is complete is
+// a no-op.
+//
+void conn_next_request(conn_t *conn) {
+    conn->arena_used = 0;
+    if (conn->hdr_end == 0)
+        return;
+    conn->in_start = conn->scan_pos = conn->hdr_end;
+    conn->hdr_end = 0;
+    if (conn->in_start == conn->in_len)
+        conn->in_start = conn->scan_pos = conn->in_len = 0;
+}
+
+//
+// size bytes of scratch that last until the next request, so handling a
+// request needs neither big stack buffers nor free(). The arena is
+// allocated on the first request that uses it; NULL when it is full.
+//
+void *conn_alloc(conn_t *conn, size_t size) {
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > CONN_ARENA - conn->arena_used)
+        return NULL;
+    if (conn->arena == NULL)
+        conn->arena = malloc_or_die(CONN_ARENA);
+    p = conn->arena + conn->arena_used;
+    conn->arena_used += size;
+    return p;
+}
+
+void conn_count_request(conn_t *conn) {
+    conn->requests++;
+    stats_add(STAT_REQUESTS, 1);
+}
+
+// How well keep-alive is working: requests per connection and the share
+// of requests that did not need a new TCP handshake
+void conn_report_stats(void) {
+    unsigned long conns = stats_sum(STAT_CONNECTIONS);
+    unsigned long reqs = stats_sum(STAT_REQUESTS);
+
+    if (conns == 0 || reqs == 0)
+        return;
+    printf("Keep-alive: %lu requests on %lu connections "
+           "(%.2f requests/connection, %.1f%% on reused connections)\n",
+           reqs, conns, (double)reqs / conns,
+           reqs > conns ? 100.0 * (reqs - conns) / reqs : 0.0);
+}
+
+// connections accepted and not yet closed
+unsigned long conn_open_count(void) {
+    return stats_sum(STAT_CONNECTIONS) - stats_sum(STAT_CONNECTIONS_CLOSED);
+}
+
+void conn_idle_remove(conn_idle_t *idle, conn_t *conn) {
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        idle->head = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    else
+        idle->tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+// mark a connection as active now by moving it to the tail
+void conn_idle_touch(conn_idle_t *idle, conn_t *conn, time_t now) {
+    conn->last_active = now;
+    if (idle->tail == conn)
+        return;
+    if (conn->prev || conn->next || idle->head == conn)
+        conn_idle_remove(idle, conn);
+    conn->prev = idle->tail;
+    conn->next = NULL;
+    if (idle->tail)
+        idle->tail->next = conn;
+    else
+        idle->head = conn;
+    idle->tail = conn;
+}
+
+// free space at the end of the input buffer, made by sliding a partial
+// request to the front if the buffer is full
+static size_t conn_room(conn_t *conn) {
+    if (conn->in_len >= CONN_INBUF && conn->in_start > 0) {
+        memmove(conn->in, conn->in + conn->in_start,
+                conn->in_len - conn->in_start);
+        conn->in_len -= conn->in_start;
+        conn->scan_pos -= conn->in_start;
+        conn->in_start = 0;
+    }
+    return CONN_INBUF - conn->in_len;
+}
+
+//
+// Receive whatever is available into the input buffer.
+// Returns bytes read, 0 on EOF, -1 on error (errno set, EAGAIN included)
+//
+ssize_t conn_fill(conn_t *conn) {
+    size_t room = conn_room(conn);
+    ssize_t n;
+
+    if (room == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    n = recv(conn->fd, conn->in + conn->in_len, room, 0);
+    if (n > 0)
+        conn->in_len += n;
+    return n;
+}
+
+// Take received bytes from elsewhere (io_uring's buffers); returns how
+// many fit
+size_t conn_append(conn_t *conn, const char *buf, size_t len) {
+    size_t room = conn_room(conn);
+
+    if (len > room)
+        len = room;
+    memcpy(conn->in + conn->in_len, buf, len);
+    conn->in_len += len;
+    return len;
+}
+
+//
+// Return 1 once a complete header block is buffered, 0 if more input is
+// needed, -1 if the buffer is full and still holds no complete request.
+// Each call only scans the bytes that arrived since the previous one (plus
+// 2 bytes of overlap, in case the terminator straddles two reads).
+//
+int conn_request_ready(conn_t *conn) {
+    size_t from, end;
+
+    if (conn->hdr_end)
+        return 1;
+    from = conn->scan_pos > conn->in_start + 2 ? conn->scan_pos - 2
+                                                : conn->in_start;
+    end = scan_header_end(conn->in, conn->in_len, from);
+    if (end) {
+        conn->hdr_end = end;
+        return 1;
+    }
+    conn->scan_pos = conn->in_len;
+    return conn->in_start == 0 && conn->in_len >= CONN_INBUF ? -1 : 0;
+}
+
+//
+// Blocking variant: keep reading until a request is buffered.
+// Returns 1 when ready, 0 if the client went away, -1 if too large
+//
+int conn_read_request(conn_t *conn) {
+    int ready;
+
+    while ((ready = conn_request_ready(conn)) == 0) {
+        ssize_t n = conn_fill(conn);
+        if (n == 0)
+            return 0;
+        if (n < 0 && errno != EINTR)
+            return 0;
+    }
+    return ready;
+}
+
+static conn_chunk_t *conn_add_chunk(conn_t *conn) {
+    if (conn->nchunks == conn->chunk_cap) {
+        conn->chunk_cap = conn->chunk_cap ? conn->chunk_cap * 2 : 4;
+        conn->chunks = realloc_or_die(conn->chunks,
+                                      conn->chunk_cap * sizeof(conn_chunk_t));
+    }
+    conn->chunks[conn->nchunks].release = NULL;
+    return &conn->chunks[conn->nchunks++];
+}
+
+static void conn_reserve(conn_t *conn, size_t len) {
+    if (conn->out_len + len <= conn->out_cap)
+        return;
+    while (conn->out_len + len > conn->out_cap)
+        conn->out_cap = conn->out_cap ? conn->out_cap * 2 : 1024;
+    conn->out = realloc_or_die(conn->out, conn->out_cap);
+}
+
+// grow the last chunk if it is already buffered bytes, else start a new one
+static void conn_extend(conn_t *conn, size_t len) {
+    conn_chunk_t *last = conn->nchunks > conn->chunk_pos
+                             ? &conn->chunks[conn->nchunks - 1]
+                             : NULL;
+    if (last && last->map == NULL && last->file_fd < 0 &&
+        last->off + last->len == conn->out_len) {
+        last->len += len;
+    } else {
+        conn_chunk_t *chunk = conn_add_chunk(conn);
+        chunk->off = conn->out_len;
+        chunk->map = NULL;
+        chunk->file_fd = -1;
+        chunk->len = len;
+    }
+    conn->out_len += len;
+    conn->out_total += len;
+}
+
+void conn_write(conn_t *conn, const void *buf, size_t len) {
+    conn_reserve(conn, len);
+    memcpy(conn->out + conn->out_len, buf, len);
+    conn_extend(conn, len);
+}
+
+void conn_printf(conn_t *conn, const char *format, ...) {
+    va_list arg;
+    int len;
+
+    va_start(arg, format);
+    len = vsnprintf(NULL, 0, format, arg);
+    va_end(arg);
+    assert(len >= 0);
+
+    conn_reserve(conn, len + 1);
+    va_start(arg, format);
+    vsnprintf(conn->out + conn->out_len, len + 1, format, arg);
+    va_end(arg);
+    conn_extend(conn, len);
+}
+
+// queue a memory-mapped body; the connection owns (and unmaps) it from now on
+void conn_write_map(conn_t *conn, char *map, size_t len) {
+    conn_chunk_t *chunk = conn_add_chunk(conn);
+    chunk->off = 0;
+    chunk->map = map;
+    chunk->file_fd = -1;
+    chunk->len = len;
+    conn->out_total += len;
+}
+
+// queue a buffer someone else owns, sent in place; release(arg) once sent
+void conn_write_buf(conn_t *conn, const char *buf, size_t len,
+                    conn_release_t release, void *arg) {
+    conn_chunk_t *chunk = conn_add_chunk(conn);
+    chunk->off = 0;
+    chunk->map = (char *)buf;
+    chunk->file_fd = -1;
+    chunk->len = len;
+    chunk->release = release;
+    chunk->release_arg = arg;
+    conn->out_total += len;
+}
+
+//
+// queue len bytes of an open file from off. Once sent the connection calls
+// release(arg), or closes fd itself when release is NULL
+//
+void conn_write_file(conn_t *conn, int fd, off_t off, size_t len,
+                     conn_release_t release, void *arg) {
+    conn_chunk_t *chunk = conn_add_chunk(conn);
+    chunk->off = 0;
+    chunk->map = NULL;
+    chunk->file_fd = fd;
+    chunk->file_off = off;
+    chunk->len = len;
+    chunk->release = release;
+    chunk->release_arg = arg;
+    conn->out_total += len;
+}
+
+//
+// Move file bytes to the socket through a pipe, for files sendfile()
+// refuses. The pipe may hold bytes the socket wasn't ready for; those go
+// out first next time. Returns bytes delivered to the socket, like send()
+//
+static ssize_t conn_splice(conn_t *conn, conn_chunk_t *chunk) {
+    size_t want;
+    ssize_t n;
+
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+
+    // top the pipe up from the file
+    want = chunk->len - conn->chunk_sent - conn->pipe_len;
+    if (want > 0) {
+        loff_t off = chunk->file_off + conn->chunk_sent + conn->pipe_len;
+        n = splice(chunk->file_fd, &off, conn->pipefd[1], NULL, want,
+                   SPLICE_F_MOVE);
+        if (n > 0)
+            conn->pipe_len += n;
+        else if (n == 0 && conn->pipe_len == 0)
+            return 0; // the file shrank underneath us
+        else if (n < 0 && errno != EAGAIN)
+            return -1;
+    }
+
+    // and drain it into the socket, which decides whether this blocks
+    n = splice(conn->pipefd[0], NULL, conn->fd, NULL, conn->pipe_len,
+               SPLICE_F_MOVE);
+    if (n > 0)
+        conn->pipe_len -= n;
+    return n;
+}
+
+//
+// Send the rest of a file chunk without copying it through user space.
+// Returns 1 when done, 0 if the socket is full, -1 on error
+//
+static int conn_send_file(conn_t *conn, conn_chunk_t *chunk) {
+    while (conn->chunk_sent < chunk->len) {
+        ssize_t n;
+
+        if (!conn->use_splice) {
+            off_t off = chunk->file_off + conn->chunk_sent;
+            n = sendfile(conn->fd, chunk->file_fd, &off,
+                         chunk->len - conn->chunk_sent);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                conn->use_splice = 1;
+                continue;
+            }
+        } else {
+            n = conn_splice(conn, chunk);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+            return -1; // file got shorter than the Content-Length we sent
+        conn->chunk_sent += n;
+    }
+    return 1;
+}
+
+//
+// Point iov at the unsent output, up to max chunks and stopping at the
+// next file chunk. Returns the number of iovecs, 0 if a file chunk is next
+//
+int conn_gather(conn_t *conn, struct iovec *iov, int max) {
+    int cnt = 0;
+
+    for (int i = conn->chunk_pos; i < conn->nchunks && cnt < max; i++) {
+        conn_chunk_t *chunk = &conn->chunks[i];
+        size_t skip = i == conn->chunk_pos ? conn->chunk_sent : 0;
+        if (chunk->file_fd >= 0)
+            break;
+        char *base = chunk->map ? chunk->map : conn->out + chunk->off;
+        iov[cnt].iov_base = base + skip;
+        iov[cnt].iov_len = chunk->len - skip;
+        cnt++;
+    }
+    return cnt;
+}
+
+//
+// Retire n sent bytes: every chunk that went out, the last one maybe
+// partially. Once nothing is left the output buffers are recycled
+//
+void conn_sent(conn_t *conn, size_t n) {
+    while (conn->chunk_pos < conn->nchunks) {
+        conn_chunk_t *chunk = &conn->chunks[conn->chunk_pos];
+        size_t left = chunk->len - conn->chunk_sent;
+        if (n < left) {
+            conn->chunk_sent += n;
+            return;
+        }
+        n -= left;
+        conn_release_chunk(chunk);
+        conn->chunk_pos++;
+        conn->chunk_sent = 0;
+    }
+    conn->nchunks = 0;
+    conn->chunk_pos = 0;
+    conn->out_len = 0;
+}
+
+//
+// Send queued output until it is all gone or the socket would block,
+// gathering up to CONN_IOV chunks (the responses to a whole batch of
+// pipelined requests) into each writev().
+// Returns 1 when everything was sent, 0 if the socket is full (EAGAIN),
+// -1 on error (e.g. the client went away)
+//
+int conn_flush(conn_t *conn) {
+    while (conn->chunk_pos < conn->nchunks) {
+        struct iovec iov[CONN_IOV];
+        int cnt;
+
+        // file chunks don't fit in an iovec, they go on their own
+        if (conn->chunks[conn->chunk_pos].file_fd >= 0) {
+            int rc = conn_send_file(conn, &conn->chunks[conn->chunk_pos]);
+            if (rc <= 0)
+                return rc;
+            conn_sent(conn, 0); // chunk_sent has reached its length
+            continue;
+        }
+
+        cnt = conn_gather(conn, iov, CONN_IOV);
+        ssize_t n = writev(conn->fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        conn_sent(conn, n);
+    }
+
+    // all sent, recycle the output buffers
+    conn->nchunks = 0;
+    conn->chunk_pos = 0;
+    conn->out_len = 0;
+    return 1;
+}
+
+//
+// Move the unsent output (responses pipelined ahead of a CGI or FastCGI
+// request) to a bare connection on fd, a dup() of the socket, for a helper
+// thread to send with conn_flush(). conn is left with nothing queued.
+//
+conn_t *conn_hand_over(conn_t *conn, int fd) {
+    conn_t *rest = malloc_or_die(sizeof(conn_t));
+
+    conn_init(rest, fd);
+    rest->http11 = conn->http11;
+    rest->out = conn->out;
+    rest->out_len = conn->out_len;
+    rest->out_cap = conn->out_cap;
+    rest->chunks = conn->chunks;
+    rest->nchunks = conn->nchunks;
+    rest->chunk_cap = conn->chunk_cap;
+    rest->chunk_pos = conn->chunk_pos;
+    rest->chunk_sent = conn->chunk_sent;
+    rest->use_splice = conn->use_splice;
+    rest->pipefd[0] = conn->pipefd[0];
+    rest->pipefd[1] = conn->pipefd[1];
+    rest->pipe_len = conn->pipe_len;
+
+    conn->out = NULL;
+    conn->out_len = conn->out_cap = 0;
+    conn->chunks = NULL;
+    conn->nchunks = conn->chunk_cap = conn->chunk_pos = 0;
+    conn->chunk_sent = 0;
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    conn->pipe_len = 0;
+    return rest;
+}
+
+// free a connection from conn_hand_over(); its socket stays open
+void conn_drop(conn_t *rest) {
+    conn_free_output(rest);
+    free(rest);
+}
@@ -0,0 +1,154 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// largest request header block we are willing to buffer
+#define CONN_INBUF (8192)
+
+// iovecs handed to a single writev() by conn_flush()
+#define CONN_IOV (64)
+
+// per-request scratch space (conn_alloc()); a path longer than this can't
+// name a file anyway (PATH_MAX)
+#define CONN_ARENA (4096 + 256)
+
+// keep-alive defaults
+#define CONN_MAX_REQUESTS (100)
+#define CONN_IDLE_TIMEOUT (5) // seconds
+
+// Where a connection is in its life; the event loop drives these,
+// blocking workers simply run them in order.
+enum ConnState {
+    CONN_READING, // waiting for a complete request header block
+    CONN_WRITING, // response queued, waiting for the socket to drain
+};
+
+// A piece of queued output: bytes copied into conn->out, a memory-mapped
+// file body, or a range of an open file that goes out with sendfile()
+// (splice() where sendfile can't). Once sent, the chunk's release callback
+// runs if it has one (for buffers and descriptors the connection borrowed);
+// otherwise the mapping is unmapped or the descriptor closed.
+typedef void (*conn_release_t)(void *arg);
+
+typedef struct {
+    size_t off;     // offset into conn->out (when map == NULL, file_fd < 0)
+    char *map;      // mmap'd file body or borrowed buffer
+    int file_fd;    // file body sent from the page cache
+    off_t file_off; // where in the file the range starts
+    size_t len;
+    conn_release_t release; // owner of map/file_fd, if not the connection
+    void *release_arg;
+} conn_chunk_t;
+
+typedef struct conn {
+    int fd;
+    int state;
+
+    // per-request protocol state, set by handle_request()
+    int http11;     // client spoke HTTP/1.1 (or later)
+    int keep_alive; // keep the connection open after this response
+    int requests;   // requests served on this connection so far
+    int status;     // status code of the response being queued
+    int shared;     // the socket was dup()ed for a CGI program
+    int evented;    // owned by an event loop thread, which must not block
+
+    // for the access log: queued response bytes since the connection
+    // opened, and the client's address, looked up on first use
+    unsigned long long out_total;
+    char peer[48];
+    void *client; // admit.c's entry for the peer, NULL without limits
+
+    // event loop bookkeeping: idle list links and last activity
+    struct conn *prev;
+    struct conn *next;
+    time_t last_active;
+
+    // input: in[in_start..in_len) holds received bytes not yet consumed,
+    // the current request's header block is in[in_start..hdr_end) once it
+    // is complete; pipelined requests simply follow it in the buffer
+    char in[CONN_INBUF + 1];
+    size_t in_start;
+    size_t in_len;
+    size_t scan_pos; // bytes before this were already searched for the end
+    size_t hdr_end;  // 0 while the header block is incomplete
+
+    // scratch for the request being handled: arena[0..arena_used) is
+    // taken, and it is all free again once the next request starts
+    char *arena;
+    size_t arena_used;
+
+    // output: chunks are sent in order, chunks[chunk_pos] is partially
+    // sent up to chunk_sent bytes
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    conn_chunk_t *chunks;
+    int nchunks;
+    int chunk_cap;
+    int chunk_pos;
+    size_t chunk_sent;
+
+    // splice() fallback: a pipe between file and socket, and how many
+    // bytes of the current file chunk are sitting in it
+    int use_splice;
+    int pipefd[2];
+    size_t pipe_len;
+
+    // io_uring engine: operations in flight, received bytes that didn't
+    // fit in the input buffer yet, and the message of the send in flight
+    int ring_ops;
+    int ring_flags;
+    char *backlog;
+    size_t backlog_len;
+    void *ring_msg;
+} conn_t;
+
+// Connections of one event loop ordered by last activity, oldest first;
+// the timeout is the same for everyone, so expiring them is a walk from
+// the head
+typedef struct {
+    conn_t *head;
+    conn_t *tail;
+} conn_idle_t;
+
+// keep-alive limits (settable from the command line)
+extern int conn_max_requests;
+extern int conn_idle_timeout;
+
+conn_t *conn_new(int fd);
+void conn_free(conn_t *conn); // also closes the socket
+void conn_next_request(conn_t *conn);
+void *conn_alloc(conn_t *conn, size_t size);
+void conn_count_request(conn_t *conn);
+void conn_report_stats(void);
+unsigned long conn_open_count(void);
+const char *conn_peer(conn_t *conn);
+void conn_idle_touch(conn_idle_t *idle, conn_t *conn, time_t now);
+void conn_idle_remove(conn_idle_t *idle, conn_t *conn);
+
+// input side
+ssize_t conn_fill(conn_t *conn);
+size_t conn_append(conn_t *conn, const char *buf, size_t len);
+int conn_request_ready(conn_t *conn);
+int conn_read_request(conn_t *conn);
+
+// output side
+void conn_write(conn_t *conn, const void *buf, size_t len);
+void conn_printf(conn_t *conn, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void conn_write_map(conn_t *conn, char *map, size_t len);
+void conn_write_buf(conn_t *conn, const char *buf, size_t len,
+                    conn_release_t release, void *arg);
+void conn_write_file(conn_t *conn, int fd, off_t off, size_t len,
+                     conn_release_t release, void *arg);
+int conn_gather(conn_t *conn, struct iovec *iov, int max);
+void conn_sent(conn_t *conn, size_t n);
+int conn_flush(conn_t *conn);
+conn_t *conn_hand_over(conn_t *conn, int fd);
+void conn_drop(conn_t *rest);
+
+#endif // __CONN_H__
@@ -0,0 +1,198 @@
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "conn_queue.h"
+#include "io_helper.h"
+
+static void futex_wait(unsigned *word, unsigned val) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void conn_queue_init(conn_queue_t *q, size_t capacity) {
+    size_t size = 2;
+
+    while (size < capacity)
+        size *= 2;
+    q->cells = malloc_or_die(size * sizeof(conn_queue_cell_t));
+    for (size_t i = 0; i < size; i++)
+        q->cells[i].seq = i;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+    q->items = 0;
+    q->item_waiters = 0;
+    q->space = 0;
+    q->space_waiters = 0;
+}
+
+//
+// A cell is free for the producer at position pos when its sequence is
+// pos, and holds an item for the consumer at pos when it is pos + 1.
+// Whoever wins the CAS on head/tail owns the cell until it publishes the
+// next sequence number.
+//
+int conn_queue_try_put(conn_queue_t *q, struct conn *conn) {
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    conn_queue_cell_t *cell;
+
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1; // full
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->conn = conn;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int conn_queue_try_get(conn_queue_t *q, struct conn **conn) {
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    conn_queue_cell_t *cell;
+
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1; // empty
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    *conn = cell->conn;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//
+// Sleeping: a waiter registers itself, then looks at the queue once more
+// before sleeping on the futex word it read beforehand. The other side
+// publishes its change, then checks for waiters; the seq_cst operations in
+// between guarantee at least one of them sees the other, and a bump of the
+// word after the read makes the futex wait return at once.
+//
+static void conn_queue_notify(unsigned *word, int *waiters) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+        futex_wake(word);
+    }
+}
+
+void conn_queue_put(conn_queue_t *q, struct conn *conn) {
+    while (conn_queue_try_put(q, conn) < 0) {
+        unsigned word = __atomic_load_n(&q->space, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&q->space_waiters, 1, __ATOMIC_SEQ_CST);
+        if (conn_queue_try_put(q, conn) == 0) {
+            __atomic_sub_fetch(&q->space_waiters, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        futex_wait(&q->space, word);
+        __atomic_sub_fetch(&q->space_waiters, 1, __ATOMIC_RELAXED);
+    }
+    conn_queue_notify(&q->items, &q->item_waiters);
+}
+
+int conn_queue_offer(conn_queue_t *q, struct conn *conn) {
+    if (conn_queue_try_put(q, conn) < 0)
+        return -1;
+    conn_queue_notify(&q->items, &q->item_waiters);
+    return 0;
+}
+
+struct conn *conn_queue_get(conn_queue_t *q) {
+    struct conn *conn;
+
+    while (conn_queue_try_get(q, &conn) < 0) {
+        unsigned word = __atomic_load_n(&q->items, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&q->item_waiters, 1, __ATOMIC_SEQ_CST);
+        if (conn_queue_try_get(q, &conn) == 0) {
+            __atomic_sub_fetch(&q->item_waiters, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        futex_wait(&q->items, word);
+        __atomic_sub_fetch(&q->item_waiters, 1, __ATOMIC_RELAXED);
+    }
+    conn_queue_notify(&q->space, &q->space_waiters);
+    return conn;
+}
+
+size_t conn_queue_depth(conn_queue_t *q) {
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    return head > tail ? head - tail : 0;
+}
+
+void conn_steal_init(conn_steal_t *s, int workers, size_t capacity) {
+    s->queues = malloc_or_die(workers * sizeof(conn_queue_t));
+    for (int i = 0; i < workers; i++)
+        conn_queue_init(&s->queues[i], capacity);
+    s->nqueues = workers;
+    s->next = 0;
+    s->idle = 0;
+    s->idle_waiters = 0;
+}
+
+int conn_steal_offer(conn_steal_t *s, struct conn *conn) {
+    unsigned start = s->next++; // only the acceptor writes it
+
+    // next worker in turn, or the first one after it with room; the owner
+    // may be busy, so any idle worker can pick it up
+    for (int i = 0; i < s->nqueues; i++) {
+        if (conn_queue_try_put(&s->queues[(start + i) % s->nqueues], conn) == 0) {
+            conn_queue_notify(&s->idle, &s->idle_waiters);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int conn_steal_try(conn_steal_t *s, int worker, struct conn **conn) {
+    for (int i = 0; i < s->nqueues; i++) {
+        conn_queue_t *q = &s->queues[(worker + i) % s->nqueues];
+        if (conn_queue_try_get(q, conn) == 0) {
+            conn_queue_notify(&q->space, &q->space_waiters);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// own queue first, then the peers after us in order
+struct conn *conn_steal_get(conn_steal_t *s, int worker) {
+    struct conn *conn;
+
+    while (conn_steal_try(s, worker, &conn) < 0) {
+        unsigned word = __atomic_load_n(&s->idle, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&s->idle_waiters, 1, __ATOMIC_SEQ_CST);
+        if (conn_steal_try(s, worker, &conn) == 0) {
+            __atomic_sub_fetch(&s->idle_waiters, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        futex_wait(&s->idle, word);
+        __atomic_sub_fetch(&s->idle_waiters, 1, __ATOMIC_RELAXED);
+    }
+    return conn;
+}
@@ -0,0 +1,75 @@
+#ifndef __CONN_QUEUE_H__
+#define __CONN_QUEUE_H__
+
+#include <stddef.h>
+
+struct conn;
+
+//
+// Bounded multi-producer/multi-consumer queue of accepted connections,
+// handed from the accept thread to the workers. It is Vyukov's ring: every cell
+// carries a sequence number telling producers and consumers whose turn it
+// is, so a put or get is one CAS on the shared position and no lock.
+// Consumers that find it empty sleep on a futex, and so does a producer
+// that finds it full; the other side only makes a wake syscall when it
+// knows somebody is sleeping.
+//
+
+typedef struct {
+    size_t seq;
+    struct conn *conn;
+} conn_queue_cell_t;
+
+typedef struct {
+    conn_queue_cell_t *cells;
+    size_t mask;
+
+    // producers and consumers each get their own cache line
+    size_t head __attribute__((aligned(64))); // next cell to fill
+    size_t tail __attribute__((aligned(64))); // next cell to take
+
+    // futex words bumped on put/get, and how many threads sleep on them
+    unsigned items __attribute__((aligned(64)));
+    int item_waiters;
+    unsigned space __attribute__((aligned(64)));
+    int space_waiters;
+} conn_queue_t;
+
+// capacity is rounded up to a power of two
+void conn_queue_init(conn_queue_t *q, size_t capacity);
+
+// non-blocking: return 0, or -1 if the queue is full/empty
+int conn_queue_try_put(conn_queue_t *q, struct conn *conn);
+int conn_queue_try_get(conn_queue_t *q, struct conn **conn);
+
+// blocking versions
+void conn_queue_put(conn_queue_t *q, struct conn *conn);
+struct conn *conn_queue_get(conn_queue_t *q);
+
+// put without blocking, waking a sleeping consumer; -1 if the queue is full
+int conn_queue_offer(conn_queue_t *q, struct conn *conn);
+
+// connections waiting, a snapshot that may be stale by the time it returns
+size_t conn_queue_depth(conn_queue_t *q);
+
+//
+// Work stealing: one queue per worker instead of one shared by all. The
+// acceptor deals connections round-robin, a worker takes from its own
+// queue first and steals from its peers when that is empty, so a worker
+// stuck on a slow request doesn't hold up the connections queued behind
+// it. Idle workers all sleep on one futex word.
+//
+typedef struct {
+    conn_queue_t *queues;
+    int nqueues;
+    unsigned next; // round-robin position of the acceptor
+
+    unsigned idle __attribute__((aligned(64)));
+    int idle_waiters;
+} conn_steal_t;
+
+void conn_steal_init(conn_steal_t *s, int workers, size_t capacity);
+int conn_steal_offer(conn_steal_t *s, struct conn *conn); // -1 if all full
+struct conn *conn_steal_get(conn_steal_t *s, int worker);
+
+#endif // __CONN_QUEUE_H__
@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+#include "io_helper.h"
+
+#define WINDOW_SIZE (32 * 1024)
+#define HASH_BITS (15)
+#define HASH_SIZE (1 << HASH_BITS)
+#define MIN_MATCH (3)
+#define MAX_MATCH (258)
+#define MAX_CHAIN (64) // candidates tried per position
+
+// output bits are packed LSB first, as deflate wants them
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+    uint64_t bits;
+    int nbits;
+} bit_writer_t;
+
+static const unsigned short length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const unsigned char dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t crc_table[256];
+
+__attribute__((constructor)) static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *buf, size_t len) {
+    uint32_t c = 0xffffffff;
+
+    for (size_t i = 0; i < len; i++)
+        c = crc_table[(c ^ (unsigned char)buf[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+static void put_byte(bit_writer_t *w, unsigned char b) {
+    if (w->len == w->cap) {
+        w->cap *= 2;
+        w->buf = realloc_or_die(w->buf, w->cap);
+    }
+    w->buf[w->len++] = b;
+}
+
+static void put_bits(bit_writer_t *w, uint32_t value, int n) {
+    w->bits |= (uint64_t)value << w->nbits;
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        put_byte(w, w->bits & 0xff);
+        w->bits >>= 8;
+        w->nbits -= 8;
+    }
+}
+
+// Huffman codes are defined MSB first, so they go out reversed
+static void put_code(bit_writer_t *w, uint32_t code, int n) {
+    uint32_t rev = 0;
+
+    for (int i = 0; i < n; i++)
+        rev |= ((code >> i) & 1) << (n - 1 - i);
+    put_bits(w, rev, n);
+}
+
+// the fixed literal/length code of RFC 1951 section 3.2.6
+static void put_symbol(bit_writer_t *w, int sym) {
+    if (sym < 144)
+        put_code(w, 0x30 + sym, 8);
+    else if (sym < 256)
+        put_code(w, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        put_code(w, sym - 256, 7);
+    else
+        put_code(w, 0xc0 + sym - 280, 8);
+}
+
+static void put_match(bit_writer_t *w, int len, int dist) {
+    int i;
+
+    for (i = 28; length_base[i] > len; i--)
+        ;
+    put_symbol(w, 257 + i);
+    put_bits(w, len - length_base[i], length_extra[i]);
+
+    for (i = 29; dist_base[i] > dist; i--)
+        ;
+    put_code(w, i, 5);
+    put_bits(w, dist - dist_base[i], dist_extra[i]);
+}
+
+static unsigned hash3(const unsigned char *p) {
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t gzip_compress(const char *in, size_t len, char **out) {
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    const unsigned char *src = (const unsigned char *)in;
+    bit_writer_t w = {malloc_or_die(len / 2 + 64), 0, len / 2 + 64, 0, 0};
+    int *head = malloc_or_die(HASH_SIZE * sizeof(int));
+    int *prev = malloc_or_die(WINDOW_SIZE * sizeof(int));
+    uint32_t crc = crc32(in, len);
+    size_t i = 0;
+
+    memset(head, -1, HASH_SIZE * sizeof(int));
+    for (int k = 0; k < 10; k++)
+        put_byte(&w, header[k]);
+
+    put_bits(&w, 1, 1); // BFINAL
+    put_bits(&w, 1, 2); // BTYPE = fixed Huffman
+
+    while (i < len) {
+        int best_len = 0, best_dist = 0;
+
+        if (i + MIN_MATCH <= len) {
+            unsigned h = hash3(src + i);
+            int max = len - i < MAX_MATCH ? len - i : MAX_MATCH;
+            int cand = head[h];
+
+            for (int chain = 0; cand >= 0 && i - cand <= WINDOW_SIZE - 1 &&
+                                chain < MAX_CHAIN;
+                 chain++) {
+                if (src[cand + best_len] == src[i + best_len]) {
+                    int n = 0;
+                    while (n < max && src[cand + n] == src[i + n])
+                        n++;
+                    if (n > best_len) {
+                        best_len = n;
+                        best_dist = i - cand;
+                        if (n == max)
+                            break;
+                    }
+                }
+                int next = prev[cand % WINDOW_SIZE];
+                if (next >= cand)
+                    break; // slot reused by a newer position
+                cand = next;
+            }
+        }
+
+        if (best_len >= MIN_MATCH) {
+            put_match(&w, best_len, best_dist);
+        } else {
+            best_len = 1;
+            put_symbol(&w, src[i]);
+        }
+
+        // index every position the match covered
+        for (size_t end = i + best_len; i < end; i++) {
+            if (i + MIN_MATCH <= len) {
+                unsigned h = hash3(src + i);
+                prev[i % WINDOW_SIZE] = head[h];
+                head[h] = i;
+            }
+        }
+    }
+    put_symbol(&w, 256); // end of block
+    put_bits(&w, 0, 7);  // flush the last partial byte
+
+    for (int k = 0; k < 4; k++)
+        put_byte(&w, crc >> (8 * k));
+    for (int k = 0; k < 4; k++)
+        put_byte(&w, (uint32_t)len >> (8 * k));
+
+    free(head);
+    free(prev);
+    if (w.len >= len) {
+        free(w.buf);
+        return 0;
+    }
+    *out = (char *)w.buf;
+    return w.len;
+}
@@ -0,0 +1,16 @@
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+#include <stddef.h>
+
+//
+// Small gzip encoder for compressing static files once, off the request
+// path: LZ77 with hash chains and a single fixed-Huffman deflate block.
+// It trades some ratio against zlib for having no dependency.
+//
+
+// Compress in[0..len) into a malloc()ed gzip member; returns its size and
+// sets *out, or returns 0 if the result wouldn't be smaller than the input
+size_t gzip_compress(const char *in, size_t len, char **out);
+
+#endif // __DEFLATE_H__
@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "admit.h"
+#include "conn.h"
+#include "event_loop.h"
+#include "io_helper.h"
+#include "request.h"
+#include "server.h"
+
+//
+// Event-driven engine: non-blocking sockets, edge-triggered epoll and a
+// small per-connection state machine (reading request -> sending
+// response -> reading the next request on keep-alive connections). Every
+// loop thread owns its connections outright, so nothing here needs a lock.
+//
+
+#define MAX_EVENTS (256)
+#define ACCEPT_BATCH (64) // accepts per wakeup, so one loop can't hog them
+
+typedef struct {
+    int id;
+    int epfd;
+    int listen_fd;
+    pthread_t thread;
+    time_t now; // refreshed once per epoll_wait()
+    conn_idle_t idle;
+} event_loop_t;
+
+static void loop_close(event_loop_t *loop, conn_t *conn) {
+    conn_idle_remove(&loop->idle, conn);
+    // closing the fd drops it from the epoll set, unless a CGI program's
+    // helper still has a copy of the socket
+    if (conn->shared)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn_free(conn);
+}
+
+// close connections that have not made progress within the idle timeout
+static void loop_expire(event_loop_t *loop) {
+    while (loop->idle.head &&
+           loop->now - loop->idle.head->last_active >= conn_idle_timeout)
+        loop_close(loop, loop->idle.head);
+}
+
+static void loop_accept(event_loop_t *loop) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in client_address;
+        socklen_t address_len = sizeof(client_address);
+        int fd = accept4(loop->listen_fd, (sockaddr_t *)&client_address,
+                         &address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
+            return;
+        }
+
+        // keep the address for the access log
+        conn_t *conn = conn_new(fd);
+        conn->evented = 1;
+        inet_ntop(AF_INET, &client_address.sin_addr, conn->peer,
+                  sizeof(conn->peer));
+        if (admit_conn(conn, (sockaddr_t *)&client_address) < 0) {
+            admit_refuse(fd);
+            conn_free(conn);
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_free(conn);
+            continue;
+        }
+        conn_idle_touch(&loop->idle, conn, loop->now);
+    }
+}
+
+//
+// Advance one connection as far as it can go without blocking.
+// Edge-triggered, so each state drains its socket until EAGAIN.
+//
+static void loop_handle(event_loop_t *loop, conn_t *conn, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        loop_close(loop, conn);
+        return;
+    }
+    conn_idle_touch(&loop->idle, conn, loop->now);
+
+    while (1) {
+        if (conn->state == CONN_READING) {
+            int ready;
+            while ((ready = conn_request_ready(conn)) == 0) {
+                ssize_t n = conn_fill(conn);
+                if (n == 0) {
+                    loop_close(loop, conn); // client is done with us
+                    return;
+                }
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        loop_close(loop, conn);
+                    return; // wait for more input
+                }
+            }
+
+            if (ready < 0)
+                handle_bad_request(conn);
+            else
+                handle_requests(conn);
+            conn->state = CONN_WRITING;
+        }
+
+        int rc = conn_flush(conn);
+        if (rc == 0)
+            return; // socket full, EPOLLOUT will bring us back
+        if (rc < 0 || !conn->keep_alive) {
+            loop_close(loop, conn);
+            return;
+        }
+
+        // keep-alive: the next request may already be buffered
+        conn_next_request(conn);
+        conn->state = CONN_READING;
+    }
+}
+
+static void *loop_thread(void *arg) {
+    event_loop_t *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // wake up at least once a second to expire idle connections
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        loop->now = time(NULL);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                loop_accept(loop);
+            else
+                loop_handle(loop, events[i].data.ptr, events[i].events);
+        }
+        loop_expire(loop);
+    }
+    return NULL;
+}
+
+void event_loop_start(int listen_fd, int nloops, int cpu) {
+    event_loop_t *loops = calloc(nloops, sizeof(event_loop_t));
+    pthread_attr_t attr;
+    assert(loops != NULL);
+
+    server_raise_fd_limit();
+    server_pin_attr(&attr, cpu);
+
+    // accept4() must not block once another loop has won the race
+    int flags = fcntl(listen_fd, F_GETFL);
+    assert(fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == 0);
+
+    for (int i = 0; i < nloops; i++) {
+        event_loop_t *loop = &loops[i];
+        loop->id = i;
+        loop->listen_fd = listen_fd;
+        loop->now = time(NULL);
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        assert(loop->epfd >= 0);
+
+        // level-triggered, and EPOLLEXCLUSIVE wakes just one loop per
+        // incoming connection instead of the whole herd
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        assert(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) == 0);
+
+        if (pthread_create(&loop->thread, &attr, loop_thread, loop) != 0) {
+            perror("Failed to create event loop thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(loop->thread);
+    }
+    pthread_attr_destroy(&attr);
+}
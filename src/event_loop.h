@@ -0,0 +1,8 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+// Start the epoll engine: nloops threads, each with its own epoll instance,
+// all accepting from listen_fd and pinned to cpu (-1: not pinned).
+void event_loop_start(int listen_fd, int nloops, int cpu);
+
+#endif // __EVENT_LOOP_H__
@@ -0,0 +1,828 @@
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "cgi.h"
+#include "fcgi.h"
+#include "io_helper.h"
+#include "log.h"
+
+// record types and the bits of the protocol we speak (FastCGI 1.0)
+#define FCGI_VERSION_1 (1)
+#define FCGI_BEGIN_REQUEST (1)
+#define FCGI_END_REQUEST (3)
+#define FCGI_PARAMS (4)
+#define FCGI_STDIN (5)
+#define FCGI_STDOUT (6)
+#define FCGI_STDERR (7)
+#define FCGI_RESPONDER (1)
+#define FCGI_KEEP_CONN (1)
+#define FCGI_REQUEST_COMPLETE (0)
+#define FCGI_REQUEST_ID (1) // one request per connection at a time
+
+#define FCGI_OVERRIDES (32)
+#define FCGI_PARAMS_MAX (8192)
+#define FCGI_REQUEST_MAX (FCGI_PARAMS_MAX + 64)
+#define FCGI_RECORD_MAX (8 + 65535 + 255) // header, content, padding
+#define FCGI_EVENTS (64)
+
+typedef struct {
+    unsigned char version;
+    unsigned char type;
+    unsigned char request_id[2];
+    unsigned char content_length[2];
+    unsigned char padding_length;
+    unsigned char reserved;
+} fcgi_header_t;
+
+typedef struct {
+    pid_t pid; // -1 while waiting to be restarted
+    int pidfd; // -1 where pidfd_open() isn't supported
+    time_t started;
+} fcgi_worker_t;
+
+//
+// One script's pool. The workers accept() on the shared listening socket;
+// connections to it are kept open between requests on an idle stack.
+// Never more connections than workers: an extra one would sit in the
+// backlog behind workers blocked reading our idle connections.
+//
+typedef struct fcgi_app {
+    struct fcgi_app *next;
+    int listen_fd;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int nworkers;
+    fcgi_worker_t workers[FCGI_MAX_WORKERS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    int idle[FCGI_MAX_WORKERS];
+    int nidle;
+    int nconns; // open connections, idle or in use
+    char path[];
+} fcgi_app_t;
+
+static struct {
+    char path[PATH_MAX];
+    int workers;
+} overrides[FCGI_OVERRIDES];
+static int noverrides;
+static int default_workers; // 0: plain CGI
+
+static fcgi_app_t *apps;
+static int napps;
+static pthread_mutex_t apps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t monitor;
+static int stopping; // no more restarts
+
+int fcgi_configure(const char *arg) {
+    const char *eq = strchr(arg, '=');
+    int n = atoi(eq ? eq + 1 : arg);
+
+    if (n < 0 || n > FCGI_MAX_WORKERS)
+        return -1;
+    if (eq == NULL) {
+        default_workers = n;
+        return 0;
+    }
+    if (noverrides == FCGI_OVERRIDES || eq - arg >= PATH_MAX)
+        return -1;
+    snprintf(overrides[noverrides].path, PATH_MAX, "%.*s", (int)(eq - arg), arg);
+    overrides[noverrides++].workers = n;
+    return 0;
+}
+
+int fcgi_pool_size(const char *filename) {
+    size_t len = strlen(filename), slen = strlen(FCGI_SUFFIX);
+
+    if (len < slen || strcmp(filename + len - slen, FCGI_SUFFIX) != 0)
+        return 0;
+    // filenames are "./" + the URL path
+    for (int i = 0; i < noverrides; i++) {
+        if (strcmp(overrides[i].path, filename + 1) == 0)
+            return overrides[i].workers;
+    }
+    return default_workers;
+}
+
+static void fcgi_spawn(fcgi_app_t *app, fcgi_worker_t *worker) {
+    extern char **environ;
+    pid_t pid;
+
+    // the listening socket becomes the worker's stdin
+    pid = cgi_spawn(app->path, environ, app->listen_fd, -1);
+    if (pid < 0)
+        logMessage("FastCGI: can't start %s: %s", app->path, strerror(errno));
+    worker->pid = pid;
+    worker->pidfd = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+    worker->started = time(NULL);
+}
+
+//
+// Restart workers that exited. One that dies within a second of starting
+// waits for the next round, so a broken script doesn't spin the CPU.
+//
+static void fcgi_check(fcgi_app_t *app, time_t now) {
+    for (int i = 0; i < app->nworkers; i++) {
+        fcgi_worker_t *worker = &app->workers[i];
+        if (worker->pid > 0 && waitpid(worker->pid, NULL, WNOHANG) == worker->pid) {
+            logMessage("FastCGI: worker %d of %s exited", worker->pid, app->path);
+            if (worker->pidfd >= 0)
+                close(worker->pidfd);
+            worker->pid = -1;
+            worker->pidfd = -1;
+        }
+        if (worker->pid < 0 && now - worker->started >= 1)
+            fcgi_spawn(app, worker);
+    }
+}
+
+// waits on the workers' pidfds (or just polls once a second without them)
+static void *fcgi_monitor(void *arg) {
+    struct pollfd pfds[FCGI_MAX_WORKERS * 16];
+
+    while (1) {
+        int n = 0;
+
+        pthread_mutex_lock(&apps_lock);
+        for (fcgi_app_t *app = apps; app; app = app->next) {
+            for (int i = 0; i < app->nworkers; i++) {
+                if (app->workers[i].pidfd >= 0 &&
+                    n < (int)(sizeof(pfds) / sizeof(pfds[0]))) {
+                    pfds[n].fd = app->workers[i].pidfd;
+                    pfds[n++].events = POLLIN;
+                }
+            }
+        }
+        pthread_mutex_unlock(&apps_lock);
+
+        poll(pfds, n, 1000);
+
+        pthread_mutex_lock(&apps_lock);
+        for (fcgi_app_t *app = apps; app; app = app->next) {
+            if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+                fcgi_check(app, time(NULL));
+        }
+        pthread_mutex_unlock(&apps_lock);
+    }
+    return NULL;
+}
+
+static fcgi_app_t *fcgi_app_create(const char *filename, int nworkers) {
+    fcgi_app_t *app = malloc_or_die(sizeof(fcgi_app_t) + strlen(filename) + 1);
+
+    strcpy(app->path, filename);
+    app->nworkers = nworkers;
+    app->nidle = 0;
+    app->nconns = 0;
+    pthread_mutex_init(&app->lock, NULL);
+    pthread_cond_init(&app->freed, NULL);
+
+    // an abstract socket: nothing in the file system to clean up
+    memset(&app->addr, 0, sizeof(app->addr));
+    app->addr.sun_family = AF_UNIX;
+    snprintf(app->addr.sun_path + 1, sizeof(app->addr.sun_path) - 1,
+             "nweb-fcgi-%d-%d", getpid(), napps);
+    app->addr_len = offsetof(struct sockaddr_un, sun_path) + 1 +
+                    strlen(app->addr.sun_path + 1);
+    app->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (app->listen_fd < 0 ||
+        bind(app->listen_fd, (sockaddr_t *)&app->addr, app->addr_len) < 0 ||
+        listen(app->listen_fd, FCGI_MAX_WORKERS) < 0) {
+        perror("FastCGI socket");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+        fcgi_spawn(app, &app->workers[i]);
+    return app;
+}
+
+static fcgi_app_t *fcgi_app_get(const char *filename, int nworkers) {
+    fcgi_app_t *app;
+
+    pthread_mutex_lock(&apps_lock);
+    for (app = apps; app; app = app->next) {
+        if (strcmp(app->path, filename) == 0)
+            break;
+    }
+    if (app == NULL) {
+        if (napps == 0 && pthread_create(&monitor, NULL, fcgi_monitor, NULL) != 0) {
+            perror("Failed to create FastCGI monitor thread");
+            exit(EXIT_FAILURE);
+        }
+        app = fcgi_app_create(filename, nworkers);
+        app->next = apps;
+        apps = app;
+        napps++;
+    }
+    pthread_mutex_unlock(&apps_lock);
+    return app;
+}
+
+//
+// An idle connection, or a new one while there are fewer than workers.
+// Without wait, returns -1 with errno EAGAIN instead of waiting for one
+// to be given back.
+//
+static int fcgi_connect(fcgi_app_t *app, int wait) {
+    struct timeval timeout = {.tv_sec = FCGI_TIMEOUT};
+    int fd;
+
+    pthread_mutex_lock(&app->lock);
+    while (app->nidle == 0 && app->nconns >= app->nworkers) {
+        if (!wait) {
+            pthread_mutex_unlock(&app->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&app->freed, &app->lock);
+    }
+    if (app->nidle > 0) {
+        fd = app->idle[--app->nidle];
+        pthread_mutex_unlock(&app->lock);
+        return fd;
+    }
+    app->nconns++;
+    pthread_mutex_unlock(&app->lock);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (sockaddr_t *)&app->addr, app->addr_len) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        pthread_mutex_lock(&app->lock);
+        app->nconns--;
+        pthread_cond_signal(&app->freed);
+        pthread_mutex_unlock(&app->lock);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+//
+// Back on the idle stack if it is still good. A broken one most likely
+// lost its worker, and the idle ones were probably to the same workers,
+// so they are all closed.
+//
+static void fcgi_release(fcgi_app_t *app, int fd, int reusable) {
+    pthread_mutex_lock(&app->lock);
+    if (reusable) {
+        app->idle[app->nidle++] = fd;
+    } else {
+        close(fd);
+        app->nconns--;
+        while (app->nidle > 0) {
+            close(app->idle[--app->nidle]);
+            app->nconns--;
+        }
+        pthread_cond_broadcast(&app->freed);
+    }
+    pthread_cond_signal(&app->freed);
+    pthread_mutex_unlock(&app->lock);
+}
+
+static void fcgi_record(char *buf, size_t *pos, int type, const char *content,
+                        size_t len) {
+    fcgi_header_t *h = (fcgi_header_t *)(buf + *pos);
+
+    h->version = FCGI_VERSION_1;
+    h->type = type;
+    h->request_id[0] = FCGI_REQUEST_ID >> 8;
+    h->request_id[1] = FCGI_REQUEST_ID & 0xff;
+    h->content_length[0] = len >> 8;
+    h->content_length[1] = len & 0xff;
+    h->padding_length = 0;
+    h->reserved = 0;
+    if (len > 0) // empty records mark the end of a stream
+        memcpy(buf + *pos + sizeof(*h), content, len);
+    *pos += sizeof(*h) + len;
+}
+
+// name-value pair: lengths below 128 take one byte, others four
+static void fcgi_param(char *buf, size_t *pos, const char *name,
+                       const char *value) {
+    size_t lens[2] = {strlen(name), strlen(value)};
+
+    if (*pos + lens[0] + lens[1] + 8 > FCGI_PARAMS_MAX)
+        return; // drop what doesn't fit
+    for (int i = 0; i < 2; i++) {
+        if (lens[i] < 128) {
+            buf[(*pos)++] = lens[i];
+        } else {
+            buf[(*pos)++] = (lens[i] >> 24) | 0x80;
+            buf[(*pos)++] = lens[i] >> 16;
+            buf[(*pos)++] = lens[i] >> 8;
+            buf[(*pos)++] = lens[i];
+        }
+    }
+    memcpy(buf + *pos, name, lens[0]);
+    memcpy(buf + *pos + lens[0], value, lens[1]);
+    *pos += lens[0] + lens[1];
+}
+
+static int fcgi_read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, (char *)buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+static int fcgi_write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//
+// The whole request, into request (FCGI_REQUEST_MAX bytes): BEGIN_REQUEST,
+// the params and an empty stdin (we only serve GET). Returns its length.
+//
+static size_t fcgi_build(char *request, const char *filename,
+                         const char *query, const char *peer) {
+    static const unsigned char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN};
+    char params[FCGI_PARAMS_MAX];
+    size_t plen = 0, rlen = 0;
+
+    fcgi_param(params, &plen, "GATEWAY_INTERFACE", "CGI/1.1");
+    fcgi_param(params, &plen, "SERVER_SOFTWARE", "nweb");
+    fcgi_param(params, &plen, "SERVER_PROTOCOL", "HTTP/1.1");
+    fcgi_param(params, &plen, "REQUEST_METHOD", "GET");
+    fcgi_param(params, &plen, "SCRIPT_FILENAME", filename);
+    fcgi_param(params, &plen, "SCRIPT_NAME", filename + 1);
+    fcgi_param(params, &plen, "QUERY_STRING", query);
+    fcgi_param(params, &plen, "REMOTE_ADDR", peer);
+
+    fcgi_record(request, &rlen, FCGI_BEGIN_REQUEST, (const char *)begin,
+                sizeof(begin));
+    fcgi_record(request, &rlen, FCGI_PARAMS, params, plen);
+    fcgi_record(request, &rlen, FCGI_PARAMS, NULL, 0);
+    fcgi_record(request, &rlen, FCGI_STDIN, NULL, 0);
+    return rlen;
+}
+
+//
+// One exchange on an open connection: send the request, then collect
+// STDOUT until END_REQUEST. Returns -2 once the output grows past
+// FCGI_MAX_OUTPUT.
+//
+static int fcgi_exchange(int fd, const char *filename, const char *query,
+                         const char *peer, char **out, size_t *len) {
+    char request[FCGI_REQUEST_MAX];
+    size_t rlen = fcgi_build(request, filename, query, peer), cap = 4096;
+    fcgi_header_t h;
+
+    if (fcgi_write_full(fd, request, rlen) < 0)
+        return -1;
+
+    *out = malloc_or_die(cap);
+    *len = 0;
+    while (1) {
+        size_t clen, skip;
+        char pad[256];
+
+        if (fcgi_read_full(fd, &h, sizeof(h)) < 0)
+            break;
+        clen = h.content_length[0] << 8 | h.content_length[1];
+        skip = h.padding_length;
+
+        // every record's content is read in after the output so far: the
+        // output keeps it, anything else is dropped again
+        if (h.type == FCGI_STDOUT && *len + clen > FCGI_MAX_OUTPUT) {
+            free(*out);
+            return -2;
+        }
+        if (*len + clen > cap) {
+            while (*len + clen > cap)
+                cap *= 2;
+            *out = realloc_or_die(*out, cap);
+        }
+
+        if (h.type == FCGI_STDOUT) {
+            if (fcgi_read_full(fd, *out + *len, clen) < 0)
+                break;
+            *len += clen;
+        } else if (h.type == FCGI_END_REQUEST) {
+            unsigned char body[8];
+            if (clen != sizeof(body) || fcgi_read_full(fd, body, clen) < 0 ||
+                fcgi_read_full(fd, pad, skip) < 0 ||
+                body[4] != FCGI_REQUEST_COMPLETE)
+                break;
+            return 0;
+        } else {
+            // stderr goes to the log, anything else is skipped
+            if (fcgi_read_full(fd, *out + *len, clen) < 0)
+                break;
+            if (h.type == FCGI_STDERR && clen > 0)
+                logMessage("FastCGI %s: %.*s", filename, (int)clen,
+                           *out + *len);
+        }
+        if (fcgi_read_full(fd, pad, skip) < 0)
+            break;
+    }
+    free(*out);
+    return -1;
+}
+
+int fcgi_request(const char *filename, const char *query, const char *peer,
+                 char **out, size_t *len) {
+    fcgi_app_t *app = fcgi_app_get(filename, fcgi_pool_size(filename));
+    int fd, rc;
+
+    // a kept-alive connection may have lost its worker since; one retry on
+    // a fresh connection tells that apart from a broken app
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if ((fd = fcgi_connect(app, 1)) < 0)
+            return -1;
+        rc = fcgi_exchange(fd, filename, query, peer, out, len);
+        fcgi_release(app, fd, rc == 0);
+        if (rc == 0)
+            return 0;
+        if (rc == -2)
+            return -1; // the app did answer, only too much
+    }
+    return -1;
+}
+
+//
+// The event loops' path: the same exchange as a state machine on a helper
+// thread with its own epoll set, on non-blocking sockets. A job waits for
+// a free connection to the app, sends the request, collects the records,
+// then has the response queued on its bare connection to the client and
+// sends it (after the responses that were queued ahead of it). Like the
+// CGI helper's, jobs are added by the loops and freed by the helper only
+// after a whole batch of events is handled, and jobs_lock is held by
+// whoever touches them.
+//
+enum FcgiWatch { FCGI_WATCH_APP, FCGI_WATCH_CLIENT, FCGI_WATCHES };
+enum FcgiStage { FCGI_WAITING, FCGI_EXCHANGING, FCGI_SENDING, FCGI_DONE };
+
+typedef struct fcgi_job fcgi_job_t;
+
+typedef struct {
+    fcgi_job_t *job;
+    int kind;
+} fcgi_watch_t;
+
+struct fcgi_job {
+    fcgi_job_t *next;
+    fcgi_app_t *app;
+    int stage;
+    int attempts;
+    time_t deadline;
+    int app_fd;   // -1 unless exchanging
+    conn_t *conn; // the client's socket and the output queued for it
+    fcgi_respond_t respond;
+    fcgi_watch_t watch[FCGI_WATCHES];
+    char *filename;
+
+    // the request: request[off..len) isn't written yet
+    char request[FCGI_REQUEST_MAX];
+    size_t request_len;
+    size_t request_off;
+
+    // records read but not parsed yet, and the app's output so far
+    char in[FCGI_RECORD_MAX];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+};
+
+static fcgi_job_t *jobs;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t helper_once = PTHREAD_ONCE_INIT;
+static int epfd = -1;
+
+static void fcgi_watch(fcgi_job_t *job, int kind, int fd, unsigned events) {
+    struct epoll_event ev = {.events = events, .data.ptr = &job->watch[kind]};
+
+    job->watch[kind].job = job;
+    job->watch[kind].kind = kind;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        perror("epoll_ctl");
+}
+
+// done with the app connection; see fcgi_release()
+static void fcgi_job_release(fcgi_job_t *job, int reusable) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, job->app_fd, NULL);
+    fcgi_release(job->app, job->app_fd, reusable);
+    job->app_fd = -1;
+}
+
+static void fcgi_job_wake(fcgi_app_t *app);
+
+// the client is answered or gone: the socket is the helper's own dup()
+static void fcgi_job_finish(fcgi_job_t *job) {
+    if (job->app_fd >= 0) {
+        fcgi_job_release(job, 0); // mid-exchange: can't be reused
+        fcgi_job_wake(job->app);
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, job->conn->fd, NULL);
+    close(job->conn->fd);
+    conn_drop(job->conn);
+    job->conn = NULL;
+    free(job->out);
+    job->out = NULL;
+    job->stage = FCGI_DONE;
+}
+
+// send what is queued for the client; finishes the job once it has all gone
+static void fcgi_job_send(fcgi_job_t *job) {
+    int rc = conn_flush(job->conn);
+
+    if (rc < 0 || (rc > 0 && job->stage == FCGI_SENDING))
+        fcgi_job_finish(job);
+}
+
+// queue the response (out is the app's, or NULL with the error) and send it
+static void fcgi_job_respond(fcgi_job_t *job, int error) {
+    char *out = error ? NULL : job->out;
+
+    if (!error)
+        job->out = NULL; // respond() frees it
+    job->stage = FCGI_SENDING;
+    job->deadline = time(NULL) + FCGI_TIMEOUT; // for a client that won't read
+    job->respond(job->conn, job->filename, out, job->out_len, error);
+    fcgi_job_send(job);
+}
+
+static void fcgi_job_exchange(fcgi_job_t *job);
+
+//
+// Take a connection to the app and start writing the request. A job that
+// finds every connection in use stays waiting until one is given back.
+//
+static void fcgi_job_begin(fcgi_job_t *job) {
+    if ((job->app_fd = fcgi_connect(job->app, 0)) < 0) {
+        if (errno != EAGAIN)
+            fcgi_job_respond(job, FCGI_FAILED);
+        return;
+    }
+    fcntl(job->app_fd, F_SETFL, fcntl(job->app_fd, F_GETFL) | O_NONBLOCK);
+    job->stage = FCGI_EXCHANGING;
+    job->request_off = 0;
+    job->in_len = 0;
+    job->out_len = 0;
+    fcgi_watch(job, FCGI_WATCH_APP, job->app_fd, EPOLLIN | EPOLLOUT | EPOLLET);
+    fcgi_job_exchange(job);
+}
+
+// a connection was given back: the oldest waiting job of its app gets it
+static void fcgi_job_wake(fcgi_app_t *app) {
+    fcgi_job_t *oldest = NULL;
+
+    for (fcgi_job_t *job = jobs; job; job = job->next) {
+        if (job->app == app && job->stage == FCGI_WAITING &&
+            (oldest == NULL || job->deadline <= oldest->deadline))
+            oldest = job;
+    }
+    if (oldest)
+        fcgi_job_begin(oldest);
+}
+
+//
+// The exchange broke off. A kept-alive connection may have lost its worker
+// since, so as in fcgi_request() one more attempt on a fresh connection
+// tells that apart from a broken app; too much output is not retried.
+//
+static void fcgi_job_fail(fcgi_job_t *job, int retry) {
+    fcgi_app_t *app = job->app;
+
+    fcgi_job_release(job, 0);
+    if (retry && ++job->attempts < 2) {
+        job->stage = FCGI_WAITING;
+        fcgi_job_begin(job);
+    } else {
+        fcgi_job_respond(job, FCGI_FAILED);
+    }
+    fcgi_job_wake(app);
+}
+
+//
+// Parse the complete records in job->in: STDOUT is collected, STDERR
+// logged, END_REQUEST ends the exchange. Returns 1 when it has ended, 0
+// for more, -1 if it broke off and -2 for too much output.
+//
+static int fcgi_job_records(fcgi_job_t *job) {
+    size_t pos = 0;
+    int rc = 0;
+
+    while (rc == 0 && job->in_len - pos >= sizeof(fcgi_header_t)) {
+        fcgi_header_t *h = (fcgi_header_t *)(job->in + pos);
+        size_t clen = h->content_length[0] << 8 | h->content_length[1];
+        char *content = job->in + pos + sizeof(*h);
+
+        if (job->in_len - pos < sizeof(*h) + clen + h->padding_length)
+            break; // the rest of it isn't here yet
+        pos += sizeof(*h) + clen + h->padding_length;
+
+        if (h->type == FCGI_STDOUT) {
+            if (job->out_len + clen > FCGI_MAX_OUTPUT) {
+                rc = -2;
+                break;
+            }
+            if (job->out_len + clen > job->out_cap) {
+                while (job->out_len + clen > job->out_cap)
+                    job->out_cap *= 2;
+                job->out = realloc_or_die(job->out, job->out_cap);
+            }
+            memcpy(job->out + job->out_len, content, clen);
+            job->out_len += clen;
+        } else if (h->type == FCGI_END_REQUEST) {
+            rc = clen == 8 && content[4] == FCGI_REQUEST_COMPLETE ? 1 : -1;
+        } else if (h->type == FCGI_STDERR && clen > 0) {
+            logMessage("FastCGI %s: %.*s", job->filename, (int)clen, content);
+        }
+    }
+    memmove(job->in, job->in + pos, job->in_len - pos);
+    job->in_len -= pos;
+    return rc;
+}
+
+// write the request and read the answer until either would block
+static void fcgi_job_exchange(fcgi_job_t *job) {
+    ssize_t n;
+    int rc;
+
+    while (job->request_off < job->request_len) {
+        n = write(job->app_fd, job->request + job->request_off,
+                  job->request_len - job->request_off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return; // EPOLLOUT brings us back
+        if (n < 0) {
+            fcgi_job_fail(job, 1);
+            return;
+        }
+        job->request_off += n;
+    }
+
+    while (1) {
+        n = read(job->app_fd, job->in + job->in_len,
+                 sizeof(job->in) - job->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return; // EPOLLIN brings us back
+        if (n <= 0) {
+            fcgi_job_fail(job, 1); // the worker went away mid-answer
+            return;
+        }
+        job->in_len += n;
+        if ((rc = fcgi_job_records(job)) != 0)
+            break;
+    }
+    if (rc < 0) {
+        fcgi_job_fail(job, rc == -1);
+        return;
+    }
+    fcgi_app_t *app = job->app;
+    fcgi_job_release(job, 1);
+    fcgi_job_respond(job, 0);
+    fcgi_job_wake(app);
+}
+
+//
+// Answer the jobs that ran out of time: one still waiting for a
+// connection gets FCGI_BUSY, one still exchanging FCGI_FAILED, and a
+// client that won't take its response is dropped. Then free the jobs that
+// are over. Called with jobs_lock held.
+//
+static void fcgi_expire(time_t now) {
+    fcgi_job_t **link = &jobs, *job;
+
+    // waiting ones first, so that none is woken by a connection given up
+    // below only to miss its own deadline on an app that isn't answering
+    for (job = jobs; job; job = job->next) {
+        if (now >= job->deadline && job->stage == FCGI_WAITING)
+            fcgi_job_respond(job, FCGI_BUSY);
+    }
+    for (job = jobs; job; job = job->next) {
+        if (now < job->deadline)
+            continue;
+        if (job->stage == FCGI_EXCHANGING) {
+            logMessage("FastCGI %s: no answer after %d seconds", job->filename,
+                       FCGI_TIMEOUT);
+            fcgi_app_t *app = job->app;
+            fcgi_job_release(job, 0);
+            fcgi_job_respond(job, FCGI_FAILED);
+            fcgi_job_wake(app);
+        } else if (job->stage == FCGI_SENDING) {
+            fcgi_job_finish(job);
+        }
+    }
+    while ((job = *link) != NULL) {
+        if (job->stage == FCGI_DONE) {
+            *link = job->next;
+            free(job->filename);
+            free(job);
+            continue;
+        }
+        link = &job->next;
+    }
+}
+
+static void *fcgi_helper(void *arg) {
+    struct epoll_event events[FCGI_EVENTS];
+
+    while (1) {
+        // wake up at least once a second for the deadlines
+        int n = epoll_wait(epfd, events, FCGI_EVENTS, 1000);
+
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < n; i++) {
+            fcgi_watch_t *watch = events[i].data.ptr;
+            fcgi_job_t *job = watch->job;
+            if (job->stage == FCGI_DONE)
+                continue;
+            if (watch->kind == FCGI_WATCH_CLIENT)
+                fcgi_job_send(job); // responses queued ahead, then ours
+            else if (job->stage == FCGI_EXCHANGING)
+                fcgi_job_exchange(job);
+        }
+        fcgi_expire(time(NULL));
+        pthread_mutex_unlock(&jobs_lock);
+    }
+    return NULL;
+}
+
+static void fcgi_helper_start(void) {
+    sigset_t all, old;
+    pthread_t thread;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    // signals are for the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, fcgi_helper, NULL) != 0) {
+        perror("Failed to create FastCGI helper thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+}
+
+void fcgi_start(const char *filename, const char *query, const char *peer,
+                conn_t *conn, int sock_fd, fcgi_respond_t respond) {
+    fcgi_job_t *job = malloc_or_die(sizeof(fcgi_job_t));
+
+    pthread_once(&helper_once, fcgi_helper_start);
+    job->app = fcgi_app_get(filename, fcgi_pool_size(filename));
+    job->stage = FCGI_WAITING;
+    job->attempts = 0;
+    job->deadline = time(NULL) + FCGI_TIMEOUT;
+    job->app_fd = -1;
+    job->conn = conn_hand_over(conn, sock_fd);
+    job->respond = respond;
+    job->filename = strdup(filename);
+    job->request_len = fcgi_build(job->request, filename, query, peer);
+    job->out_cap = 4096;
+    job->out = malloc_or_die(job->out_cap);
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+
+    // the client socket's first EPOLLOUT sends the responses queued ahead
+    pthread_mutex_lock(&jobs_lock);
+    job->next = jobs;
+    jobs = job;
+    fcgi_watch(job, FCGI_WATCH_CLIENT, sock_fd, EPOLLOUT | EPOLLET);
+    fcgi_job_begin(job);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+void fcgi_shutdown(void) {
+    // no lock: this runs at exit, and the monitor may be holding it
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (fcgi_app_t *app = apps; app; app = app->next) {
+        for (int i = 0; i < app->nworkers; i++) {
+            if (app->workers[i].pid > 0)
+                kill(app->workers[i].pid, SIGTERM);
+        }
+    }
+}
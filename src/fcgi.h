@@ -0,0 +1,63 @@
+#ifndef __FCGI_H__
+#define __FCGI_H__
+
+#include <stddef.h>
+
+#include "conn.h"
+
+//
+// FastCGI worker pools. A script ending in FCGI_SUFFIX is started once as
+// a few long-lived processes that share a listening Unix socket as their
+// stdin, the FastCGI convention. Requests go to them over persistent
+// connections (FCGI_KEEP_CONN), at most one per worker, so no fork or exec
+// happens per request. A monitor thread restarts workers that exit.
+//
+
+#define FCGI_SUFFIX ".fcgi"
+#define FCGI_MAX_WORKERS (64)
+#define FCGI_TIMEOUT (30) // seconds an app may take to answer
+#define FCGI_MAX_OUTPUT (16 << 20) // bytes of response an app may send
+
+// "n" sets the pool size of every script, "path=n" of one script (as
+// named in the URL, e.g. /cgi/app.fcgi=8); 0 runs them as plain CGI.
+// Returns -1 if arg doesn't parse.
+int fcgi_configure(const char *arg);
+
+// workers for this script (a path relative to the docroot), 0 for none
+int fcgi_pool_size(const char *filename);
+
+//
+// Run one request through the script's pool. On success *out holds what
+// the app wrote to FCGI_STDOUT (CGI headers, blank line, body), malloc()ed
+// and *len bytes long. Returns -1 if the app couldn't be reached, broke
+// off the exchange or sent more than FCGI_MAX_OUTPUT.
+//
+int fcgi_request(const char *filename, const char *query, const char *peer,
+                 char **out, size_t *len);
+
+// how a request through the pool ended, for fcgi_respond_t
+enum FcgiResult {
+    FCGI_OK,
+    FCGI_FAILED, // the app couldn't be reached, broke off or said too much
+    FCGI_BUSY,   // no connection to the app came free within FCGI_TIMEOUT
+};
+
+// queue the response on conn; out (malloc()ed, or NULL) is the callee's
+typedef void (*fcgi_respond_t)(conn_t *conn, const char *filename, char *out,
+                               size_t len, int result);
+
+//
+// The same for an event loop, which must not block: the exchange runs on a
+// helper thread, which then calls respond() with the app's output on a bare
+// connection on sock_fd (a dup() of conn's socket) and sends it, after the
+// output conn still has queued. A request that can't be done within
+// FCGI_TIMEOUT, waiting for a connection included, gets respond() with
+// out NULL. sock_fd is closed at the end.
+//
+void fcgi_start(const char *filename, const char *query, const char *peer,
+                conn_t *conn, int sock_fd, fcgi_respond_t respond);
+
+// stop every worker (at exit)
+void fcgi_shutdown(void);
+
+#endif // __FCGI_H__
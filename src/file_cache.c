@@ -0,0 +1,656 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deflate.h"
+#include "file_cache.h"
+#include "io_helper.h"
+#include "mime.h"
+#include "rcu.h"
+#include "request.h"
+#include "stats.h"
+
+//
+// Open-file cache for the static path. A hit skips the stat(), open() and
+// MIME lookup a request would otherwise pay for.
+//
+// Lookups walk the hash chains without taking a lock, inside an RCU read
+// section; everything that changes the table holds cache_lock. An entry
+// that gets unlinked (evicted or invalidated) is put on a retire list and
+// the maintenance thread drops the table's reference after a grace period,
+// so a reader that was still looking at it is never left with freed
+// memory. Requests using an entry hold their own reference on top.
+//
+// Eviction is CLOCK: hits set the entry's referenced bit, and the hand
+// sweeps the ring clearing bits until it finds an entry without one.
+//
+// Staleness is handled with inotify on every directory holding a cached
+// file: a change, move or delete of the file (or of the directory)
+// invalidates the entries below it. A change to "x.gz" also drops "x",
+// whose entry remembers whether that sibling exists.
+//
+// The same thread compresses hot text files that have no .gz sibling, so
+// gzip never runs on the request path.
+//
+
+// retired entries the maintenance thread lets pile up before it is woken
+#define FILE_CACHE_RETIRE_BATCH (64)
+
+typedef struct {
+    int wd;
+    char dir[PATH_MAX]; // normalized, "" for the docroot
+} file_watch_t;
+
+size_t response_cache_max = RESPONSE_CACHE_MAX;
+size_t response_cache_budget = RESPONSE_CACHE_BUDGET;
+unsigned response_cache_admit = RESPONSE_CACHE_ADMIT;
+static size_t response_cache_used;
+
+size_t gzip_cache_budget = GZIP_CACHE_BUDGET;
+static size_t gzip_cache_used;
+static file_entry_t *compress_queue;
+
+static int capacity; // 0 when disabled
+static file_entry_t **buckets;
+static unsigned long mask;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static file_entry_t **ring; // CLOCK ring, NULL where a slot is free
+static int count;
+static int hand;
+static file_entry_t *retired;
+static int nretired;
+
+// bumped on every invalidation, so a miss racing with one doesn't cache
+// what it opened before the change
+static unsigned long generation;
+
+static int inotify_fd = -1;
+static int wake_fd = -1;
+static file_watch_t *watches;
+static int nwatches;
+static int watch_cap;
+
+// FNV-1a
+static unsigned long file_cache_hash(const char *key) {
+    unsigned long h = 14695981039346656037UL;
+
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static file_entry_t *file_cache_find(const char *key, unsigned long hash) {
+    file_entry_t *entry =
+        __atomic_load_n(&buckets[hash & mask], __ATOMIC_ACQUIRE);
+
+    for (; entry; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+        if (entry->hash == hash && strcmp(entry->path, key) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+void file_cache_hold(file_entry_t *entry) {
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+}
+
+void file_cache_put(file_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (entry->response) {
+            __atomic_sub_fetch(&response_cache_used, entry->response->len,
+                               __ATOMIC_RELAXED);
+            free(entry->response);
+        }
+        if (entry->gzip_response) {
+            __atomic_sub_fetch(&gzip_cache_used, entry->gzip_response->len,
+                               __ATOMIC_RELAXED);
+            free(entry->gzip_response);
+        }
+        if (entry->gzip_sibling)
+            file_cache_put(entry->gzip_sibling);
+        close(entry->fd);
+        free(entry);
+    }
+}
+
+// conn_release_t for file bodies queued with conn_write_file()
+void file_cache_release(void *entry) {
+    file_cache_put(entry);
+}
+
+static void file_cache_wake(void) {
+    uint64_t one = 1;
+
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // already pending
+    }
+}
+
+// unlink an entry from its chain and the ring; called with cache_lock held
+static void file_cache_unlink(file_entry_t *entry) {
+    file_entry_t **link = &buckets[entry->hash & mask];
+
+    while (*link != entry)
+        link = &(*link)->next;
+    // readers standing on entry still find the rest of the chain through it
+    __atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+
+    ring[entry->slot] = NULL;
+    entry->slot = -1;
+    count--;
+
+    entry->retired = retired;
+    retired = entry;
+    if (++nretired == FILE_CACHE_RETIRE_BATCH)
+        file_cache_wake();
+}
+
+// run the CLOCK hand until it finds a victim; called with cache_lock held
+static void file_cache_evict(void) {
+    while (1) {
+        file_entry_t *entry = ring[hand];
+        if (entry && entry->referenced) {
+            entry->referenced = 0;
+        } else if (entry) {
+            file_cache_unlink(entry);
+            return;
+        }
+        hand = (hand + 1) % capacity;
+    }
+}
+
+// watch one directory (dir[0..len)) unless it already is; cache_lock held
+static void file_cache_watch_dir(const char *dir, size_t len) {
+    char path[PATH_MAX];
+    int wd;
+
+    memcpy(path, dir, len);
+    path[len] = '\0';
+
+    for (int i = 0; i < nwatches; i++) {
+        if (strcmp(watches[i].dir, path) == 0)
+            return;
+    }
+
+    wd = inotify_add_watch(inotify_fd, len ? path : ".",
+                           IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE |
+                               IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0)
+        return; // entries below it only go away by eviction
+
+    // a directory that was moved here is still watched under its old name
+    for (int i = 0; i < nwatches; i++) {
+        if (watches[i].wd == wd) {
+            strcpy(watches[i].dir, path);
+            return;
+        }
+    }
+
+    if (nwatches == watch_cap) {
+        watch_cap = watch_cap ? watch_cap * 2 : 16;
+        watches = realloc_or_die(watches, watch_cap * sizeof(file_watch_t));
+    }
+    watches[nwatches].wd = wd;
+    strcpy(watches[nwatches].dir, path);
+    nwatches++;
+}
+
+//
+// Watch every directory on the way to a cached file, so that renaming
+// any of them is noticed too, not just changes next to the file
+//
+static void file_cache_watch(const char *key) {
+    file_cache_watch_dir(key, 0);
+    for (const char *p = key; (p = strchr(p, '/')) != NULL; p++)
+        file_cache_watch_dir(key, p - key);
+}
+
+//
+// Put a freshly opened entry in the table, unless the file changed since
+// gen was read or another thread got there first. Takes the table's
+// reference on success.
+//
+static void file_cache_insert(file_entry_t *entry, unsigned long gen) {
+    file_entry_t **bucket = &buckets[entry->hash & mask];
+
+    pthread_mutex_lock(&cache_lock);
+    if (generation != gen || file_cache_find(entry->path, entry->hash)) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    if (count == capacity)
+        file_cache_evict();
+    while (ring[hand] != NULL)
+        hand = (hand + 1) % capacity;
+    entry->slot = hand;
+    ring[hand] = entry;
+    count++;
+
+    file_cache_hold(entry);
+    entry->next = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int file_cache_is_gz(const char *path) {
+    size_t len = strlen(path);
+    return len > 3 && strcmp(path + len - 3, ".gz") == 0;
+}
+
+//
+// Format the entry's validators once, so conditional requests and the
+// response headers just copy them
+//
+static void file_cache_validators(file_entry_t *entry) {
+    struct stat *st = &entry->st;
+    struct tm tm;
+
+    snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx-%llx.%lx\"",
+             (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(entry->last_modified, sizeof(entry->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//
+// Open and stat a file into a new, unshared entry. Returns NULL with errno
+// ENOENT if there is no such file, or EACCES if it isn't a readable
+// regular file.
+//
+static file_entry_t *file_cache_entry_open(const char *key,
+                                           unsigned long hash) {
+    file_entry_t *entry;
+    struct stat st;
+    int fd;
+
+    fd = open(key[0] ? key : ".", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        errno = errno == ENOENT || errno == ENOTDIR ? ENOENT : EACCES;
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(S_IRUSR & st.st_mode)) {
+        close(fd);
+        errno = EACCES;
+        return NULL;
+    }
+
+    entry = malloc_or_die(sizeof(file_entry_t) + strlen(key) + 1);
+    entry->next = NULL;
+    entry->retired = NULL;
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->referenced = 0;
+    entry->slot = -1;
+    entry->fd = fd;
+    entry->st = st;
+    entry->mime = getMimeType(key);
+    file_cache_validators(entry);
+    entry->hits = 1;
+    entry->response = NULL;
+    entry->gzip_sibling = NULL;
+    entry->gzip_response = NULL;
+    entry->gzip_state = GZIP_NONE;
+    entry->compress_next = NULL;
+    entry->vary = 0;
+    strcpy(entry->path, key);
+    return entry;
+}
+
+//
+// Look up a docroot file by its normalized path ("a/b/c", as the request
+// parser leaves it), opening it on a miss. Returns 0 and a referenced
+// entry (drop it with file_cache_put()), ENOENT if there is no such file,
+// or EACCES if it isn't a readable regular file.
+//
+int file_cache_open(const char *key, file_entry_t **out) {
+    unsigned long hash, gen = 0;
+    file_entry_t *entry = NULL;
+
+    if (strlen(key) >= PATH_MAX)
+        return ENOENT;
+    hash = file_cache_hash(key);
+
+    if (capacity > 0) {
+        rcu_read_lock();
+        entry = file_cache_find(key, hash);
+        if (entry) {
+            file_cache_hold(entry);
+            if (__atomic_load_n(&entry->response, __ATOMIC_ACQUIRE) == NULL)
+                __atomic_add_fetch(&entry->hits, 1, __ATOMIC_RELAXED);
+            // only write the bit when it changes, hot entries stay shared
+            if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+                __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        }
+        rcu_read_unlock();
+        if (entry) {
+            stats_add(STAT_FILE_CACHE_HITS, 1);
+            *out = entry;
+            return 0;
+        }
+
+        // watch before opening: a change after this point is either seen
+        // by the open or invalidates the entry
+        pthread_mutex_lock(&cache_lock);
+        file_cache_watch(key);
+        gen = generation;
+        pthread_mutex_unlock(&cache_lock);
+    }
+    stats_add(STAT_FILE_CACHE_MISSES, 1);
+
+    entry = file_cache_entry_open(key, hash);
+    if (entry == NULL)
+        return errno;
+
+    // look for a precompressed sibling once, not on every request
+    if (!file_cache_is_gz(key)) {
+        char gz[PATH_MAX + 3];
+        snprintf(gz, sizeof(gz), "%s.gz", key);
+        entry->gzip_sibling = file_cache_entry_open(gz, 0);
+    }
+    entry->vary = entry->gzip_sibling != NULL ||
+                  (capacity > 0 && gzip_cache_budget > 0 &&
+                   mime_compressible(entry->mime));
+
+    if (capacity > 0)
+        file_cache_insert(entry, gen);
+    *out = entry;
+    return 0;
+}
+
+//
+// Whether a response for this entry should be prebuilt now: the file is
+// small enough, was asked for often enough, and is in the table (so the
+// work isn't thrown away with the request).
+//
+int response_cache_admit_entry(file_entry_t *entry) {
+    return response_cache_budget > 0 &&
+           (size_t)entry->st.st_size <= response_cache_max &&
+           __atomic_load_n(&entry->hits, __ATOMIC_RELAXED) >=
+               response_cache_admit &&
+           __atomic_load_n(&entry->slot, __ATOMIC_RELAXED) >= 0;
+}
+
+//
+// Attach a prebuilt response to an entry, charging it to the budget. The
+// entry owns it from then on. Returns -1 when the budget is used up or
+// another thread attached one first; the caller keeps (and frees) it.
+//
+int response_cache_set(file_entry_t *entry, file_response_t *response) {
+    file_response_t *expected = NULL;
+
+    if (__atomic_add_fetch(&response_cache_used, response->len,
+                           __ATOMIC_RELAXED) > response_cache_budget) {
+        __atomic_sub_fetch(&response_cache_used, response->len,
+                           __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&entry->response, &expected, response, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        __atomic_sub_fetch(&response_cache_used, response->len,
+                           __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Ask for a compressed copy of a text file the client could have taken
+// gzipped; the maintenance thread makes it, and later requests use it.
+// Queued at most once per entry.
+//
+void gzip_cache_request(file_entry_t *entry) {
+    int expected = GZIP_NONE;
+
+    if (gzip_cache_budget == 0 || !mime_compressible(entry->mime) ||
+        entry->st.st_size > GZIP_CACHE_MAX || entry->st.st_size == 0 ||
+        __atomic_load_n(&entry->slot, __ATOMIC_RELAXED) < 0)
+        return;
+    if (!__atomic_compare_exchange_n(&entry->gzip_state, &expected,
+                                     GZIP_QUEUED, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+        return;
+
+    file_cache_hold(entry);
+    pthread_mutex_lock(&cache_lock);
+    entry->compress_next = compress_queue;
+    compress_queue = entry;
+    pthread_mutex_unlock(&cache_lock);
+    file_cache_wake();
+}
+
+static void gzip_cache_compress(file_entry_t *entry) {
+    file_response_t *response = NULL;
+    char *body, *gz;
+    size_t gz_len = 0, len = entry->st.st_size;
+
+    body = malloc_or_die(len);
+    if (pread(entry->fd, body, len, 0) == (ssize_t)len)
+        gz_len = gzip_compress(body, len, &gz);
+    free(body);
+    if (gz_len == 0)
+        return; // changed under us, or doesn't compress
+
+    response = request_build_response(entry, gz, gz_len, "gzip");
+    free(gz);
+
+    if (__atomic_add_fetch(&gzip_cache_used, response->len,
+                           __ATOMIC_RELAXED) > gzip_cache_budget) {
+        __atomic_sub_fetch(&gzip_cache_used, response->len, __ATOMIC_RELAXED);
+        free(response);
+        return;
+    }
+    __atomic_store_n(&entry->gzip_response, response, __ATOMIC_RELEASE);
+}
+
+static void gzip_cache_work(void) {
+    file_entry_t *list;
+
+    pthread_mutex_lock(&cache_lock);
+    list = compress_queue;
+    compress_queue = NULL;
+    pthread_mutex_unlock(&cache_lock);
+
+    while (list) {
+        file_entry_t *next = list->compress_next;
+        // skip entries that were dropped while they waited
+        if (__atomic_load_n(&list->slot, __ATOMIC_RELAXED) >= 0)
+            gzip_cache_compress(list);
+        __atomic_store_n(&list->gzip_state, GZIP_DONE, __ATOMIC_RELAXED);
+        file_cache_put(list);
+        list = next;
+    }
+}
+
+//
+// Drop every entry at or below path: the entry itself and, for a
+// directory, everything under it. "" flushes the whole table.
+//
+static void file_cache_invalidate(const char *path) {
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&cache_lock);
+    generation++;
+    for (int i = 0; i < capacity; i++) {
+        file_entry_t *entry = ring[i];
+        if (entry == NULL)
+            continue;
+        if (len == 0 || (strncmp(entry->path, path, len) == 0 &&
+                         (entry->path[len] == '\0' || entry->path[len] == '/')))
+            file_cache_unlink(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// forget a watch the kernel dropped (or that now points somewhere else)
+static void file_cache_unwatch(int i, int remove) {
+    pthread_mutex_lock(&cache_lock);
+    if (remove)
+        inotify_rm_watch(inotify_fd, watches[i].wd);
+    watches[i] = watches[--nwatches];
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void file_cache_event(struct inotify_event *event) {
+    char path[PATH_MAX * 2];
+    int i;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        file_cache_invalidate("");
+        return;
+    }
+
+    // only this thread removes watches, so the index stays valid
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < nwatches && watches[i].wd != event->wd; i++)
+        ;
+    if (i == nwatches) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    strcpy(path, watches[i].dir);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        if (path[0] == '\0')
+            file_cache_invalidate("");
+        else
+            file_cache_invalidate(path);
+        file_cache_unwatch(i, !(event->mask & IN_IGNORED));
+        return;
+    }
+
+    if (event->len == 0)
+        return;
+    if (path[0] != '\0')
+        strcat(path, "/");
+    strncat(path, event->name, PATH_MAX - 1);
+    file_cache_invalidate(path);
+    if (file_cache_is_gz(path)) {
+        path[strlen(path) - 3] = '\0';
+        file_cache_invalidate(path);
+    }
+}
+
+// drop the table's reference to retired entries, once no reader can see them
+static void file_cache_reclaim(void) {
+    file_entry_t *list;
+
+    pthread_mutex_lock(&cache_lock);
+    list = retired;
+    retired = NULL;
+    nretired = 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (list == NULL)
+        return;
+    rcu_synchronize();
+    while (list) {
+        file_entry_t *next = list->retired;
+        file_cache_put(list);
+        list = next;
+    }
+}
+
+static void *file_cache_thread(void *arg) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+
+    while (1) {
+        if (poll(fds, 2, 1000) < 0 && errno != EINTR)
+            perror("poll");
+
+        if (fds[0].revents & POLLIN) {
+            ssize_t n;
+            while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + n;) {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    file_cache_event(event);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t val;
+            if (read(wake_fd, &val, sizeof(val)) < 0) {
+                // spurious
+            }
+        }
+        gzip_cache_work();
+        file_cache_reclaim();
+    }
+    return NULL;
+}
+
+static unsigned long response_cache_bytes(void) {
+    return __atomic_load_n(&response_cache_used, __ATOMIC_RELAXED);
+}
+
+static unsigned long gzip_cache_bytes(void) {
+    return __atomic_load_n(&gzip_cache_used, __ATOMIC_RELAXED);
+}
+
+// size the table and start the maintenance thread; capacity 0 disables it
+void file_cache_init(int entries) {
+    unsigned long nbuckets = 64;
+    pthread_t thread;
+
+    stats_add_gauge("response_cache_bytes", "Memory held by prebuilt responses",
+                    response_cache_bytes);
+    stats_add_gauge("gzip_cache_bytes", "Memory held by gzipped copies",
+                    gzip_cache_bytes);
+    if (entries <= 0)
+        return;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_fd < 0 || wake_fd < 0) {
+        perror("file cache disabled");
+        return;
+    }
+
+    while (nbuckets < (unsigned long)entries * 2)
+        nbuckets *= 2;
+    buckets = calloc(nbuckets, sizeof(file_entry_t *));
+    ring = calloc(entries, sizeof(file_entry_t *));
+    assert(buckets != NULL && ring != NULL);
+    mask = nbuckets - 1;
+    capacity = entries;
+
+    if (pthread_create(&thread, NULL, file_cache_thread, NULL) != 0) {
+        perror("Failed to create file cache thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+void file_cache_report(void) {
+    unsigned long hits = stats_sum(STAT_FILE_CACHE_HITS);
+    unsigned long misses = stats_sum(STAT_FILE_CACHE_MISSES);
+
+    if (hits + misses == 0)
+        return;
+    printf("File cache: %lu hits, %lu misses (%.1f%% hit rate)\n", hits,
+           misses, 100.0 * hits / (hits + misses));
+    printf("Response cache: %lu hits, %zu bytes in use\n",
+           stats_sum(STAT_RESPONSE_CACHE_HITS),
+           __atomic_load_n(&response_cache_used, __ATOMIC_RELAXED));
+    printf("Gzip cache: %lu hits, %zu bytes in use\n",
+           stats_sum(STAT_GZIP_CACHE_HITS),
+           __atomic_load_n(&gzip_cache_used, __ATOMIC_RELAXED));
+}
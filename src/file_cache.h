@@ -0,0 +1,75 @@
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <sys/stat.h>
+
+// default number of open files kept around
+#define FILE_CACHE_ENTRIES (512)
+
+// defaults for the prebuilt responses kept with small, hot entries
+#define RESPONSE_CACHE_MAX (64 * 1024)            // largest file body
+#define RESPONSE_CACHE_BUDGET (32 * 1024 * 1024) // bytes for all of them
+#define RESPONSE_CACHE_ADMIT (2)                 // requests before caching
+
+// defaults for gzip variants compressed in the background
+#define GZIP_CACHE_MAX (1024 * 1024)          // largest file compressed
+#define GZIP_CACHE_BUDGET (16 * 1024 * 1024) // bytes for all of them
+
+// A complete response (status line, headers, body) in one buffer; the
+// Connection header goes at split when the connection needs one
+typedef struct {
+    size_t len;
+    size_t split;
+    char data[];
+} file_response_t;
+
+//
+// An open docroot file with everything needed to serve it. Entries are
+// shared and reference counted: the table holds one reference, and so
+// does every request or queued response using the entry.
+//
+typedef struct file_entry {
+    struct file_entry *next;    // hash chain, walked by readers without locks
+    struct file_entry *retired; // retire list, once unlinked
+    unsigned long hash;
+    int refs;
+    int referenced; // CLOCK bit, set on hits
+    int slot;       // position in the CLOCK ring, -1 if not cached
+    int fd;
+    struct stat st;
+    const char *mime;
+    char etag[64];          // strong validator from inode, size and mtime
+    char last_modified[32]; // mtime as an HTTP date
+    unsigned hits; // requests served, counted until a response is built
+    file_response_t *response; // built once the entry is hot
+
+    // gzip variant: a precompressed "<path>.gz" next to the file, or one
+    // compressed in the background (as a prebuilt response)
+    struct file_entry *gzip_sibling;
+    file_response_t *gzip_response;
+    int gzip_state; // GZIP_NONE, GZIP_QUEUED or GZIP_DONE
+    struct file_entry *compress_next;
+    int vary; // the response depends on Accept-Encoding
+
+    char path[]; // normalized, relative to the docroot
+} file_entry_t;
+
+enum GzipState { GZIP_NONE, GZIP_QUEUED, GZIP_DONE };
+
+// admission policy for prebuilt responses
+extern size_t response_cache_max;
+extern size_t response_cache_budget;
+extern unsigned response_cache_admit;
+extern size_t gzip_cache_budget;
+
+void file_cache_init(int capacity);
+int file_cache_open(const char *key, file_entry_t **entry);
+void file_cache_hold(file_entry_t *entry);
+void file_cache_put(file_entry_t *entry);
+void file_cache_release(void *entry);
+int response_cache_admit_entry(file_entry_t *entry);
+int response_cache_set(file_entry_t *entry, file_response_t *response);
+void gzip_cache_request(file_entry_t *entry);
+void file_cache_report(void);
+
+#endif // __FILE_CACHE_H__
@@ -0,0 +1,334 @@
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "io_helper.h"
+#include "log.h"
+
+//
+// A thread's ring is single producer (the thread) and single consumer (the
+// writer thread): head only ever moves forward in the owner, tail in the
+// writer, so neither side takes a lock or writes the other's cache line.
+//
+typedef struct {
+    unsigned long head __attribute__((aligned(64))); // bytes ever appended
+    unsigned long tail __attribute__((aligned(64))); // bytes ever written out
+    int used;
+    char buf[LOG_RING_SIZE];
+} log_ring_t;
+
+static log_ring_t *rings[LOG_MAX_THREADS];
+static int nrings; // slots ever handed out
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread log_ring_t *self;
+
+static int log_fd = -1; // -1 until log_init(): write straight to stdout
+static int wake_fd = -1;
+static unsigned long dropped;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Timestamps, formatted by the writer thread when the second changes and
+// copied out by everyone else under a sequence lock
+static struct {
+    unsigned seq; // odd while being rewritten
+    time_t now;
+    char clock[16]; // [HH:MM:SS]
+    char clf[32];   // 17/Oct/2026:10:00:00 +0000
+} stamp;
+
+static void log_stamp_refresh(time_t now) {
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    __atomic_add_fetch(&stamp.seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    stamp.now = now;
+    strftime(stamp.clock, sizeof(stamp.clock), "[%H:%M:%S]", &tm);
+    strftime(stamp.clf, sizeof(stamp.clf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    __atomic_add_fetch(&stamp.seq, 1, __ATOMIC_RELEASE);
+}
+
+static void log_stamp_copy(char *buf, int clf) {
+    unsigned seq;
+
+    do {
+        seq = __atomic_load_n(&stamp.seq, __ATOMIC_ACQUIRE);
+        if (clf)
+            memcpy(buf, stamp.clf, sizeof(stamp.clf));
+        else
+            memcpy(buf, stamp.clock, sizeof(stamp.clock));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&stamp.seq, __ATOMIC_RELAXED));
+}
+
+static log_ring_t *log_register_thread(void) {
+    log_ring_t *ring = NULL;
+
+    // reuse a slot given back by a retired thread once it has drained
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < nrings && ring == NULL; i++) {
+        if (!rings[i]->used && __atomic_load_n(&rings[i]->tail, __ATOMIC_ACQUIRE) ==
+                                   rings[i]->head)
+            ring = rings[i];
+    }
+    if (ring == NULL) {
+        assert(nrings < LOG_MAX_THREADS);
+        ring = malloc_or_die(sizeof(log_ring_t));
+        ring->head = 0;
+        ring->tail = 0;
+        rings[nrings] = ring;
+        __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    }
+    ring->used = 1;
+    pthread_mutex_unlock(&registry_lock);
+    return ring;
+}
+
+void log_unregister_thread(void) {
+    if (self == NULL)
+        return;
+    pthread_mutex_lock(&registry_lock);
+    self->used = 0;
+    pthread_mutex_unlock(&registry_lock);
+    self = NULL;
+}
+
+//
+// Append one complete line to the calling thread's ring, or drop it if
+// there is no room. The writer is only woken when the ring fills past
+// half; otherwise it comes round on its own within LOG_FLUSH_MS.
+//
+static void log_append(const char *line, size_t len) {
+    unsigned long used, pos;
+    size_t first;
+
+    if (log_fd < 0) {
+        fwrite(line, 1, len, stdout);
+        return;
+    }
+    if (self == NULL)
+        self = log_register_thread();
+
+    used = self->head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - used < len) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    pos = self->head % LOG_RING_SIZE;
+    first = len < LOG_RING_SIZE - pos ? len : LOG_RING_SIZE - pos;
+    memcpy(self->buf + pos, line, first);
+    memcpy(self->buf, line + first, len - first);
+    __atomic_store_n(&self->head, self->head + len, __ATOMIC_RELEASE);
+
+    if (used < LOG_RING_SIZE / 2 && used + len >= LOG_RING_SIZE / 2) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            ; // the timeout will get to it
+    }
+}
+
+//
+// Write out everything published so far, up to LOG_IOV pieces per
+// writev(). A ring's tail only moves once its bytes are in the file, so a
+// partial write just continues where it stopped.
+//
+#define LOG_IOV (256)
+
+static void log_write_batch(struct iovec *iov, log_ring_t **owner, int n) {
+    int i = 0;
+
+    while (i < n) {
+        ssize_t written = writev(log_fd, iov + i, n - i);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            // nowhere to put it: count it as lost rather than retry forever
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            for (; i < n; i++)
+                __atomic_store_n(&owner[i]->tail, owner[i]->tail + iov[i].iov_len,
+                                 __ATOMIC_RELEASE);
+            return;
+        }
+        while (i < n && (size_t)written >= iov[i].iov_len) {
+            written -= iov[i].iov_len;
+            __atomic_store_n(&owner[i]->tail, owner[i]->tail + iov[i].iov_len,
+                             __ATOMIC_RELEASE);
+            i++;
+        }
+        if (i < n && written > 0) {
+            iov[i].iov_base = (char *)iov[i].iov_base + written;
+            iov[i].iov_len -= written;
+            __atomic_store_n(&owner[i]->tail, owner[i]->tail + written,
+                             __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void log_drain(void) {
+    struct iovec iov[LOG_IOV];
+    log_ring_t *owner[LOG_IOV];
+    int n = 0, count = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+    // keep the order with whatever was printf()ed before
+    if (log_fd == STDOUT_FILENO)
+        fflush(stdout);
+
+    for (int i = 0; i < count; i++) {
+        log_ring_t *ring = rings[i];
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        size_t pos = tail % LOG_RING_SIZE, len = head - tail;
+
+        if (len == 0)
+            continue;
+        if (n + 2 > LOG_IOV) {
+            log_write_batch(iov, owner, n);
+            n = 0;
+        }
+        // at most two pieces: up to the end of the buffer, then from its start
+        if (pos + len > LOG_RING_SIZE) {
+            iov[n].iov_base = ring->buf + pos;
+            iov[n].iov_len = LOG_RING_SIZE - pos;
+            owner[n++] = ring;
+            len -= LOG_RING_SIZE - pos;
+            pos = 0;
+        }
+        iov[n].iov_base = ring->buf + pos;
+        iov[n].iov_len = len;
+        owner[n++] = ring;
+    }
+    if (n > 0)
+        log_write_batch(iov, owner, n);
+}
+
+static void *log_thread(void *arg) {
+    struct pollfd pfd = {.fd = wake_fd, .events = POLLIN};
+
+    while (1) {
+        if (poll(&pfd, 1, LOG_FLUSH_MS) > 0) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0)
+                ; // woken anyway
+        }
+        time_t now = time(NULL);
+        if (now != stamp.now)
+            log_stamp_refresh(now);
+
+        pthread_mutex_lock(&drain_lock);
+        log_drain();
+        pthread_mutex_unlock(&drain_lock);
+    }
+    return NULL;
+}
+
+void log_init(const char *path) {
+    pthread_t thread;
+    sigset_t all, old;
+
+    log_stamp_refresh(time(NULL));
+    if (path == NULL || strcmp(path, "-") == 0) {
+        log_fd = STDOUT_FILENO;
+    } else if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                              0644)) < 0) {
+        perror("Failed to open log file");
+        exit(EXIT_FAILURE);
+    }
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // ctrl-C must not land on the writer while it holds drain_lock
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+        perror("Failed to create log thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+}
+
+void logMessage(const char *format, ...) {
+    char line[LOG_LINE_MAX];
+    va_list arg;
+    int n;
+
+    log_stamp_copy(line, 0);
+    n = strlen(line);
+    line[n++] = ' ';
+
+    va_start(arg, format);
+    n += vsnprintf(line + n, sizeof(line) - n - 1, format, arg);
+    va_end(arg);
+    if (n > (int)sizeof(line) - 2)
+        n = sizeof(line) - 2;
+    line[n++] = '\n';
+    log_append(line, n);
+}
+
+// copy src for a quoted log field: quotes, backslashes and control
+// characters become \xHH so a request can't forge log lines
+static size_t log_escape(char *dst, size_t size, const char *src) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+
+    for (; *src && n + 4 < size; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) {
+            dst[n++] = '\\';
+            dst[n++] = 'x';
+            dst[n++] = hex[c >> 4];
+            dst[n++] = hex[c & 15];
+        } else {
+            dst[n++] = c;
+        }
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+void log_access(const char *peer, const char *method, const char *uri,
+                const char *version, int status, long long bytes, long usec) {
+    char line[LOG_LINE_MAX], request[LOG_LINE_MAX - 128];
+    char clf[sizeof(stamp.clf)];
+    size_t n = 0;
+
+    if (method == NULL) {
+        strcpy(request, "-"); // never got a request line
+    } else {
+        n = log_escape(request, sizeof(request), method);
+        request[n++] = ' ';
+        n += log_escape(request + n, sizeof(request) - n, uri);
+        if (version[0] != '\0' && n + 2 < sizeof(request)) {
+            request[n++] = ' ';
+            log_escape(request + n, sizeof(request) - n, version);
+        }
+    }
+    log_stamp_copy(clf, 1);
+    n = snprintf(line, sizeof(line), "%s - - [%s] \"%s\" %d %lld %ldus\n", peer,
+                 clf, request, status, bytes, usec);
+    if (n >= sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+    log_append(line, n);
+}
+
+unsigned long log_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+void log_flush(void) {
+    if (log_fd < 0) {
+        fflush(stdout);
+        return;
+    }
+    // if the writer is in the middle of a drain, it finishes the job
+    if (pthread_mutex_trylock(&drain_lock) != 0)
+        return;
+    log_drain();
+    pthread_mutex_unlock(&drain_lock);
+}
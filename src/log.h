@@ -0,0 +1,38 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+//
+// Asynchronous logging. Each thread appends formatted lines to its own
+// lock-free ring; a writer thread drains all the rings with one writev()
+// to the log file every so often. A thread whose ring is full drops the
+// line and counts it instead of waiting. Timestamps come from strings the
+// writer thread refreshes once a second.
+//
+
+#define LOG_RING_SIZE (64 * 1024) // bytes buffered per thread
+#define LOG_MAX_THREADS (1024)
+#define LOG_LINE_MAX (2048)
+#define LOG_FLUSH_MS (100) // longest a line waits in its ring
+
+// path NULL or "-" logs to stdout
+void log_init(const char *path);
+
+// "[HH:MM:SS] message" line, printf style
+void logMessage(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+// Common Log Format line plus the time it took, e.g.
+// 127.0.0.1 - - [17/Oct/2026:10:00:00 +0000] "GET /index.html HTTP/1.1" 200 155 42us
+void log_access(const char *peer, const char *method, const char *uri,
+                const char *version, int status, long long bytes, long usec);
+
+// lines lost to full rings
+unsigned long log_dropped(void);
+
+// write out everything buffered so far (at exit)
+void log_flush(void);
+
+// give the calling thread's ring back once drained (a retiring thread)
+void log_unregister_thread(void);
+
+#endif // __LOG_H__
@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <netdb.h> // for getnameinfo()
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -15,11 +16,25 @@
 // Socket headers
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
-#include <semaphore.h>
 
+#include "admit.h"
+#include "cgi.h"
+#include "conn.h"
+#include "conn_queue.h"
+#include "event_loop.h"
+#include "fcgi.h"
+#include "file_cache.h"
+#include "io_helper.h"
+#include "log.h"
+#include "mime.h"
+#include "rcu.h"
 #include "request.h"
+#include "scan.h"
 #include "server.h"
+#include "stats.h"
+#include "uring.h"
 
 // For enabling strncasecmp(), getnameinfo(), etc.
 #define _POSIX_C_SOURCE 200809L
@@ -27,99 +42,334 @@
 #define VERSION 23
 #define DEFAULT_PORT 8080
 
+// Pool mode grows from -t workers up to -w when connections queue up,
+// and shrinks back once they sit idle. The controller looks every
+// POOL_TICK_MS; it grows after a backlog has lasted POOL_GROW_TICKS looks,
+// or at once when the acceptor had to turn a connection away, and retires
+// workers only after fewer than half have been busy, with nothing queued,
+// for POOL_COOLDOWN_TICKS looks in a row. The gap between the two
+// conditions keeps the pool from see-sawing.
+#define POOL_MAX_WORKERS (64)
+#define POOL_TICK_MS (100)
+#define POOL_GROW_TICKS (2)
+#define POOL_COOLDOWN_TICKS (100) // 10 s
+
+// Every thread that serves requests takes a slot in the stats, log and
+// RCU registries, which are fixed in size. Besides the shards' threads
+// there are a few of the server's own (main, log writer, CGI helper,
+// FastCGI monitor, file cache).
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define THREADS_MAX MIN(MIN(STATS_MAX_THREADS, LOG_MAX_THREADS), RCU_MAX_THREADS)
+#define SERVER_THREADS (16)
+
 HTTP_Server http_server;
 
+// A listening socket with its own accept thread, connection queue and
+// workers. Without -s there is a single unpinned shard; with -s every
+// shard has a SO_REUSEPORT listener and all its threads share one CPU.
+// With -m steal each worker has its own queue instead of sharing one.
+typedef struct shard shard_t;
+
 typedef struct {
-    int buffer[1024];
-    int in;                  // insertion index
-    int out;                 // removal index
-    int size;                // current number of items
-    int capacity;            // maximum capacity
-    pthread_mutex_t mutex;   // protects buffer access
-    sem_t empty;             // counts empty slots
-    sem_t full;              // counts full slots
-} conn_buffer_t;
-
-// Global variables for thread pool and buffer
-conn_buffer_t connection_buffer;
-pthread_t *worker_threads;
-int thread_pool_size;
+    shard_t *shard;
+    int index; // which queue is its own when stealing
+} worker_t;
+
+struct shard {
+    HTTP_Server server;
+    conn_queue_t queue;
+    conn_steal_t steal;
+    bool stealing;
+    pthread_t acceptor;
+    pthread_t controller;
+    int cpu; // -1 when not pinned
+
+    // pool size: changed only by the controller (workers counts those
+    // told to retire as gone); busy is bumped by the workers themselves
+    int workers;
+    int busy;
+
+    // set by the acceptor when the queue is full but the pool may grow,
+    // to wake the controller before its next look
+    pthread_mutex_t grow_lock;
+    pthread_cond_t grow_wake;
+    bool grow;
+};
+
+// Global variables for the thread pool shards
+shard_t *shards;
+int nshards;
+int thread_pool_size; // workers per shard, the least in pool mode
+int pool_max_size;    // the most workers per shard in pool mode
+int queue_size;       // accepted connections waiting per shard, 0 = auto
+
+// handed to a worker instead of a connection: exit
+#define WORKER_RETIRE NULL
 
 void *worker_thread(void *arg);
 
-// Buffer functions
-void buffer_init(conn_buffer_t *cb, int capacity) {
-    cb->in = 0;
-    cb->out = 0;
-    cb->size = 0;
-    cb->capacity = capacity;
-    pthread_mutex_init(&cb->mutex, NULL);
-    sem_init(&cb->empty, 0, capacity);
-    sem_init(&cb->full, 0, 0);
-}
+// Worker thread function
+void *worker_thread(void *arg) {
+    worker_t *worker = arg;
+    shard_t *shard = worker->shard;
+
+    while (1) {
+        conn_t *conn = shard->stealing
+                           ? conn_steal_get(&shard->steal, worker->index)
+                           : conn_queue_get(&shard->queue);
+
+        if (conn == WORKER_RETIRE)
+            break;
+        __atomic_add_fetch(&shard->busy, 1, __ATOMIC_RELAXED);
+
+        // an idle keep-alive connection gives its worker back after this
+        struct timeval idle = {.tv_sec = conn_idle_timeout};
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+        // serve requests until the client or a keep-alive limit says stop
+        while (1) {
+            int ready = conn_read_request(conn);
+            if (ready == 0)
+                break; // closed, or idle for too long
+            if (ready > 0)
+                handle_requests(conn);
+            else
+                handle_bad_request(conn);
+            if (conn_flush(conn) < 0 || !conn->keep_alive)
+                break;
+            conn_next_request(conn);
+        }
+        conn_free(conn); // closes the socket
+        __atomic_sub_fetch(&shard->busy, 1, __ATOMIC_RELAXED);
+    }
 
-void buffer_put(conn_buffer_t *cb, int connfd) {
-    sem_wait(&cb->empty);
-    pthread_mutex_lock(&cb->mutex);
-    
-    cb->buffer[cb->in] = connfd;
-    cb->in = (cb->in + 1) % cb->capacity;
-    cb->size++;
-    
-    pthread_mutex_unlock(&cb->mutex);
-    sem_post(&cb->full);
+    // give back this thread's log ring, RCU and stats slots for reuse
+    log_unregister_thread();
+    rcu_unregister_thread();
+    stats_unregister_thread();
+    free(worker);
+    return NULL;
 }
 
-int buffer_get(conn_buffer_t *cb) {
-    int connfd;
-    
-    sem_wait(&cb->full);
-    pthread_mutex_lock(&cb->mutex);
-    
-    connfd = cb->buffer[cb->out];
-    cb->out = (cb->out + 1) % cb->capacity;
-    cb->size--;
-    
-    pthread_mutex_unlock(&cb->mutex);
-    sem_post(&cb->empty);
-    
-    return connfd;
+// ask the pool controller to grow the pool now rather than at its next look
+static void shard_grow(shard_t *shard) {
+    if (__atomic_load_n(&shard->grow, __ATOMIC_RELAXED))
+        return; // already asked
+    pthread_mutex_lock(&shard->grow_lock);
+    __atomic_store_n(&shard->grow, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&shard->grow_wake);
+    pthread_mutex_unlock(&shard->grow_lock);
 }
 
-void buffer_destroy(conn_buffer_t *cb) {
-    pthread_mutex_destroy(&cb->mutex);
-    sem_destroy(&cb->empty);
-    sem_destroy(&cb->full);
+//
+// Hand a connection to a worker without stopping to wait for one: the
+// accept thread must keep going, or the kernel's backlog fills and clients
+// time out without an answer. Returns -1 if the queue is full and the
+// connection should be turned away; a pool that can still grow is told
+// to, for the connections after it.
+//
+int shard_put(shard_t *shard, conn_t *conn) {
+    if (shard->stealing)
+        return conn_steal_offer(&shard->steal, conn);
+    if (conn_queue_offer(&shard->queue, conn) == 0)
+        return 0;
+    if (__atomic_load_n(&shard->workers, __ATOMIC_RELAXED) < pool_max_size)
+        shard_grow(shard);
+    return -1;
 }
 
-// Worker thread function
-void *worker_thread(void *arg) {
+// Accept thread function, one per shard
+void *accept_thread(void *arg) {
+    shard_t *shard = arg;
+
     while (1) {
-        int connfd = buffer_get(&connection_buffer);
-        handle_request((void *)&connfd);
-        close(connfd);
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int client_fd = accept(shard->server.socket, (sockaddr_t *)&addr, &len);
+
+        if (client_fd < 0) {
+            perror("Accept failed");
+            continue;
+        }
+
+        // Count the connection against its client before it takes up a
+        // queue slot, then hand it to a worker, or answer it with a 503;
+        // the worker gets the count along with it
+        conn_t *conn = conn_new(client_fd);
+        if (admit_conn(conn, (sockaddr_t *)&addr) < 0 ||
+            shard_put(shard, conn) < 0) {
+            admit_refuse(client_fd);
+            conn_free(conn);
+        }
     }
     return NULL;
 }
 
-void logMessage(const char *format, ...) {
-    va_list arg;
-    va_start(arg, format);
-    char buf[1024];
+// accepted connections no worker has picked up yet, over all shards
+unsigned long queued_connections(void) {
+    unsigned long n = 0;
+
+    for (int i = 0; i < nshards; i++) {
+        shard_t *shard = &shards[i];
+        if (shard->stealing) {
+            for (int q = 0; q < shard->steal.nqueues; q++)
+                n += conn_queue_depth(&shard->steal.queues[q]);
+        } else {
+            n += conn_queue_depth(&shard->queue);
+        }
+    }
+    return n;
+}
+
+// worker threads over all shards, and how many are serving a connection
+unsigned long pool_workers(void) {
+    unsigned long n = 0;
+
+    for (int i = 0; i < nshards; i++)
+        n += __atomic_load_n(&shards[i].workers, __ATOMIC_RELAXED);
+    return n;
+}
+
+unsigned long busy_workers(void) {
+    unsigned long n = 0;
+
+    for (int i = 0; i < nshards; i++)
+        n += __atomic_load_n(&shards[i].busy, __ATOMIC_RELAXED);
+    return n;
+}
+
+void start_worker(shard_t *shard, int index) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    worker_t *worker = malloc_or_die(sizeof(worker_t));
+
+    worker->shard = shard;
+    worker->index = index;
+    server_pin_attr(&attr, shard->cpu);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, worker_thread, worker) != 0) {
+        perror("Failed to create worker thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&attr);
+    __atomic_add_fetch(&shard->workers, 1, __ATOMIC_RELAXED);
+}
+
+// sleep until the next look, or until the acceptor asks for growth;
+// returns true in the second case
+static bool pool_wait(shard_t *shard) {
+    struct timespec deadline;
+    bool grow;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += POOL_TICK_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&shard->grow_lock);
+    while (!shard->grow && pthread_cond_timedwait(&shard->grow_wake,
+                                                  &shard->grow_lock,
+                                                  &deadline) == 0)
+        ;
+    grow = shard->grow;
+    pthread_mutex_unlock(&shard->grow_lock);
+    return grow;
+}
+
+//
+// Size a pool-mode shard to its load. A backlog means every worker is
+// tied up (keep-alive connections and CGI programs hold one for a long
+// time), so the pool grows by up to its current size at once. It gives
+// back one worker per look once the cooldown has passed.
+//
+void *pool_controller(void *arg) {
+    shard_t *shard = arg;
+    int backlog = 0, calm = 0;
+
+    while (1) {
+        int workers, busy, queued;
+        bool urgent = pool_wait(shard);
+
+        workers = __atomic_load_n(&shard->workers, __ATOMIC_RELAXED);
+        busy = __atomic_load_n(&shard->busy, __ATOMIC_RELAXED);
+        queued = conn_queue_depth(&shard->queue);
+
+        backlog = queued > 0 ? backlog + 1 : 0;
+        calm = queued == 0 && busy * 2 < workers ? calm + 1 : 0;
+
+        if ((urgent || backlog >= POOL_GROW_TICKS) && workers < pool_max_size) {
+            int add = queued < workers ? queued : workers;
+            if (add < 1)
+                add = 1;
+            if (add > pool_max_size - workers)
+                add = pool_max_size - workers;
+            for (int i = 0; i < add; i++)
+                start_worker(shard, workers + i);
+            backlog = 0;
+        }
+        if (urgent) {
+            // connections refused while the new workers started asked for
+            // the same growth; if the queue is still full, they ask again
+            pthread_mutex_lock(&shard->grow_lock);
+            __atomic_store_n(&shard->grow, false, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&shard->grow_lock);
+        } else if (calm >= POOL_COOLDOWN_TICKS && workers > thread_pool_size) {
+            // one of the idle workers wakes up to take it; if the queue
+            // filled up since the look, it isn't the time to shrink
+            if (conn_queue_offer(&shard->queue, WORKER_RETIRE) == 0)
+                __atomic_sub_fetch(&shard->workers, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
 
-    vsnprintf(buf, sizeof(buf), format, arg);
-    va_end(arg);
+//
+// Initialize a shard's connection queue(s) and start its workers, plus
+// the controller that resizes a pool-mode shard
+//
+void start_shard(shard_t *shard, int threads, bool stealing) {
+    pthread_attr_t attr;
+    pthread_condattr_t cond_attr;
+    int capacity = queue_size > 0 ? queue_size : threads * 10;
+
+    shard->stealing = stealing;
+    pthread_mutex_init(&shard->grow_lock, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&shard->grow_wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    shard->grow = false;
+    if (stealing)
+        conn_steal_init(&shard->steal, threads, (capacity + threads - 1) / threads);
+    else
+        conn_queue_init(&shard->queue, capacity);
 
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    char time_str[64];
-    strftime(time_str, sizeof(time_str), "[%H:%M:%S]", tm);
+    // Create worker threads
+    for (int i = 0; i < threads; i++)
+        start_worker(shard, i);
 
-    printf("%s %s\n", time_str, buf);
+    server_pin_attr(&attr, shard->cpu);
+    if (pthread_create(&shard->acceptor, &attr, accept_thread, shard) != 0) {
+        perror("Failed to create accept thread");
+        exit(EXIT_FAILURE);
+    }
+    if (!stealing && pool_max_size > threads &&
+        pthread_create(&shard->controller, &attr, pool_controller, shard) != 0) {
+        perror("Failed to create pool controller thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&attr);
 }
 
 void cleanup(int sig) {
+    log_flush();
     printf("Cleaning up connections and exiting.\n");
+    conn_report_stats();
+    file_cache_report();
+    if (log_dropped() > 0)
+        printf("Log lines dropped: %lu\n", log_dropped());
+    fcgi_shutdown();
 
     // try to close the listening socket
     if (close(http_server.socket) < 0) {
@@ -152,29 +402,148 @@ void report(struct sockaddr_in *serverAddress) {
 int main(int argc, char *argv[]) {
     int port = DEFAULT_PORT;
     int threads = 2;
+    int max_threads = POOL_MAX_WORKERS;
     char *docroot = "docroot";
+    char *mode = "pool";
+    char *logfile = NULL; // stdout
+    int shard_count = -1; // no sharding
+    bool steer = false;
+    int cache_entries = FILE_CACHE_ENTRIES;
     int c;
 
-    while ((c = getopt(argc, argv, "d:p:t:")) != -1)
+    while ((c = getopt(argc, argv, "a:Bc:C:d:f:F:i:k:l:m:M:p:P:q:r:R:s:t:T:w:z:")) != -1)
         switch (c) {
+        case 'a':
+            response_cache_admit = atoi(optarg);
+            break;
         case 'd':
             docroot = optarg;
             break;
+        case 'B':
+            steer = true;
+            break;
+        case 'c':
+            cache_entries = atoi(optarg);
+            break;
+        case 'C':
+            cgi_max_procs = atoi(optarg);
+            break;
+        case 'f':
+            sendfile_threshold = atoll(optarg);
+            break;
+        case 'F':
+            if (fcgi_configure(optarg) < 0) {
+                fprintf(stderr, "Bad -F %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            conn_idle_timeout = atoi(optarg);
+            break;
+        case 'k':
+            conn_max_requests = atoi(optarg);
+            break;
+        case 'l':
+            logfile = optarg;
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'M':
+            response_cache_budget = (size_t)atol(optarg) * 1024 * 1024;
+            break;
+        case 's':
+            shard_count = atoi(optarg);
+            break;
         case 'p':
             port = atoi(optarg);
             break;
+        case 'P':
+            admit_max_conns = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 'r':
+            response_cache_max = atol(optarg);
+            break;
+        case 'R':
+            if (sscanf(optarg, "%d:%d", &admit_rate, &admit_burst) < 1) {
+                fprintf(stderr, "Bad -R %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 't':
             threads = atoi(optarg);
             break;
+        case 'T':
+            cgi_timeout = atoi(optarg);
+            break;
+        case 'w':
+            max_threads = atoi(optarg);
+            break;
+        case 'z':
+            gzip_cache_budget = (size_t)atol(optarg) * 1024 * 1024;
+            break;
         default:
-            printf("Usage: %s [-d docroot] [-p port] [-t threads]\n", argv[0]);
+            printf("Usage: %s [-d docroot] [-m mode] [-p port] [-t threads] [-w max_threads]\n"
+                   "       [-s shards [-B]] [-k max_requests] [-i idle_timeout] [-f sendfile_bytes]\n"
+                   "       [-c cache_entries] [-r response_bytes] [-M response_mb] [-a admit_hits]\n"
+                   "       [-z gzip_mb] [-q queue_size] [-l logfile] [-F [script=]fcgi_workers]...\n"
+                   "       [-C max_cgi] [-T cgi_seconds] [-P conns_per_client]\n"
+                   "       [-R rate[:burst]]\n",
+                   argv[0]);
             printf("  port: Port number (default: 8080)\n");
             printf("  docroot: Document root directory (default: docroot)\n");
+            printf("  mode: pool (blocking thread pool), steal (thread pool with a queue per\n"
+                   "        worker and work stealing), epoll (event loops) or uring (event\n"
+                   "        loops on io_uring, epoll if the kernel lacks it) (default: pool)\n");
             printf(
-                "  threads: Number of threads in thread pool (default: 10)\n");
+                "  threads: Number of threads in thread pool (the least, in pool mode), or event\n"
+                "           loops in epoll and uring modes (default: 2)\n");
+            printf("  max_threads: Most threads the pool grows to when connections queue up,\n"
+                   "               in pool mode (default: 64)\n");
+            printf("  shards: SO_REUSEPORT listeners, each pinned to a CPU with its own\n"
+                   "          accept path and -t threads; 0 means one per CPU (default: off)\n");
+            printf("  queue_size: Accepted connections waiting for a worker, per shard\n"
+                   "              (default: 10 per thread)\n");
+            printf("  -B: steer connections to the shard on the CPU that received them\n");
+            printf("  max_requests: Requests served per keep-alive connection (default: 100)\n");
+            printf("  idle_timeout: Seconds an idle keep-alive connection is kept open (default: 5)\n");
+            printf("  sendfile_bytes: Files this size or larger are sent with sendfile(),\n"
+                   "                  smaller ones are mmap()ed (default: 16384)\n");
+            printf("  cache_entries: Static files kept open with their stat and MIME type,\n"
+                   "                 invalidated through inotify; 0 disables (default: 512)\n");
+            printf("  response_bytes: Files up to this size get their whole response prebuilt\n"
+                   "                  in memory (default: 65536)\n");
+            printf("  response_mb: Memory for prebuilt responses, 0 disables (default: 32)\n");
+            printf("  admit_hits: Requests for a file before its response is prebuilt (default: 2)\n");
+            printf("  logfile: Access and server log, written in the background; lines are\n"
+                   "           dropped rather than wait when it falls behind (default: stdout)\n");
+            printf("  gzip_mb: Memory for text files gzipped in the background when they have\n"
+                   "           no .gz sibling, 0 disables (default: 16)\n");
+            printf("  fcgi_workers: Persistent FastCGI workers started for each *.fcgi script,\n"
+                   "                or for one script given by its URL path; repeatable;\n"
+                   "                0 runs them as plain CGI (default: 0)\n");
+            printf("  max_cgi: CGI programs running at once; more requests get a 503 (default: 64)\n");
+            printf("  cgi_seconds: CGI programs still running after this long are killed\n"
+                   "               (default: 30)\n");
+            printf("  conns_per_client: Connections one client address may have open; more\n"
+                   "                    get a 503 (default: unlimited)\n");
+            printf("  rate: Requests per second per client address, with bursts of up to\n"
+                   "        burst (default: rate) above it; more get a 429 (default: unlimited)\n");
             exit(EXIT_FAILURE);
         }
 
+    if (strcmp(mode, "pool") != 0 && strcmp(mode, "steal") != 0 &&
+        strcmp(mode, "epoll") != 0 && strcmp(mode, "uring") != 0) {
+        printf("Invalid mode: %s\n", mode);
+        exit(EXIT_FAILURE);
+    }
+
+    // before the chdir below, so a relative log path means what it says
+    log_init(logfile);
+
     // Get current working directory
     char cwd[1024];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
@@ -211,46 +580,94 @@ int main(int argc, char *argv[]) {
     // set up signal handler for ctrl-C
     (void)signal(SIGINT, cleanup);
 
-    struct sockaddr_in client_address;
-
     // initiate server
-    init_server(&http_server, port);
+    if (shard_count >= 0) {
+        int cpus[CPU_SETSIZE];
+        int ncpus = server_cpus(cpus, CPU_SETSIZE);
+
+        nshards = shard_count > 0 ? shard_count : ncpus;
+        shards = calloc(nshards, sizeof(shard_t));
+        for (int i = 0; i < nshards; i++) {
+            init_server_shard(&shards[i].server, port);
+            shards[i].cpu = cpus[i % ncpus];
+        }
+        if (steer) {
+            int *shard_cpus = malloc(nshards * sizeof(int));
+            if (shard_cpus == NULL) {
+                perror("malloc failed");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < nshards; i++)
+                shard_cpus[i] = shards[i].cpu;
+            server_steer_by_cpu(&shards[0].server, shard_cpus, nshards);
+            free(shard_cpus);
+        }
+        http_server = shards[0].server;
+        printf("HTTP Server Initialized\nPort: %d\nShards: %d\n", port, nshards);
+    } else {
+        nshards = 1;
+        shards = calloc(1, sizeof(shard_t));
+        init_server(&shards[0].server, port);
+        shards[0].cpu = -1;
+        http_server = shards[0].server;
+    }
 
     // report
     report(http_server.address);
+    printf("Request scanner: %s\n", scan_impl());
+    printf("MIME types: %d extensions\n", mime_init(MIME_TYPES_PATH));
+
+    // relative to the docroot we just moved into
+    file_cache_init(cache_entries);
+    request_init();
+    admit_init();
+    cgi_init();
 
     // Ignore SIGPIPE signal, so if browser cancels the request, it
     // won't kill the whole process.
     signal(SIGPIPE, SIG_IGN);
 
-    // Initialize thread pool and connection buffer
-    buffer_init(&connection_buffer, threads*10);
+    stats_add_gauge("open_connections", "Connections currently open",
+                    conn_open_count);
+    stats_add_gauge("queued_connections",
+                    "Accepted connections waiting for a worker",
+                    queued_connections);
+    stats_add_gauge("pool_workers", "Worker threads in pool and steal modes",
+                    pool_workers);
+    stats_add_gauge("busy_workers", "Worker threads serving a connection",
+                    busy_workers);
+
+    // Start every shard's threads, then just wait for ctrl-C. A shard's
+    // accept thread and pool controller count too, and a pool can't grow
+    // past what the thread registries have room for.
     thread_pool_size = threads;
-    worker_threads = malloc(threads * sizeof(pthread_t));
-    
-    // Create worker threads
-    for (int i = 0; i < threads; i++) {
-        if (pthread_create(&worker_threads[i], NULL, worker_thread, NULL) != 0) {
-            perror("Failed to create worker thread");
-            exit(EXIT_FAILURE);
-        }
+    pool_max_size = max_threads > threads ? max_threads : threads;
+    int room = (THREADS_MAX - SERVER_THREADS) / nshards - 2;
+    if (threads > room) {
+        printf("Error: %d shards of %d threads need more than the %d threads "
+               "the server supports\n",
+               nshards, threads, THREADS_MAX);
+        exit(EXIT_FAILURE);
     }
-
-    while (1) {
-        int client_fd = accept(http_server.socket, (struct sockaddr *)&client_address,&http_server.address_len);
-        
-        if (client_fd < 0) {
-            perror("Accept failed");
-            continue;
+    if (strcmp(mode, "pool") == 0 && pool_max_size > room) {
+        printf("Pool workers: at most %d per shard\n", room);
+        pool_max_size = room;
+    }
+    for (int i = 0; i < nshards; i++) {
+        if (strcmp(mode, "uring") == 0) {
+            if (uring_start(shards[i].server.socket, threads, shards[i].cpu) == 0)
+                continue;
+            printf("io_uring is not available, using epoll\n");
+            mode = "epoll";
         }
-        
-        logMessage("Connection accepted from %s:%d", 
-                  inet_ntoa(client_address.sin_addr),
-                  ntohs(client_address.sin_port));
-
-        // Add connection to buffer
-        buffer_put(&connection_buffer, client_fd);
+        if (strcmp(mode, "epoll") == 0)
+            event_loop_start(shards[i].server.socket, threads, shards[i].cpu);
+        else
+            start_shard(&shards[i], threads, strcmp(mode, "steal") == 0);
     }
 
+    while (1)
+        pause();
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,259 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "io_helper.h"
+#include "mime.h"
+
+typedef struct {
+    const char *ext; // lowercase, NULL for an empty slot
+    const char *type;
+    size_t len;
+} mime_entry_t;
+
+// served even when the system has no mime.types; its entries win over these
+static const mime_entry_t builtin[] = {
+    {"gif", "image/gif"},          {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},        {"png", "image/png"},
+    {"webp", "image/webp"},        {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},       {"css", "text/css"},
+    {"htm", "text/html"},          {"html", "text/html"},
+    {"txt", "text/plain"},         {"js", "text/javascript"},
+    {"json", "application/json"},  {"xml", "application/xml"},
+    {"pdf", "application/pdf"},    {"wasm", "application/wasm"},
+    {"zip", "application/zip"},    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},  {"woff2", "font/woff2"},
+};
+
+//
+// Hash and displace: an extension's hash picks its bucket, and the bucket's
+// displacement d puts it in slot (base + d * stride) & slot_mask, with base
+// and stride from other bits of the same hash. mime_init() picks every d
+// so that no two extensions share a slot.
+//
+static mime_entry_t *slots;
+static uint16_t *disp;
+static unsigned slot_mask, bucket_mask;
+static uint64_t seed;
+
+#define MIME_BUCKET(h) ((unsigned)((h) >> 48) & bucket_mask)
+#define MIME_SLOT(h, d)                                                        \
+    (((uint32_t)(h) + (d) * ((uint32_t)((h) >> 32) | 1)) & slot_mask)
+
+// FNV-1a over a lowercase extension, then mixed so every bit counts
+static uint64_t mime_hash(const char *ext, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)ext[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+const char *getMimeType(const char *filename) {
+    const char *end = filename + strlen(filename), *ext = end;
+    char lower[MIME_EXT_MAX];
+    mime_entry_t *entry;
+    uint64_t h;
+    size_t len;
+
+    // the last extension of the last path segment
+    while (ext > filename && ext[-1] != '.' && ext[-1] != '/')
+        ext--;
+    len = end - ext;
+    if (ext == filename || ext[-1] != '.' || len > MIME_EXT_MAX ||
+        slots == NULL)
+        return MIME_DEFAULT;
+    for (size_t i = 0; i < len; i++)
+        lower[i] = ext[i] >= 'A' && ext[i] <= 'Z' ? ext[i] + 32 : ext[i];
+
+    h = mime_hash(lower, len);
+    entry = &slots[MIME_SLOT(h, disp[MIME_BUCKET(h)])];
+    if (entry->len != len || entry->ext == NULL ||
+        memcmp(entry->ext, lower, len) != 0)
+        return MIME_DEFAULT;
+    return entry->type;
+}
+
+int mime_compressible(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strstr(type, "javascript") ||
+           strstr(type, "json") || strstr(type, "xml");
+}
+
+// mime.types entries in file order, then the built-ins; index keeps that
+// order through the sort
+typedef struct {
+    mime_entry_t entry;
+    int index;
+} mime_item_t;
+
+typedef struct {
+    mime_item_t *items;
+    int count, cap;
+} mime_list_t;
+
+// scratch for mime_place()
+typedef struct {
+    uint64_t *hashes;
+    int *order; // entries grouped by bucket
+    int *start; // bucket b's entries are order[start[b]..start[b + 1])
+    int *fill;
+} mime_scratch_t;
+
+static void mime_list_add(mime_list_t *list, const char *ext,
+                          const char *type) {
+    char *lower;
+
+    if (strlen(ext) > MIME_EXT_MAX)
+        return;
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 256;
+        list->items =
+            realloc_or_die(list->items, list->cap * sizeof(mime_item_t));
+    }
+    lower = malloc_or_die(strlen(ext) + 1);
+    for (int i = 0; (lower[i] = tolower((unsigned char)ext[i])); i++)
+        ;
+    list->items[list->count].entry.ext = lower;
+    list->items[list->count].entry.type = type;
+    list->items[list->count].entry.len = strlen(ext);
+    list->items[list->count].index = list->count;
+    list->count++;
+}
+
+// mime.types as read, kept for good: the types point into it
+static char *mime_text;
+
+// "type ext ext ..." per line, '#' comments
+static void mime_load(mime_list_t *list, const char *path) {
+    char *line, *save_line, *save, *type, *ext;
+    FILE *file = fopen(path, "r");
+    long size;
+
+    if (file == NULL)
+        return;
+    if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0) {
+        fclose(file);
+        return;
+    }
+    rewind(file);
+    mime_text = malloc_or_die(size + 1);
+    mime_text[fread(mime_text, 1, size, file)] = '\0';
+    fclose(file);
+
+    for (line = strtok_r(mime_text, "\n", &save_line); line;
+         line = strtok_r(NULL, "\n", &save_line)) {
+        if ((type = strtok_r(line, " \t\r", &save)) == NULL ||
+            type[0] == '#' || (ext = strtok_r(NULL, " \t\r", &save)) == NULL)
+            continue;
+        for (; ext; ext = strtok_r(NULL, " \t\r", &save))
+            mime_list_add(list, ext, type);
+    }
+}
+
+// by extension, and for the same extension the one listed first
+static int mime_by_ext(const void *a, const void *b) {
+    const mime_item_t *ia = a, *ib = b;
+    int cmp = strcmp(ia->entry.ext, ib->entry.ext);
+    return cmp ? cmp : ia->index - ib->index;
+}
+
+// Try to place all n entries with the current seed. Returns 0 if some
+// bucket found no displacement, and the caller reseeds.
+static int mime_place(mime_entry_t *entries, int n, mime_scratch_t *sc) {
+    int nbuckets = bucket_mask + 1;
+
+    for (int i = 0; i < n; i++)
+        sc->hashes[i] = mime_hash(entries[i].ext, entries[i].len);
+
+    // group the entries by bucket (counting sort)
+    memset(sc->start, 0, (nbuckets + 1) * sizeof(int));
+    for (int i = 0; i < n; i++)
+        sc->start[MIME_BUCKET(sc->hashes[i]) + 1]++;
+    for (int b = 0; b < nbuckets; b++)
+        sc->start[b + 1] += sc->start[b];
+    memcpy(sc->fill, sc->start, nbuckets * sizeof(int));
+    for (int i = 0; i < n; i++)
+        sc->order[sc->fill[MIME_BUCKET(sc->hashes[i])]++] = i;
+
+    // biggest buckets first, while the table is still empty
+    memset(slots, 0, (slot_mask + 1) * sizeof(mime_entry_t));
+    for (int size = n; size > 0; size--) {
+        for (int b = 0; b < nbuckets; b++) {
+            int *keys = sc->order + sc->start[b];
+            unsigned d;
+            int k;
+
+            if (sc->start[b + 1] - sc->start[b] != size)
+                continue;
+            for (d = 0; d <= slot_mask && d <= UINT16_MAX; d++) {
+                for (k = 0; k < size; k++) {
+                    unsigned s = MIME_SLOT(sc->hashes[keys[k]], d);
+                    if (slots[s].ext)
+                        break;
+                    slots[s] = entries[keys[k]]; // taken for now
+                }
+                if (k == size)
+                    break;
+                while (k-- > 0) // undo, try the next d
+                    slots[MIME_SLOT(sc->hashes[keys[k]], d)].ext = NULL;
+            }
+            if (d > slot_mask || d > UINT16_MAX)
+                return 0;
+            disp[b] = d;
+        }
+    }
+    return 1;
+}
+
+int mime_init(const char *path) {
+    mime_list_t list = {NULL, 0, 0};
+    mime_entry_t *entries;
+    mime_scratch_t sc;
+    unsigned size = 16;
+    int n = 0;
+
+    if (path)
+        mime_load(&list, path);
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+        mime_list_add(&list, builtin[i].ext, builtin[i].type);
+
+    // one entry per extension, the first one listed
+    qsort(list.items, list.count, sizeof(mime_item_t), mime_by_ext);
+    entries = malloc_or_die((list.count + 1) * sizeof(mime_entry_t));
+    for (int i = 0; i < list.count; i++) {
+        if (n > 0 && strcmp(entries[n - 1].ext, list.items[i].entry.ext) == 0)
+            free((char *)list.items[i].entry.ext);
+        else
+            entries[n++] = list.items[i].entry;
+    }
+    free(list.items);
+
+    // a table at most half full, about four extensions per bucket
+    while (size < 2 * (unsigned)n)
+        size *= 2;
+    slot_mask = size - 1;
+    bucket_mask = size / 8 - 1;
+    slots = malloc_or_die(size * sizeof(mime_entry_t));
+    disp = calloc(bucket_mask + 1, sizeof(uint16_t));
+    sc.hashes = malloc_or_die(n * sizeof(uint64_t));
+    sc.order = malloc_or_die(n * sizeof(int));
+    sc.start = malloc_or_die((bucket_mask + 2) * sizeof(int));
+    sc.fill = malloc_or_die((bucket_mask + 1) * sizeof(int));
+
+    // distinct extensions always fit eventually; a few seeds is typical
+    for (seed = 0; !mime_place(entries, n, &sc); seed++)
+        ;
+
+    free(sc.hashes);
+    free(sc.order);
+    free(sc.start);
+    free(sc.fill);
+    free(entries);
+    return n;
+}
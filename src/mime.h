@@ -0,0 +1,27 @@
+#ifndef __MIME_H__
+#define __MIME_H__
+
+//
+// File extension -> MIME type, from the system's mime.types loaded once at
+// startup (plus a few built-in types, so a machine without the file still
+// serves the usual web formats). The table is a perfect hash: a lookup
+// hashes the extension once, reads one displacement and compares one key.
+//
+
+#define MIME_TYPES_PATH "/etc/mime.types"
+#define MIME_DEFAULT "application/octet-stream"
+
+// longest extension kept; longer ones get MIME_DEFAULT
+#define MIME_EXT_MAX (32)
+
+// Build the table from path (NULL: built-ins only). Returns the number of
+// extensions known. Call once, before any lookup.
+int mime_init(const char *path);
+
+// MIME type for a file name, by its last extension, case-insensitively
+const char *getMimeType(const char *filename);
+
+// text-like types worth gzipping; images and archives already are packed
+int mime_compressible(const char *type);
+
+#endif // __MIME_H__
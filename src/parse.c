@@ -0,0 +1,160 @@
+#include <string.h>
+#include <strings.h>
+
+#include "parse.h"
+#include "scan.h"
+
+// the end of the line starting at pos, without its "\r\n" and trailing
+// spaces; *next is where the following line starts, or len if none does
+static size_t parse_line(const char *buf, size_t len, size_t pos,
+                         size_t *next) {
+    size_t eol = scan_line_end(buf, len, pos), end = eol;
+
+    *next = eol < len ? eol + 1 : len;
+    while (end > pos && (buf[end - 1] == '\r' || buf[end - 1] == ' ' ||
+                         buf[end - 1] == '\t'))
+        end--;
+    return end;
+}
+
+// the next space-delimited word of buf[*pos..end), terminated in place
+static int parse_word(char *buf, size_t *pos, size_t end, parse_str_t *word) {
+    char *space = memchr(buf + *pos, ' ', end - *pos);
+    size_t stop = space ? (size_t)(space - buf) : end;
+
+    if (stop == *pos)
+        return -1;
+    word->ptr = buf + *pos;
+    word->len = stop - *pos;
+    buf[stop] = '\0';
+    *pos = stop < end ? stop + 1 : end;
+    while (*pos < end && buf[*pos] == ' ')
+        (*pos)++;
+    return 0;
+}
+
+int parse_request(char *buf, size_t len, parse_request_t *req) {
+    size_t pos = 0, end, next;
+    char *query;
+
+    // empty lines ahead of the request line are allowed
+    while (pos < len && (buf[pos] == '\r' || buf[pos] == '\n'))
+        pos++;
+    end = parse_line(buf, len, pos, &next);
+    if (next == len)
+        return -1; // no header block ends on its request line
+
+    // METHOD SP target [SP version]
+    if (parse_word(buf, &pos, end, &req->method) < 0 ||
+        parse_word(buf, &pos, end, &req->target) < 0)
+        return -1;
+    req->version.ptr = buf + pos;
+    req->version.len = end - pos;
+    buf[end] = '\0';
+
+    // origin form "/path?query", or absolute form "http://host/path?query"
+    req->path = req->target;
+    if (strncasecmp(req->path.ptr, "http://", 7) == 0 ||
+        strncasecmp(req->path.ptr, "https://", 8) == 0) {
+        char *host = strstr(req->path.ptr, "://") + 3;
+        req->path.ptr = host + strcspn(host, "/?");
+        req->path.len = req->target.len - (req->path.ptr - req->target.ptr);
+    }
+    query = memchr(req->path.ptr, '?', req->path.len);
+    if (query) {
+        req->query.ptr = query + 1;
+        req->query.len = req->path.len - (query + 1 - req->path.ptr);
+        req->path.len = query - req->path.ptr;
+    } else {
+        req->query.ptr = req->path.ptr + req->path.len;
+        req->query.len = 0;
+    }
+    // an absolute form without a path asks for "/" (RFC 9112, 3.2.2)
+    if (req->path.len == 0) {
+        req->path.ptr = (char *)"/";
+        req->path.len = 1;
+    }
+
+    // "Name: value" lines up to the empty one; lines without a colon are
+    // skipped
+    req->nheaders = 0;
+    for (pos = next; pos < len; pos = next) {
+        parse_header_t *h;
+        char *colon, *value;
+
+        end = parse_line(buf, len, pos, &next);
+        if (end == pos)
+            break;
+        colon = memchr(buf + pos, ':', end - pos);
+        if (colon == NULL || colon == buf + pos ||
+            req->nheaders == PARSE_HEADERS_MAX)
+            continue;
+        h = &req->headers[req->nheaders++];
+        h->name.ptr = buf + pos;
+        h->name.len = colon - (buf + pos);
+        *colon = '\0';
+        value = colon + 1;
+        while (value < buf + end && (*value == ' ' || *value == '\t'))
+            value++;
+        h->value.ptr = value;
+        h->value.len = buf + end - value;
+        buf[end] = '\0';
+    }
+    return 0;
+}
+
+static int parse_hex(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+int parse_path(const char *path, size_t len, char *out) {
+    size_t i = 1, o = 1;
+
+    if (len == 0 || path[0] != '/')
+        return -1;
+    out[0] = '/';
+
+    // one segment per round, decoded into out[seg..o); out[seg - 1] is
+    // always the '/' before it
+    while (i < len) {
+        size_t seg = o;
+        int slash = 0;
+
+        while (i < len) {
+            char c = path[i++];
+            if (c == '%') {
+                int hi, lo;
+                if (i + 2 > len || (hi = parse_hex(path[i])) < 0 ||
+                    (lo = parse_hex(path[i + 1])) < 0 || (hi | lo) == 0)
+                    return -1;
+                c = hi << 4 | lo;
+                i += 2;
+            }
+            if (c == '/') {
+                slash = 1;
+                break;
+            }
+            out[o++] = c;
+        }
+
+        if (o - seg == 1 && out[seg] == '.') {
+            o = seg;
+        } else if (o - seg == 2 && out[seg] == '.' && out[seg + 1] == '.') {
+            if (seg == 1)
+                return -1; // above the root
+            // back to just after the '/' ahead of the previous segment
+            o = seg - 1;
+            while (out[o - 1] != '/')
+                o--;
+        } else if (o > seg && slash) {
+            out[o++] = '/';
+        }
+    }
+    out[o] = '\0';
+    return o;
+}
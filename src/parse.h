@@ -0,0 +1,49 @@
+#ifndef __PARSE_H__
+#define __PARSE_H__
+
+#include <stddef.h>
+
+//
+// Single-pass parser for a buffered request header block. It works in
+// place: every field points into the block and is NUL-terminated there,
+// over the delimiter that followed it, so nothing is copied or allocated.
+//
+
+// headers kept per request; any beyond these are ignored
+#define PARSE_HEADERS_MAX (32)
+
+// a piece of the header block
+typedef struct {
+    char *ptr;
+    size_t len;
+} parse_str_t;
+
+typedef struct {
+    parse_str_t name;
+    parse_str_t value; // without the whitespace around it
+} parse_header_t;
+
+typedef struct {
+    parse_str_t method;
+    parse_str_t target;  // as sent, for the log
+    parse_str_t path;    // target up to '?', still encoded, not terminated;
+                         // "/" if an absolute form has none
+    parse_str_t query;   // after '?', empty if there is none
+    parse_str_t version; // empty on an HTTP/0.9 style request line
+    int nheaders;
+    parse_header_t headers[PARSE_HEADERS_MAX];
+} parse_request_t;
+
+// Parse the header block buf[0..len) (up to and including the empty line).
+// Returns 0, or -1 if the request line is malformed.
+int parse_request(char *buf, size_t len, parse_request_t *req);
+
+//
+// Percent-decode a request path into out (len + 1 bytes), dropping "."
+// segments and repeated slashes and resolving ".." ones; a trailing slash
+// stays. Returns the length, or -1 if it doesn't start with '/', has a
+// bad or NUL escape, or climbs above the root.
+//
+int parse_path(const char *path, size_t len, char *out);
+
+#endif // __PARSE_H__
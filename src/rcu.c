@@ -0,0 +1,85 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+#include "rcu.h"
+
+// one slot per reader thread, each on its own cache line
+typedef struct {
+    unsigned long ctr; // grace period seen at rcu_read_lock(), 0 if outside
+    int used;
+} __attribute__((aligned(64))) rcu_reader_t;
+
+static rcu_reader_t readers[RCU_MAX_THREADS];
+static int nreaders;             // slots ever handed out
+static unsigned long rcu_gp = 1; // current grace period
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread rcu_reader_t *self;
+
+static rcu_reader_t *rcu_register_thread(void) {
+    rcu_reader_t *reader = NULL;
+
+    // reuse a slot given back by a thread that exited
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < nreaders && reader == NULL; i++) {
+        if (!readers[i].used)
+            reader = &readers[i];
+    }
+    if (reader == NULL) {
+        assert(nreaders < RCU_MAX_THREADS);
+        reader = &readers[nreaders];
+        __atomic_store_n(&nreaders, nreaders + 1, __ATOMIC_RELEASE);
+    }
+    reader->used = 1;
+    pthread_mutex_unlock(&registry_lock);
+    return reader;
+}
+
+void rcu_read_lock(void) {
+    if (self == NULL)
+        self = rcu_register_thread();
+    __atomic_store_n(&self->ctr, __atomic_load_n(&rcu_gp, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    // the announcement must be visible before we load any shared pointer
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock(void) {
+    __atomic_store_n(&self->ctr, 0, __ATOMIC_RELEASE);
+}
+
+// a thread that stops reading (e.g. a retired worker) gives its slot back
+void rcu_unregister_thread(void) {
+    if (self == NULL)
+        return;
+    pthread_mutex_lock(&registry_lock);
+    __atomic_store_n(&self->ctr, 0, __ATOMIC_RELEASE);
+    self->used = 0;
+    pthread_mutex_unlock(&registry_lock);
+    self = NULL;
+}
+
+//
+// Start a new grace period and wait until no reader is still inside a
+// section that began before it. Must not be called from a read section.
+//
+void rcu_synchronize(void) {
+    unsigned long gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+    int n;
+
+    // pairs with the fence in rcu_read_lock(): either we see the reader's
+    // announcement or it sees what we unlinked before getting here
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    n = __atomic_load_n(&nreaders, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++) {
+        while (1) {
+            unsigned long ctr = __atomic_load_n(&readers[i].ctr, __ATOMIC_ACQUIRE);
+            if (ctr == 0 || ctr >= gp)
+                break;
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+//
+// Minimal epoch-based RCU for read-mostly tables. Readers bracket their
+// lookups with rcu_read_lock()/rcu_read_unlock(): a store and a fence, no
+// shared cache line is written. A writer that unlinked an object calls
+// rcu_synchronize() before freeing it, which waits until every reader that
+// could still see the object has left its read-side section. Readers
+// register themselves on first use; sections must not nest.
+//
+
+#define RCU_MAX_THREADS (1024)
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+void rcu_unregister_thread(void);
+
+#endif // __RCU_H__
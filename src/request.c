@@ -1,5 +1,14 @@
+#include <stdarg.h>
+
 #include "request.h"
+#include "admit.h"
+#include "cgi.h"
+#include "fcgi.h"
+#include "file_cache.h"
 #include "io_helper.h"
+#include "log.h"
+#include "parse.h"
+#include "stats.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
@@ -8,235 +17,1174 @@
 
 #define MAXBUF (8192)
 
+// most slices one Range request is answered with, after merging overlaps;
+// asking for more gets the whole file
+#define RANGE_MAX (16)
+
+// limits on one batch of pipelined requests answered with a single flush
+#define PIPELINE_MAX (32)
+#define PIPELINE_OUTBUF (64 * 1024)
+
+// files at least this big are sent with sendfile() instead of mmap()
+off_t sendfile_threshold = SENDFILE_THRESHOLD;
+
 enum HttpStatusCode {
     OK = 200,
     CREATED = 201,
     ACCEPTED = 202,
     NO_CONTENT = 204,
+    PARTIAL_CONTENT = 206,
+    NOT_MODIFIED = 304,
     BAD_REQUEST = 400,
     UNAUTHORIZED = 401,
     FORBIDDEN = 403,
     NOT_FOUND = 404,
+    URI_TOO_LONG = 414,
     UNSUPPORTED_MEDIA_TYPE = 415,
+    RANGE_NOT_SATISFIABLE = 416,
+    TOO_MANY_REQUESTS = 429,
     INTERNAL_SERVER_ERROR = 500,
     NOT_IMPLEMENTED = 501,
+    BAD_GATEWAY = 502,
     SERVICE_UNAVAILABLE = 503
 };
 
-struct MimeType {
-    char *extension;
-    char *type;
-} mimeTypes[] = {{".gif", "image/gif"},
-                 {".jpg", "image/jpeg"},
-                 {".jpeg", "image/jpeg"},
-                 {".png", "image/png"},
-                 {".css", "text/css"},
-                 {".ico", "image/x-icon"},
-                 {".zip", "application/zip"},
-                 {".gz", "application/gzip"},
-                 {".tar", "application/x-tar"},
-                 {".htm", "text/html"},
-                 {".html", "text/html"},
-                 {".txt", "text/plain"},
-                 {NULL, NULL}};
-
-void request_error(int fd, char *cause, char *errnum, char *shortmsg,
-                   char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-
-    // Create the body of error message first (have to know its length for
-    // header)
-    sprintf(body,
-            ""
-            "<!doctype html>\r\n"
-            "<head>\r\n"
-            "  <title>OSTEP WebServer Error</title>\r\n"
-            "</head>\r\n"
-            "<body>\r\n"
-            "  <h2>%s: %s</h2>\r\n"
-            "  <p>%s: %s</p>\r\n"
-            "</body>\r\n"
-            "</html>\r\n",
-            errnum, shortmsg, longmsg, cause);
-
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
-
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
-
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
-
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
-}
-
-//
-// Reads and discards everything up to an empty text line
-//
-void request_read_headers(int fd) {
-    char buf[MAXBUF];
-    int lines = 0;
-
-    // Read the first header line
-    if (readline(fd, buf, MAXBUF) <= 0) {
-        // client closed or read error
-        return;
-    }
-
-    while (strcmp(buf, "\r\n") != 0) {
-        lines++;
-        if (lines >= 200) {
-            return;
-        }
+// values of the Connection header
+enum ConnectionOption {
+    CONNECTION_DEFAULT, // header absent: the protocol version decides
+    CONNECTION_KEEP_ALIVE,
+    CONNECTION_CLOSE
+};
 
-        if (readline(fd, buf, MAXBUF) <= 0) {
-            // client closed or read error mid-headers
-            return;
+// The request headers we act on; everything else is skipped. The values
+// point into the connection's input buffer.
+typedef struct {
+    int connection;    // enum ConnectionOption
+    int has_body;      // Content-Length/Transfer-Encoding present
+    int gzip;          // Accept-Encoding allows gzip
+    char *range;       // Range value, NULL if none
+    char *if_range;
+    char *if_none_match;
+    time_t if_modified_since; // -1 if absent or unparsable
+} request_headers_t;
+
+// one slice of a Range request, end inclusive as on the wire
+typedef struct {
+    off_t start;
+    off_t end;
+} byte_range_t;
+
+//
+// Tell the client what happens to the connection after this response.
+// HTTP/1.1 keeps it by default, HTTP/1.0 only when asked to.
+//
+const char *request_connection_line(conn_t *conn) {
+    if (!conn->keep_alive && conn->http11)
+        return "Connection: close\r\n";
+    if (conn->keep_alive && !conn->http11)
+        return "Connection: keep-alive\r\n";
+    return NULL;
+}
+
+void request_connection_header(conn_t *conn) {
+    const char *line = request_connection_line(conn);
+    if (line)
+        conn_write(conn, line, strlen(line));
+}
+
+//
+// Error responses are serialized once, at startup: the status line and
+// Content-Type, then the body in up to two pieces around the message. A
+// docroot/<status>.html page, when there is one, is the whole body (and
+// its Content-Length is prebuilt too); otherwise the built-in page says
+// what went wrong, HTML-escaped.
+//
+typedef struct {
+    int status;
+    const char *reason;
+    char *head; // status line, Content-Type, Content-Length for a page
+    size_t head_len;
+    char *body; // blank line, body up to the message
+    size_t body_len;
+    const char *tail; // body after the message, NULL for a docroot page
+    size_t tail_len;
+} error_page_t;
+
+static error_page_t error_pages[] = {
+    {BAD_REQUEST, "Bad Request"},
+    {FORBIDDEN, "Forbidden"},
+    {NOT_FOUND, "Not Found"},
+    {URI_TOO_LONG, "URI Too Long"},
+    {TOO_MANY_REQUESTS, "Too Many Requests"},
+    {INTERNAL_SERVER_ERROR, "Internal Server Error"},
+    {NOT_IMPLEMENTED, "Not Implemented"},
+    {BAD_GATEWAY, "Bad Gateway"},
+    {SERVICE_UNAVAILABLE, "Service Unavailable"},
+};
+#define ERROR_PAGES (sizeof(error_pages) / sizeof(error_pages[0]))
+
+// the whole of a small regular file, or NULL
+static char *request_read_page(const char *path, size_t *len) {
+    struct stat sbuf;
+    char *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+        sbuf.st_size > MAXBUF) {
+        close(fd);
+        return NULL;
+    }
+    data = malloc_or_die(sbuf.st_size + 1);
+    *len = read(fd, data, sbuf.st_size);
+    close(fd);
+    if (*len != (size_t)sbuf.st_size) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static char *request_asprintf(size_t *len, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+static char *request_asprintf(size_t *len, const char *format, ...) {
+    va_list arg;
+    char *buf;
+    int n;
+
+    va_start(arg, format);
+    n = vasprintf(&buf, format, arg);
+    va_end(arg);
+    if (n < 0) {
+        perror("vasprintf");
+        exit(EXIT_FAILURE);
+    }
+    *len = n;
+    return buf;
+}
+
+// Build the error responses; the docroot must be the working directory
+void request_init(void) {
+    for (size_t i = 0; i < ERROR_PAGES; i++) {
+        error_page_t *page = &error_pages[i];
+        const char *retry = "";
+        char path[32], *data;
+        size_t len;
+
+        // tell clients that are only turned away for now when to come back
+        if (page->status == TOO_MANY_REQUESTS ||
+            page->status == SERVICE_UNAVAILABLE)
+            retry = "Retry-After: " ADMIT_RETRY_AFTER "\r\n";
+
+        snprintf(path, sizeof(path), "%d.html", page->status);
+        data = request_read_page(path, &len);
+        if (data) {
+            page->head = request_asprintf(
+                &page->head_len,
+                "HTTP/1.1 %d %s\r\n%sContent-Type: text/html\r\n"
+                "Content-Length: %lu\r\n",
+                page->status, page->reason, retry, (unsigned long)len);
+            page->body = request_asprintf(&page->body_len, "\r\n%.*s",
+                                          (int)len, data);
+            free(data);
+            continue;
         }
+        page->head = request_asprintf(&page->head_len,
+                                      "HTTP/1.1 %d %s\r\n"
+                                      "%sContent-Type: text/html\r\n",
+                                      page->status, page->reason, retry);
+        page->body = request_asprintf(&page->body_len,
+                                      "\r\n"
+                                      "<!doctype html>\r\n"
+                                      "<head>\r\n"
+                                      "  <title>OSTEP WebServer Error</title>\r\n"
+                                      "</head>\r\n"
+                                      "<body>\r\n"
+                                      "  <h2>%d: %s</h2>\r\n"
+                                      "  <p>",
+                                      page->status, page->reason);
+        page->tail = "</p>\r\n</body>\r\n</html>\r\n";
+        page->tail_len = strlen(page->tail);
     }
 }
 
+// the error pages live as long as the process
+static void request_keep(void *arg) {}
+
+// what text needs to become to be safe in HTML
+static const char *request_entity(char c) {
+    switch (c) {
+    case '&':
+        return "&amp;";
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    case '"':
+        return "&quot;";
+    case '\'':
+        return "&#39;";
+    }
+    return NULL;
+}
+
+// length of text once escaped; with conn, also queue it
+static size_t request_escape(conn_t *conn, const char *text) {
+    size_t len = 0;
+
+    while (*text) {
+        size_t run = strcspn(text, "&<>\"'");
+        const char *entity;
+
+        if (conn)
+            conn_write(conn, text, run);
+        len += run;
+        text += run;
+        if (*text == '\0')
+            break;
+        entity = request_entity(*text++);
+        if (conn)
+            conn_write(conn, entity, strlen(entity));
+        len += strlen(entity);
+    }
+    return len;
+}
+
 //
-// Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// Answer with an error page, "longmsg: cause" on the built-in ones. Only
+// the Content-Length, the Connection header and the escaped message are
+// written per request; the rest is queued from the prebuilt pieces, and
+// all of it leaves in one writev().
 //
-int request_parse_uri(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
+void request_error(conn_t *conn, int status, const char *cause,
+                   const char *longmsg) {
+    const char *line = request_connection_line(conn);
+    error_page_t *page = &error_pages[0];
 
-    if (!strstr(uri, "cgi")) {
-        // static
-        strcpy(cgiargs, "");
-        sprintf(filename, ".%s", uri);
-        if (uri[strlen(uri) - 1] == '/') {
-            strcat(filename, "index.html");
-        }
-        return 1;
-    } else {
-        // dynamic
-        ptr = index(uri, '?');
-        if (ptr) {
-            strcpy(cgiargs, ptr + 1);
-            *ptr = '\0';
-        } else {
-            strcpy(cgiargs, "");
+    for (size_t i = 0; i < ERROR_PAGES; i++) {
+        if (error_pages[i].status == status)
+            page = &error_pages[i];
+    }
+
+    conn->status = page->status;
+    conn_write_buf(conn, page->head, page->head_len, request_keep, NULL);
+    if (page->tail) {
+        size_t len = page->body_len - 2 + request_escape(NULL, longmsg) + 2 +
+                     request_escape(NULL, cause) + page->tail_len;
+        conn_printf(conn, "Content-Length: %lu\r\n", (unsigned long)len);
+    }
+    if (line)
+        conn_write(conn, line, strlen(line));
+    conn_write_buf(conn, page->body, page->body_len, request_keep, NULL);
+    if (page->tail) {
+        request_escape(conn, longmsg);
+        conn_write(conn, ": ", 2);
+        request_escape(conn, cause);
+        conn_write_buf(conn, page->tail, page->tail_len, request_keep, NULL);
+    }
+}
+
+//
+// Parse the comma separated tokens of a Connection header
+//
+void request_parse_connection(char *value, request_headers_t *headers) {
+    char *saveptr, *token;
+
+    for (token = strtok_r(value, ", \t\r\n", &saveptr); token != NULL;
+         token = strtok_r(NULL, ", \t\r\n", &saveptr)) {
+        if (strcasecmp(token, "close") == 0)
+            headers->connection = CONNECTION_CLOSE;
+        else if (strcasecmp(token, "keep-alive") == 0 &&
+                 headers->connection != CONNECTION_CLOSE)
+            headers->connection = CONNECTION_KEEP_ALIVE;
+    }
+}
+
+//
+// Whether an Accept-Encoding header lets us send gzip: listed as "gzip"
+// (or the old "x-gzip"), or covered by "*", with a non-zero q-value
+//
+void request_parse_accept_encoding(char *value, request_headers_t *headers) {
+    char *saveptr, *token;
+    int gzip = -1, any = 0;
+
+    for (token = strtok_r(value, ",", &saveptr); token != NULL;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        char *params = strchr(token, ';');
+        char *q = NULL;
+        int accepted = 1;
+
+        if (params) {
+            *params++ = '\0';
+            q = strstr(params, "q=");
         }
-        sprintf(filename, ".%s", uri);
-        return 0;
+        if (q)
+            accepted = atof(q + 2) > 0;
+        token += strspn(token, " \t");
+        token[strcspn(token, " \t\r\n")] = '\0';
+
+        if (strcasecmp(token, "gzip") == 0 || strcasecmp(token, "x-gzip") == 0)
+            gzip = accepted;
+        else if (strcmp(token, "*") == 0)
+            any = accepted;
+    }
+    headers->gzip = gzip >= 0 ? gzip : any;
+}
+
+// An HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"), or -1
+time_t request_parse_date(const char *value) {
+    struct tm tm;
+    const char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL)
+        return -1;
+    return timegm(&tm);
+}
+
+//
+// Look at one header, keeping what we care about
+//
+void request_parse_header(char *name, char *value, request_headers_t *headers) {
+    if (strcasecmp(name, "Connection") == 0)
+        request_parse_connection(value, headers);
+    else if (strcasecmp(name, "Content-Length") == 0)
+        headers->has_body = atol(value) != 0;
+    else if (strcasecmp(name, "Transfer-Encoding") == 0)
+        headers->has_body = 1;
+    else if (strcasecmp(name, "Accept-Encoding") == 0)
+        request_parse_accept_encoding(value, headers);
+    else if (strcasecmp(name, "Range") == 0)
+        headers->range = value;
+    else if (strcasecmp(name, "If-Range") == 0)
+        headers->if_range = value;
+    else if (strcasecmp(name, "If-None-Match") == 0)
+        headers->if_none_match = value;
+    else if (strcasecmp(name, "If-Modified-Since") == 0)
+        headers->if_modified_since = request_parse_date(value);
+}
+
+// pick the headers listed in request_headers_t out of the parsed ones
+void request_read_headers(parse_request_t *req, request_headers_t *headers) {
+    headers->connection = CONNECTION_DEFAULT;
+    headers->has_body = 0;
+    headers->gzip = 0;
+    headers->range = NULL;
+    headers->if_range = NULL;
+    headers->if_none_match = NULL;
+    headers->if_modified_since = -1;
+
+    for (int i = 0; i < req->nheaders; i++)
+        request_parse_header(req->headers[i].name.ptr,
+                             req->headers[i].value.ptr, headers);
+}
+
+//
+// The file a request path names, built in the connection's arena: "." and
+// the decoded, normalized path, plus index.html for a directory. Returns
+// 0, or the status to answer with: 400 for a path that isn't one (or
+// climbs out of the docroot), 414 for one too long to be a file name.
+//
+int request_filename(conn_t *conn, parse_str_t *path, char **filename) {
+    char *buf = conn_alloc(conn, path->len + sizeof("./index.html"));
+    int len;
+
+    if (buf == NULL)
+        return URI_TOO_LONG;
+    buf[0] = '.';
+    if ((len = parse_path(path->ptr, path->len, buf + 1)) < 0)
+        return BAD_REQUEST;
+    if (buf[len] == '/')
+        strcpy(buf + len + 1, "index.html");
+    *filename = buf;
+    return 0;
+}
+
+// reason phrases for statuses an app may send that aren't error pages
+static const struct {
+    int status;
+    const char *reason;
+} reasons[] = {
+    {200, "OK"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {204, "No Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {401, "Unauthorized"},
+    {405, "Method Not Allowed"},
+    {409, "Conflict"},
+    {410, "Gone"},
+    {422, "Unprocessable Content"},
+};
+
+// the standard reason phrase, or "" (which HTTP allows) for a rare status
+static const char *request_reason(int status) {
+    for (size_t i = 0; i < ERROR_PAGES; i++) {
+        if (error_pages[i].status == status)
+            return error_pages[i].reason;
     }
+    for (size_t i = 0; i < sizeof(reasons) / sizeof(reasons[0]); i++) {
+        if (reasons[i].status == status)
+            return reasons[i].reason;
+    }
+    return "";
+}
+
+// framing is ours: the app's own would repeat or contradict it
+static int request_fcgi_hop_header(const char *line) {
+    return strncasecmp(line, "Status:", 7) == 0 ||
+           strncasecmp(line, "Content-Length:", 15) == 0 ||
+           strncasecmp(line, "Transfer-Encoding:", 18) == 0 ||
+           strncasecmp(line, "Connection:", 11) == 0 ||
+           strncasecmp(line, "Keep-Alive:", 11) == 0;
 }
 
+//
+// A FastCGI app's output is complete before any of it is sent, so unlike
+// plain CGI the response gets a Content-Length. The app's CGI headers are
+// passed on, except Status, which becomes the status line, and the ones
+// that frame the response. Runs on the FastCGI helper thread for the
+// event loops, so it touches nothing but conn.
+//
+static void request_fcgi_respond(conn_t *conn, const char *filename,
+                                 char *out, size_t len, int result) {
+    char *body, *line, *next, *end, reason[64] = "";
+    size_t header_len;
+    int status = OK;
 
-// Function to get MIME type based on file extension
-void getMimeType(const char *fileExtension, char* filetype) {
-    if (fileExtension == NULL) {
-        strcpy(filetype, "application/octet-stream");
+    if (result == FCGI_BUSY) {
+        request_error(conn, SERVICE_UNAVAILABLE, filename,
+                      "every FastCGI worker is busy");
+        return;
+    }
+    if (result != FCGI_OK) {
+        request_error(conn, BAD_GATEWAY, filename,
+                      "the FastCGI program did not answer");
+        return;
+    }
+    if ((body = memmem(out, len, "\r\n\r\n", 4)) != NULL) {
+        header_len = body - out + 2;
+        body += 4;
+    } else if ((body = memmem(out, len, "\n\n", 2)) != NULL) {
+        header_len = body - out + 1;
+        body += 2;
+    } else {
+        free(out);
+        request_error(conn, BAD_GATEWAY, filename,
+                      "the FastCGI program sent no headers");
         return;
     }
+    out[header_len] = '\0';
 
-    for (int i = 0; mimeTypes[i].extension != NULL; i++) {
-        if (strstr(fileExtension, mimeTypes[i].extension)) {
-            strcpy(filetype, mimeTypes[i].type);
-            return;
+    for (line = out; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        if (*next)
+            *next++ = '\0';
+        if (strncasecmp(line, "Status:", 7) == 0) {
+            status = strtol(line + 7, &end, 10);
+            if (end == line + 7 || status < 100 || status > 599 ||
+                (*end != ' ' && *end != '\t' && *end != '\r' && *end)) {
+                free(out);
+                request_error(conn, BAD_GATEWAY, filename,
+                              "the FastCGI program sent an invalid status");
+                return;
+            }
+            reason[0] = '\0';
+            sscanf(end, " %63[^\r]", reason);
+        } else if (strncasecmp(line, "Location:", 9) == 0 && status == OK) {
+            status = 302;
+            reason[0] = '\0';
         }
     }
-    strcpy(filetype, "application/octet-stream"); // Default MIME type
+    if (reason[0] == '\0')
+        snprintf(reason, sizeof(reason), "%s", request_reason(status));
+
+    conn->status = status;
+    conn_printf(conn, ""
+                      "HTTP/1.1 %d %s\r\n"
+                      "Server: nweb\r\n",
+                status, reason);
+    request_connection_header(conn);
+    conn_printf(conn, "Content-Length: %zu\r\n", len - (body - out));
+    // the header lines again, now that they are split
+    for (line = out; line < out + header_len; line += strlen(line) + 1) {
+        if (*line && *line != '\r' && !request_fcgi_hop_header(line))
+            conn_printf(conn, "%.*s\r\n", (int)strcspn(line, "\r"), line);
+    }
+    conn_write(conn, "\r\n", 2);
+    conn_write(conn, body, len - (body - out));
+    free(out);
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXBUF], *argv[] = {NULL};
+//
+// A pool worker may wait for the app, and keeps the connection open. An
+// event loop mustn't, so like a CGI program the request goes to a helper
+// thread with a copy of the socket, and the connection ends with it.
+//
+void request_serve_fcgi(conn_t *conn, char *filename, char *cgiargs) {
+    char *out;
+    size_t len;
+    int fd;
+
+    if (!conn->evented) {
+        int rc = fcgi_request(filename, cgiargs, conn_peer(conn), &out, &len);
+        request_fcgi_respond(conn, filename, out, len,
+                             rc < 0 ? FCGI_FAILED : FCGI_OK);
+        return;
+    }
+    conn->keep_alive = 0;
+    if ((fd = dup(conn->fd)) < 0) {
+        request_error(conn, INTERNAL_SERVER_ERROR, filename,
+                      "server could not run this FastCGI program");
+        return;
+    }
+    fcgi_start(filename, cgiargs, conn_peer(conn), conn, fd,
+               request_fcgi_respond);
+    conn->status = OK;
+    conn->shared = 1;
+}
+
+void request_serve_dynamic(conn_t *conn, char *filename, char *cgiargs) {
+    char head[128];
+    const char *line;
+    int len, fd;
+
+    if (fcgi_pool_size(filename) > 0) {
+        request_serve_fcgi(conn, filename, cgiargs);
+        return;
+    }
 
     // The server does only a little bit of the header.
     // The CGI script has to finish writing out the header.
-    sprintf(buf, ""
-                 "HTTP/1.0 200 OK\r\n"
+    // Without a Content-Length the end of the output is marked by
+    // closing the connection
+    conn->keep_alive = 0;
+    line = request_connection_line(conn);
+    len = snprintf(head, sizeof(head), ""
+                                       "HTTP/1.1 200 OK\r\n"
+                                       "Server: nweb\r\n"
+                                       "%s",
+                   line ? line : "");
+
+    // From here the connection belongs to the CGI helper thread. On its
+    // own copy of the socket it sends the responses pipelined ahead of
+    // this one, then the head and the program's output, so no worker or
+    // event loop waits for a slow client.
+    if ((fd = dup(conn->fd)) < 0 ||
+        cgi_run(filename, cgiargs, conn, fd, head, len) < 0) {
+        int busy = errno == EAGAIN;
+        if (fd >= 0)
+            close(fd);
+        if (busy)
+            request_error(conn, SERVICE_UNAVAILABLE, filename,
+                          "too many CGI programs are running");
+        else
+            request_error(conn, INTERNAL_SERVER_ERROR, filename,
+                          "server could not run this CGI program");
+        return;
+    }
+    conn->status = OK;
+    conn->shared = 1;
+}
+
+//
+// The gzip variant is a different representation, so it gets its own
+// strong ETag: the file's with "-gzip" inside the quotes.
+//
+void request_gzip_etag(file_entry_t *file, char *buf, size_t size) {
+    snprintf(buf, size, "%.*s-gzip\"", (int)strlen(file->etag) - 1,
+             file->etag);
+}
+
+// ETag and Last-Modified header lines for a file or its gzip variant
+int request_validators(char *buf, size_t size, file_entry_t *file, int gzip) {
+    char etag[sizeof(file->etag) + 8];
+
+    if (gzip)
+        request_gzip_etag(file, etag, sizeof(etag));
+    return snprintf(buf, size,
+                    "ETag: %s\r\n"
+                    "Last-Modified: %s\r\n",
+                    gzip ? etag : file->etag, file->last_modified);
+}
+
+//
+// Whether the client's cached copy is current, so a 304 will do. If-None-
+// Match takes precedence over If-Modified-Since and is compared weakly (a
+// "W/" prefix is ignored), against either representation of the file.
+//
+int request_not_modified(file_entry_t *file, request_headers_t *headers) {
+    char etag[sizeof(file->etag) + 8];
+    char *saveptr, *token;
+
+    if (headers->if_none_match == NULL)
+        return headers->if_modified_since >= 0 &&
+               file->st.st_mtime <= headers->if_modified_since;
+
+    request_gzip_etag(file, etag, sizeof(etag));
+    for (token = strtok_r(headers->if_none_match, ", \t", &saveptr);
+         token != NULL; token = strtok_r(NULL, ", \t", &saveptr)) {
+        if (strncmp(token, "W/", 2) == 0)
+            token += 2;
+        if (strcmp(token, "*") == 0 || strcmp(token, file->etag) == 0 ||
+            strcmp(token, etag) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+//
+// If-Range: the Range only applies if the client's copy is still this
+// file, named by a strong ETag or by exactly its Last-Modified date
+//
+int request_if_range(file_entry_t *file, request_headers_t *headers) {
+    const char *value = headers->if_range;
+
+    if (value == NULL)
+        return 1;
+    if (value[0] == '"')
+        return strcmp(value, file->etag) == 0;
+    if (strncmp(value, "W/", 2) == 0)
+        return 0;
+    return request_parse_date(value) == file->st.st_mtime;
+}
+
+// body-less answer to a revalidation; no file access at all
+void request_serve_not_modified(conn_t *conn, file_entry_t *file, int gzip) {
+    char validators[MAXBUF / 8];
+
+    request_validators(validators, sizeof(validators), file, gzip);
+    conn->status = NOT_MODIFIED;
+    conn_printf(conn, ""
+                      "HTTP/1.1 304 Not Modified\r\n"
+                      "Server: nweb\r\n");
+    request_connection_header(conn);
+    conn_printf(conn, "%s%s\r\n", validators,
+                file->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+//
+// Format the headers of a static response into buf. The Connection header
+// depends on the connection, so it isn't included: *split is where it
+// goes. Returns the length of the header block.
+//
+int request_static_headers(char *buf, size_t size, file_entry_t *file,
+                           off_t len, const char *encoding, int *split) {
+    int n;
+
+    n = snprintf(buf, size,
+                 "HTTP/1.1 200 OK\r\n"
                  "Server: nweb\r\n");
+    *split = n;
+    n += snprintf(buf + n, size - n,
+                  "Content-Length: %lld\r\n"
+                  "Content-Type: %s\r\n",
+                  (long long)len, file->mime);
+    if (encoding)
+        n += snprintf(buf + n, size - n, "Content-Encoding: %s\r\n", encoding);
+    n += request_validators(buf + n, size - n, file, encoding != NULL);
+    if (file->vary)
+        n += snprintf(buf + n, size - n, "Vary: Accept-Encoding\r\n");
+    n += snprintf(buf + n, size - n, "Accept-Ranges: bytes\r\n\r\n");
+    return n;
+}
 
-    write_or_die(fd, buf, strlen(buf));
+//
+// Serialize the whole response for a file into one buffer, to be kept
+// with its cache entry. The body is body[0..len) in the given encoding, or
+// when body is NULL the file itself, read through the cached descriptor
+// so this costs no path lookup either.
+//
+file_response_t *request_build_response(file_entry_t *file, const char *body,
+                                        size_t len, const char *encoding) {
+    char header[MAXBUF];
+    int split, hlen;
+    file_response_t *response;
 
-    if (fork_or_die() == 0) {                      // child
-        setenv_or_die("QUERY_STRING", cgiargs, 1); // args to cgi go here
-        dup2_or_die(fd,
-                    STDOUT_FILENO); // make cgi writes go to socket (not screen)
-        extern char **environ;      // defined by libc
-        execve_or_die(filename, argv, environ);
+    hlen = request_static_headers(header, sizeof(header), file, len, encoding,
+                                  &split);
+    response = malloc_or_die(sizeof(file_response_t) + hlen + len);
+    memcpy(response->data, header, hlen);
+    if (body) {
+        memcpy(response->data + hlen, body, len);
+    } else if (pread(file->fd, response->data + hlen, len, 0) != (ssize_t)len) {
+        free(response);
+        return NULL; // changed under us; inotify will drop the entry
+    }
+    response->len = hlen + len;
+    response->split = split;
+    return response;
+}
+
+//
+// Queue a prebuilt response: no formatting, no file access, and the bytes
+// go out straight from the cache. The Connection header, when this
+// connection needs one, is spliced in as its own piece of the same writev.
+//
+void request_serve_cached(conn_t *conn, file_entry_t *file,
+                          file_response_t *response) {
+    const char *line = request_connection_line(conn);
+
+    conn->status = OK;
+    if (line == NULL) {
+        file_cache_hold(file);
+        conn_write_buf(conn, response->data, response->len, file_cache_release,
+                       file);
+        return;
+    }
+    file_cache_hold(file);
+    conn_write_buf(conn, response->data, response->split, file_cache_release,
+                   file);
+    conn_write(conn, line, strlen(line));
+    file_cache_hold(file);
+    conn_write_buf(conn, response->data + response->split,
+                   response->len - response->split, file_cache_release, file);
+}
+
+static int request_range_cmp(const void *a, const void *b) {
+    off_t x = ((const byte_range_t *)a)->start;
+    off_t y = ((const byte_range_t *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+//
+// Parse a Range value ("bytes=0-99,200-,-500") against a file of the given
+// size into sorted slices, merging overlapping and adjacent ones. Returns
+// how many there are, 0 if none can be satisfied (a 416), or -1 if the
+// header should be ignored and the whole file sent: a unit other than
+// bytes, bad syntax, or too many slices.
+//
+int request_parse_range(const char *value, off_t size, byte_range_t *ranges) {
+    byte_range_t parsed[RANGE_MAX * 4];
+    int n = 0, merged = 0;
+    const char *p;
+    char *end;
+
+    value += strspn(value, " \t");
+    if (strncasecmp(value, "bytes=", 6) != 0)
+        return -1;
+    p = value + 6;
+
+    while (1) {
+        off_t start, last;
+
+        p += strspn(p, " \t");
+        if (*p == '-') {
+            // suffix: the last N bytes
+            if (!isdigit((unsigned char)p[1]))
+                return -1;
+            last = strtoll(p + 1, &end, 10);
+            start = last < size ? size - last : 0;
+            last = last > 0 ? size - 1 : -1;
+        } else {
+            if (!isdigit((unsigned char)*p))
+                return -1;
+            start = strtoll(p, &end, 10);
+            if (*end != '-')
+                return -1;
+            if (isdigit((unsigned char)end[1])) {
+                last = strtoll(end + 1, &end, 10);
+                if (last < start)
+                    return -1;
+            } else {
+                last = size - 1;
+                end++;
+            }
+            if (last > size - 1)
+                last = size - 1;
+        }
+
+        // keep the satisfiable ones
+        if (start < size && start <= last) {
+            if (n == RANGE_MAX * 4)
+                return -1;
+            parsed[n].start = start;
+            parsed[n].end = last;
+            n++;
+        }
+
+        p = end + strspn(end, " \t");
+        if (*p == '\0' || *p == '\r' || *p == '\n')
+            break;
+        if (*p++ != ',')
+            return -1;
+    }
+
+    qsort(parsed, n, sizeof(byte_range_t), request_range_cmp);
+    for (int i = 0; i < n; i++) {
+        if (merged > 0 && parsed[i].start <= ranges[merged - 1].end + 1) {
+            if (parsed[i].end > ranges[merged - 1].end)
+                ranges[merged - 1].end = parsed[i].end;
+            continue;
+        }
+        if (merged == RANGE_MAX)
+            return -1;
+        ranges[merged++] = parsed[i];
+    }
+    return merged;
+}
+
+//
+// Answer a Range request: 206 with just the requested slices, each sent
+// straight from the page cache with an offset, or 416 if none of them is
+// inside the file. Several slices go out as multipart/byteranges.
+//
+void request_serve_ranges(conn_t *conn, file_entry_t *file,
+                          byte_range_t *ranges, int n) {
+    off_t size = file->st.st_size;
+    char parts[RANGE_MAX][MAXBUF / 16];
+    char boundary[64];
+    off_t total = 0;
+
+    if (n == 0) {
+        conn->status = RANGE_NOT_SATISFIABLE;
+        conn_printf(conn, ""
+                          "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                          "Server: nweb\r\n");
+        request_connection_header(conn);
+        conn_printf(conn,
+                    ""
+                    "Content-Range: bytes */%lld\r\n"
+                    "Content-Length: 0\r\n\r\n",
+                    (long long)size);
+        return;
+    }
+
+    conn->status = PARTIAL_CONTENT;
+    conn_printf(conn, ""
+                      "HTTP/1.1 206 Partial Content\r\n"
+                      "Server: nweb\r\n");
+    request_connection_header(conn);
+
+    if (n == 1) {
+        total = ranges[0].end - ranges[0].start + 1;
+        conn_printf(conn,
+                    ""
+                    "Content-Length: %lld\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n",
+                    (long long)total, file->mime, (long long)ranges[0].start,
+                    (long long)ranges[0].end, (long long)size);
     } else {
-        wait_or_die(NULL);
+        // the body length has to be known up front, so every part header
+        // is formatted before anything is queued
+        snprintf(boundary, sizeof(boundary), "nweb-%llx-%llx",
+                 (long long)file->st.st_ino, (long long)file->st.st_mtime);
+        for (int i = 0; i < n; i++) {
+            total += snprintf(parts[i], sizeof(parts[i]),
+                              "%s--%s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                              i ? "\r\n" : "", boundary, file->mime,
+                              (long long)ranges[i].start,
+                              (long long)ranges[i].end, (long long)size);
+            total += ranges[i].end - ranges[i].start + 1;
+        }
+        total += strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
+        conn_printf(conn,
+                    ""
+                    "Content-Length: %lld\r\n"
+                    "Content-Type: multipart/byteranges; boundary=%s\r\n",
+                    (long long)total, boundary);
+    }
+    conn_printf(conn, "ETag: %s\r\nLast-Modified: %s\r\n", file->etag,
+                file->last_modified);
+    if (file->vary)
+        conn_printf(conn, "Vary: Accept-Encoding\r\n");
+    conn_printf(conn, "Accept-Ranges: bytes\r\n\r\n");
+
+    for (int i = 0; i < n; i++) {
+        if (n > 1)
+            conn_write(conn, parts[i], strlen(parts[i]));
+        file_cache_hold(file);
+        conn_write_file(conn, file->fd, ranges[i].start,
+                        ranges[i].end - ranges[i].start + 1, file_cache_release,
+                        file);
     }
+    if (n > 1)
+        conn_printf(conn, "\r\n--%s--\r\n", boundary);
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+//
+// Serve a static file. Clients taking gzip get the compressed variant if
+// there is one; for text files without one, a compressed copy is queued
+// for next time and this request gets the plain file.
+//
+void request_serve_static(conn_t *conn, file_entry_t *file,
+                          request_headers_t *headers) {
+    file_entry_t *body = file;
+    const char *encoding = NULL;
+    char header[MAXBUF], *srcp;
+    byte_range_t ranges[RANGE_MAX];
+    int split, hlen, n;
+    off_t filesize;
+
+    if (request_not_modified(file, headers)) {
+        request_serve_not_modified(
+            conn, file,
+            headers->gzip && (file->gzip_sibling || file->gzip_response));
+        return;
+    }
 
-    getMimeType(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
+    // slices are always of the identity encoding, and never cached
+    if (headers->range && request_if_range(file, headers)) {
+        n = request_parse_range(headers->range, file->st.st_size, ranges);
+        if (n >= 0) {
+            request_serve_ranges(conn, file, ranges, n);
+            return;
+        }
+    }
+
+    if (headers->gzip) {
+        file_response_t *response =
+            __atomic_load_n(&file->gzip_response, __ATOMIC_ACQUIRE);
+        if (response) {
+            stats_add(STAT_GZIP_CACHE_HITS, 1);
+            request_serve_cached(conn, file, response);
+            return;
+        }
+        if (file->gzip_sibling) {
+            stats_add(STAT_GZIP_CACHE_HITS, 1);
+            body = file->gzip_sibling;
+            encoding = "gzip";
+        } else {
+            gzip_cache_request(file);
+        }
+    }
+
+    // hot small files are answered from a prebuilt response
+    if (body == file) {
+        if (file->response == NULL && response_cache_admit_entry(file)) {
+            file_response_t *response =
+                request_build_response(file, NULL, file->st.st_size, NULL);
+            if (response && response_cache_set(file, response) < 0)
+                free(response);
+        }
+        if (__atomic_load_n(&file->response, __ATOMIC_ACQUIRE)) {
+            stats_add(STAT_RESPONSE_CACHE_HITS, 1);
+            request_serve_cached(conn, file, file->response);
+            return;
+        }
+    }
+
+    // put together response
+    filesize = body->st.st_size;
+    hlen = request_static_headers(header, sizeof(header), file, filesize,
+                                  encoding, &split);
+    conn->status = OK;
+    conn_write(conn, header, split);
+    request_connection_header(conn);
+    conn_write(conn, header + split, hlen - split);
+
+    if (filesize == 0)
+        return; // nothing to map
+
+    // Big files go from the page cache to the socket with sendfile(): no
+    // mapping to set up and tear down (and no TLB shootdowns across the
+    // worker threads when it is unmapped). The connection keeps a
+    // reference on the cached descriptor until the body is out.
+    if (filesize >= sendfile_threshold) {
+        file_cache_hold(body);
+        conn_write_file(conn, body->fd, 0, filesize, file_cache_release, body);
+        return;
+    }
 
     // Rather than call read() to read the file into memory,
     // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
+    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, body->fd, 0);
 
-    // put together response
-    sprintf(buf,
-            ""
-            "HTTP/1.0 200 OK\r\n"
-            "Server: nweb\r\n"
-            "Content-Length: %d\r\n"
-            "Content-Type: %s\r\n\r\n",
-            filesize, filetype);
+    // The mapping is queued on the connection and unmapped once sent
+    conn_write_map(conn, srcp, filesize);
+}
+
+//
+// The server's own metrics, at a path no file can shadow. Never cached,
+// so every scrape sees the counters as they are now.
+//
+void request_serve_stats(conn_t *conn, const char *query) {
+    int json = strstr(query, "format=json") != NULL;
+    size_t len;
+    char *body = stats_format(json, &len);
+
+    conn->status = OK;
+    conn_printf(conn, ""
+                      "HTTP/1.1 200 OK\r\n"
+                      "Server: nweb\r\n");
+    request_connection_header(conn);
+    conn_printf(conn,
+                ""
+                "Content-Length: %zu\r\n"
+                "Content-Type: %s\r\n"
+                "Cache-Control: no-store\r\n\r\n",
+                len, json ? "application/json" : "text/plain; version=0.0.4");
+    conn_write(conn, body, len);
+    free(body);
+}
 
-    write_or_die(fd, buf, strlen(buf));
+// microseconds since start, for the access log and latency histogram
+long request_elapsed(struct timespec *start) {
+    struct timespec now;
 
-    //  Writes out to the client socket the memory-mapped file
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
-// handle a request
-void *handle_request(void *arg_fd) {
-    int fd = *((int *)arg_fd);
-    int is_static;
+// the header block didn't fit in the input buffer
+void handle_bad_request(conn_t *conn) {
+    unsigned long long queued = conn->out_total;
+    struct timespec start;
+    long usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    conn_count_request(conn);
+    conn->keep_alive = 0;
+    request_error(conn, BAD_REQUEST, "request", "request headers too large");
+    usec = request_elapsed(&start);
+    stats_record(conn->status, conn->out_total - queued, usec);
+    log_access(conn_peer(conn), NULL, NULL, NULL, conn->status,
+               conn->out_total - queued, usec);
+}
+
+// answer one parsed request
+void request_dispatch(conn_t *conn, parse_request_t *req) {
+    char *method = req->method.ptr, *version = req->version.ptr, *filename;
     struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
+    file_entry_t *file;
+    request_headers_t headers;
+    int err;
 
-    // parse first line
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    // printf("method:%s uri:%s version:%s\n", method, uri, version);
-    // printf("filename: %s\n", filename);
+    conn->http11 = strncmp(version, "HTTP/1.", 7) == 0 &&
+                   strcmp(version, "HTTP/1.0") != 0;
+    conn->keep_alive = 0;
 
     if (strcasecmp(method, "GET")) {
-        request_error(fd, method, "501", "Not Implemented",
+        // we don't read request bodies, so we can't tell where the next
+        // request would start
+        request_error(conn, NOT_IMPLEMENTED, method,
                       "server does not implement this method");
-        return (void*)0;
+        return;
     }
-    request_read_headers(fd);
+    request_read_headers(req, &headers);
 
-    is_static = request_parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-        request_error(fd, filename, "404", "Not Found",
-                      "server could not find this file");
-        return (void*)0;
+    if (headers.connection == CONNECTION_KEEP_ALIVE)
+        conn->keep_alive = 1;
+    else if (headers.connection == CONNECTION_DEFAULT)
+        conn->keep_alive = conn->http11;
+    if (headers.has_body || conn->requests >= conn_max_requests)
+        conn->keep_alive = 0;
+
+    // refused once the connection's fate is known: a client over its rate
+    // keeps the connection, and learns when to try again
+    if (admit_request(conn) < 0) {
+        request_error(conn, TOO_MANY_REQUESTS, "request",
+                      "too many requests from this client");
+        return;
+    }
+
+    err = request_filename(conn, &req->path, &filename);
+    if (err == URI_TOO_LONG) {
+        request_error(conn, URI_TOO_LONG, "request",
+                      "the requested path is too long");
+        return;
+    }
+    if (err != 0) {
+        request_error(conn, BAD_REQUEST, "request",
+                      "the requested path is invalid");
+        return;
+    }
+
+    if (strcmp(filename + 1, STATS_PATH) == 0) {
+        request_serve_stats(conn, req->query.ptr);
+        return;
     }
 
-    if (is_static) {
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            request_error(fd, filename, "403", "Forbidden",
+    if (!strstr(filename, "cgi")) {
+        // open (or find already open) file, stat and MIME type in one go;
+        // the cache is keyed by the path without "./"
+        err = file_cache_open(filename + 2, &file);
+        if (err == ENOENT) {
+            request_error(conn, NOT_FOUND, filename,
+                          "server could not find this file");
+            return;
+        }
+        if (err != 0) {
+            request_error(conn, FORBIDDEN, filename,
                           "server could not read this file");
-            return (void*)0;
+            return;
         }
-        request_serve_static(fd, filename, sbuf.st_size);
+        request_serve_static(conn, file, &headers);
+        file_cache_put(file);
+        return;
+    }
+
+    if (stat(filename, &sbuf) < 0) {
+        request_error(conn, NOT_FOUND, filename,
+                      "server could not find this file");
+        return;
+    }
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+        request_error(conn, FORBIDDEN, filename,
+                      "server could not run this CGI program");
+        return;
+    }
+    request_serve_dynamic(conn, filename, req->query.ptr);
+}
+
+//
+// Handle a request, and log it once its response is queued. The header
+// block is parsed where it lies in the input buffer; only the file name
+// is built elsewhere, in the connection's arena.
+//
+void handle_request(conn_t *conn) {
+    parse_request_t req;
+    unsigned long long queued = conn->out_total;
+    struct timespec start;
+    long usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    conn_count_request(conn);
+    conn->status = 0;
+
+    if (parse_request(conn->in + conn->in_start, conn->hdr_end - conn->in_start,
+                      &req) < 0) {
+        // nothing of this request is known, so it is answered as HTTP/1.0
+        req.method.ptr = req.target.ptr = req.version.ptr = NULL;
+        conn->http11 = 0;
+        conn->keep_alive = 0;
+        request_error(conn, BAD_REQUEST, "request", "malformed request line");
     } else {
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            request_error(fd, filename, "403", "Forbidden",
-                          "server could not run this CGI program");
-            return (void*)0;
-        }
-        request_serve_dynamic(fd, filename, cgiargs);
+        request_dispatch(conn, &req);
+    }
+
+    usec = request_elapsed(&start);
+    stats_record(conn->status, conn->out_total - queued, usec);
+    log_access(conn_peer(conn), req.method.ptr, req.target.ptr,
+               req.version.ptr, conn->status, conn->out_total - queued, usec);
+}
+
+//
+// Handle the buffered request, then every complete request the client has
+// already pipelined behind it. The responses are only queued, in request
+// order, so the caller sends the whole batch with one conn_flush().
+//
+void handle_requests(conn_t *conn) {
+    int batch = 0;
+
+    while (1) {
+        handle_request(conn);
+        if (!conn->keep_alive || ++batch >= PIPELINE_MAX ||
+            conn->out_len >= PIPELINE_OUTBUF)
+            return;
+        conn_next_request(conn);
+        if (conn_request_ready(conn) <= 0)
+            return; // the rest isn't here yet
     }
-    return (void*)0;
 }
@@ -1,5 +1,23 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void *handle_request(void *fd);
+#include "conn.h"
+#include "file_cache.h"
+
+// Default size from which static files are sent with sendfile(). Smaller
+// bodies stay mmap()ed so they go out in the same writev() as their headers
+// (and as the rest of a pipelined batch); see bench/sendfile_bench.
+#define SENDFILE_THRESHOLD (16 * 1024)
+
+extern off_t sendfile_threshold;
+
+void handle_request(conn_t *conn);
+void handle_requests(conn_t *conn);
+void handle_bad_request(conn_t *conn);
+void request_init(void);
+void request_error(conn_t *conn, int status, const char *cause,
+                   const char *longmsg);
+file_response_t *request_build_response(file_entry_t *file, const char *body,
+                                        size_t len, const char *encoding);
 
 #endif // __REQUEST_H__
@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+//
+// Scalar versions: the fallback on other targets, and the tail of the
+// buffer that is too short for a full vector on x86.
+//
+static size_t header_end_scalar(const char *buf, size_t len, size_t from) {
+    const char *p = buf + from, *end = buf + len;
+
+    while (end - p >= 2 && (p = memchr(p, '\n', end - p - 1)) != NULL) {
+        if (p[1] == '\n')
+            return p - buf + 2;
+        if (p[1] == '\r' && end - p >= 3 && p[2] == '\n')
+            return p - buf + 3;
+        p++;
+    }
+    return 0;
+}
+
+static size_t line_end_scalar(const char *buf, size_t len, size_t from) {
+    const char *p = from < len ? memchr(buf + from, '\n', len - from) : NULL;
+    return p ? (size_t)(p - buf) : len;
+}
+
+#ifdef SCAN_X86
+//
+// The header block ends at a '\n' followed by "\n" or "\r\n", which covers
+// "\r\n\r\n" as well as the bare-LF forms. Compare the block at offsets
+// 0..2 and AND the results, so a set bit in lflf or lfcrlf marks an exact
+// match with no candidate re-checking. Blocks stop 2 bytes short so loads
+// stay in bounds.
+//
+static size_t header_end_sse2(const char *buf, size_t len, size_t from) {
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    size_t i = from;
+
+    for (; i + 16 + 2 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(buf + i + 2));
+        __m128i a_lf = _mm_cmpeq_epi8(a, lf);
+        int lflf = _mm_movemask_epi8(_mm_and_si128(a_lf, _mm_cmpeq_epi8(b, lf)));
+        int lfcrlf = _mm_movemask_epi8(_mm_and_si128(
+            a_lf, _mm_and_si128(_mm_cmpeq_epi8(b, cr), _mm_cmpeq_epi8(c, lf))));
+        if (lflf | lfcrlf) {
+            int at = __builtin_ctz(lflf | lfcrlf);
+            return i + at + (lflf >> at & 1 ? 2 : 3);
+        }
+    }
+    return header_end_scalar(buf, len, i);
+}
+
+static size_t line_end_sse2(const char *buf, size_t len, size_t from) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = from;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, lf));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return line_end_scalar(buf, len, i);
+}
+
+__attribute__((target("avx2")))
+static size_t header_end_avx2(const char *buf, size_t len, size_t from) {
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    size_t i = from;
+
+    for (; i + 32 + 2 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(buf + i + 2));
+        __m256i a_lf = _mm256_cmpeq_epi8(a, lf);
+        unsigned lflf = _mm256_movemask_epi8(
+            _mm256_and_si256(a_lf, _mm256_cmpeq_epi8(b, lf)));
+        unsigned lfcrlf = _mm256_movemask_epi8(_mm256_and_si256(
+            a_lf, _mm256_and_si256(_mm256_cmpeq_epi8(b, cr),
+                                   _mm256_cmpeq_epi8(c, lf))));
+        if (lflf | lfcrlf) {
+            int at = __builtin_ctz(lflf | lfcrlf);
+            return i + at + (lflf >> at & 1 ? 2 : 3);
+        }
+    }
+    return header_end_sse2(buf, len, i);
+}
+
+__attribute__((target("avx2")))
+static size_t line_end_avx2(const char *buf, size_t len, size_t from) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = from;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, lf));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return line_end_sse2(buf, len, i);
+}
+#endif // SCAN_X86
+
+static size_t (*header_end_fn)(const char *, size_t, size_t) = header_end_scalar;
+static size_t (*line_end_fn)(const char *, size_t, size_t) = line_end_scalar;
+static const char *impl_name = "scalar";
+
+// pick the widest implementation the CPU supports, once at startup
+__attribute__((constructor)) static void scan_init(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        header_end_fn = header_end_avx2;
+        line_end_fn = line_end_avx2;
+        impl_name = "avx2";
+    } else {
+        header_end_fn = header_end_sse2;
+        line_end_fn = line_end_sse2;
+        impl_name = "sse2";
+    }
+#endif
+}
+
+size_t scan_header_end(const char *buf, size_t len, size_t from) {
+    return header_end_fn(buf, len, from);
+}
+
+size_t scan_line_end(const char *buf, size_t len, size_t from) {
+    return line_end_fn(buf, len, from);
+}
+
+const char *scan_impl(void) {
+    return impl_name;
+}
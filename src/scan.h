@@ -0,0 +1,20 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stddef.h>
+
+// Vectorized scanners for request parsing. SSE2 is always there on x86-64,
+// AVX2 is picked at startup when the CPU has it, and other targets get
+// the scalar versions.
+
+// Offset just past the first blank line in buf[from..len): "\r\n\r\n", or
+// "\n\n" / "\n\r\n" from bare-LF clients. 0 if none
+size_t scan_header_end(const char *buf, size_t len, size_t from);
+
+// Offset of the first '\n' in buf[from..len), or len if none
+size_t scan_line_end(const char *buf, size_t len, size_t from);
+
+// Name of the implementation in use, for the startup banner
+const char *scan_impl(void);
+
+#endif // __SCAN_H__
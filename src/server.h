@@ -1,6 +1,7 @@
 #ifndef HTTP_SERVER_H
 #define HTTP_SERVER_H
 
+#include <pthread.h>
 #include <sys/socket.h>
 
 typedef struct HTTP_Server
@@ -12,5 +13,11 @@ typedef struct HTTP_Server
 } HTTP_Server;
 
 void init_server(HTTP_Server *http_server, int port);
+void init_server_shard(HTTP_Server *http_server, int port);
+void server_steer_by_cpu(HTTP_Server *http_server, const int *shard_cpus,
+                         int nshards);
+int server_cpus(int *cpus, int max);
+void server_pin_attr(pthread_attr_t *attr, int cpu);
+void server_raise_fd_limit(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,262 @@
+#include <pthread.h>
+#include <stdarg.h>
+
+#include "io_helper.h"
+#include "stats.h"
+
+#define STATS_GAUGES (16)
+
+static stats_thread_t *slots[STATS_MAX_THREADS];
+static int nslots; // slots ever handed out
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread stats_thread_t *stats_self;
+
+static struct {
+    const char *name;
+    const char *help;
+    stats_gauge_t read;
+} gauges[STATS_GAUGES];
+static int ngauges;
+
+// names and help text of the counters, in enum StatsCounter order
+static const char *counter_names[STAT_COUNTERS][2] = {
+    {"connections_total", "Connections accepted"},
+    {"connections_closed_total", "Connections closed"},
+    {"requests_total", "Requests answered"},
+    {"responses_2xx_total", "Responses with a 2xx status"},
+    {"responses_3xx_total", "Responses with a 3xx status"},
+    {"responses_4xx_total", "Responses with a 4xx status"},
+    {"responses_5xx_total", "Responses with a 5xx status"},
+    {"response_bytes_total", "Response bytes queued, headers included"},
+    {"file_cache_hits_total", "Static file lookups answered by the open-file cache"},
+    {"file_cache_misses_total", "Static file lookups that had to open the file"},
+    {"response_cache_hits_total", "Requests answered from a prebuilt response"},
+    {"gzip_cache_hits_total", "Requests answered with a gzip variant"},
+    {"connections_shed_total", "Connections turned away with a 503"},
+    {"requests_limited_total", "Requests over their client's rate, answered with a 429"},
+};
+
+//
+// Slots are never freed: a retired thread's counts stay in the totals,
+// and a new thread takes the slot over and keeps counting on top of them.
+//
+stats_thread_t *stats_register_thread(void) {
+    stats_thread_t *slot = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < nslots && slot == NULL; i++) {
+        if (!slots[i]->used)
+            slot = slots[i];
+    }
+    if (slot == NULL) {
+        assert(nslots < STATS_MAX_THREADS);
+        slot = aligned_alloc(64, sizeof(stats_thread_t));
+        assert(slot != NULL);
+        memset(slot, 0, sizeof(stats_thread_t));
+        slots[nslots] = slot;
+        __atomic_store_n(&nslots, nslots + 1, __ATOMIC_RELEASE);
+    }
+    slot->used = 1;
+    pthread_mutex_unlock(&registry_lock);
+    return slot;
+}
+
+void stats_unregister_thread(void) {
+    if (stats_self == NULL)
+        return;
+    pthread_mutex_lock(&registry_lock);
+    stats_self->used = 0;
+    pthread_mutex_unlock(&registry_lock);
+    stats_self = NULL;
+}
+
+// Values below STATS_SUB_BUCKETS get a bucket each; above that, each power
+// of two is split into STATS_SUB_BUCKETS by the bits after the top one
+static int stats_bucket(unsigned long usec) {
+    int shift, idx;
+
+    if (usec < STATS_SUB_BUCKETS)
+        return usec;
+    shift = 63 - __builtin_clzl(usec) - STATS_SUB_BITS;
+    idx = (shift + 1) * STATS_SUB_BUCKETS +
+          ((usec >> shift) & (STATS_SUB_BUCKETS - 1));
+    return idx < STATS_BUCKETS ? idx : STATS_BUCKETS - 1;
+}
+
+// smallest value that no longer falls into bucket idx
+static unsigned long stats_bucket_end(int idx) {
+    int shift = idx / STATS_SUB_BUCKETS - 1;
+
+    if (shift < 0)
+        return idx + 1;
+    return (unsigned long)(STATS_SUB_BUCKETS + idx % STATS_SUB_BUCKETS + 1)
+           << shift;
+}
+
+static void stats_bump(unsigned long *value, unsigned long n) {
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+void stats_record(int status, unsigned long long bytes, long usec) {
+    stats_thread_t *self = stats_self;
+
+    if (self == NULL)
+        self = stats_self = stats_register_thread();
+    if (usec < 0)
+        usec = 0;
+    if (status >= 200 && status < 600)
+        stats_bump(&self->counters[STAT_STATUS_2XX + status / 100 - 2], 1);
+    stats_bump(&self->counters[STAT_BYTES], bytes);
+    stats_bump(&self->latency[stats_bucket(usec)], 1);
+    stats_bump(&self->latency_sum, usec);
+}
+
+unsigned long stats_sum(int counter) {
+    int n = __atomic_load_n(&nslots, __ATOMIC_ACQUIRE);
+    unsigned long sum = 0;
+
+    for (int i = 0; i < n; i++)
+        sum += __atomic_load_n(&slots[i]->counters[counter], __ATOMIC_RELAXED);
+    return sum;
+}
+
+void stats_add_gauge(const char *name, const char *help, stats_gauge_t read) {
+    pthread_mutex_lock(&registry_lock);
+    assert(ngauges < STATS_GAUGES);
+    gauges[ngauges].name = name;
+    gauges[ngauges].help = help;
+    gauges[ngauges].read = read;
+    __atomic_store_n(&ngauges, ngauges + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// growing output buffer for stats_format()
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} stats_buf_t;
+
+static void stats_printf(stats_buf_t *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void stats_printf(stats_buf_t *out, const char *format, ...) {
+    va_list arg;
+    int n;
+
+    while (1) {
+        va_start(arg, format);
+        n = vsnprintf(out->buf + out->len, out->cap - out->len, format, arg);
+        va_end(arg);
+        if ((size_t)n < out->cap - out->len)
+            break;
+        out->cap = out->cap * 2 + n;
+        out->buf = realloc_or_die(out->buf, out->cap);
+    }
+    out->len += n;
+}
+
+// the value below which the given fraction of the samples fall
+static unsigned long stats_percentile(unsigned long *latency,
+                                      unsigned long count, double fraction) {
+    unsigned long rank = (unsigned long)(count * fraction), seen = 0;
+
+    if (count == 0)
+        return 0;
+    if (rank >= count)
+        rank = count - 1; // the largest sample
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen > rank)
+            return stats_bucket_end(i);
+    }
+    return 0;
+}
+
+char *stats_format(int json, size_t *len) {
+    int n = __atomic_load_n(&nslots, __ATOMIC_ACQUIRE);
+    int g = __atomic_load_n(&ngauges, __ATOMIC_ACQUIRE);
+    unsigned long counters[STAT_COUNTERS] = {0}, latency[STATS_BUCKETS] = {0};
+    unsigned long count = 0, sum = 0, cumulative = 0;
+    stats_buf_t out = {malloc_or_die(4096), 0, 4096};
+
+    // merge the slots; a reading taken while threads count is as good as
+    // any, every value only goes up
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < STAT_COUNTERS; c++)
+            counters[c] += __atomic_load_n(&slots[i]->counters[c], __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            latency[b] += __atomic_load_n(&slots[i]->latency[b], __ATOMIC_RELAXED);
+        sum += __atomic_load_n(&slots[i]->latency_sum, __ATOMIC_RELAXED);
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++)
+        count += latency[b];
+
+    if (json) {
+        stats_printf(&out, "{");
+        for (int c = 0; c < STAT_COUNTERS; c++)
+            stats_printf(&out, "\"%s\": %lu, ", counter_names[c][0], counters[c]);
+        for (int i = 0; i < g; i++)
+            stats_printf(&out, "\"%s\": %lu, ", gauges[i].name, gauges[i].read());
+        stats_printf(&out,
+                     "\"latency_us\": {\"count\": %lu, \"sum\": %lu, "
+                     "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, "
+                     "\"max\": %lu}, ",
+                     count, sum, stats_percentile(latency, count, 0.5),
+                     stats_percentile(latency, count, 0.9),
+                     stats_percentile(latency, count, 0.99),
+                     stats_percentile(latency, count, 0.999),
+                     stats_percentile(latency, count, 1.0));
+        stats_printf(&out, "\"threads\": [");
+        for (int i = 0; i < n; i++)
+            stats_printf(&out, "%s%lu", i ? ", " : "",
+                         __atomic_load_n(&slots[i]->counters[STAT_REQUESTS],
+                                         __ATOMIC_RELAXED));
+        stats_printf(&out, "]}\n");
+        *len = out.len;
+        return out.buf;
+    }
+
+    for (int c = 0; c < STAT_COUNTERS; c++)
+        stats_printf(&out,
+                     "# HELP nweb_%s %s\n"
+                     "# TYPE nweb_%s counter\n"
+                     "nweb_%s %lu\n",
+                     counter_names[c][0], counter_names[c][1],
+                     counter_names[c][0], counter_names[c][0], counters[c]);
+    for (int i = 0; i < g; i++)
+        stats_printf(&out,
+                     "# HELP nweb_%s %s\n"
+                     "# TYPE nweb_%s gauge\n"
+                     "nweb_%s %lu\n",
+                     gauges[i].name, gauges[i].help, gauges[i].name,
+                     gauges[i].name, gauges[i].read());
+
+    // a request count per thread shows how evenly the work is spread
+    stats_printf(&out, "# HELP nweb_thread_requests_total Requests answered "
+                       "by each thread\n"
+                       "# TYPE nweb_thread_requests_total counter\n");
+    for (int i = 0; i < n; i++)
+        stats_printf(&out, "nweb_thread_requests_total{thread=\"%d\"} %lu\n", i,
+                     __atomic_load_n(&slots[i]->counters[STAT_REQUESTS],
+                                     __ATOMIC_RELAXED));
+
+    // the histogram's buckets are exact at every power of two
+    stats_printf(&out, "# HELP nweb_request_duration_seconds Time to produce "
+                       "a response\n"
+                       "# TYPE nweb_request_duration_seconds histogram\n");
+    for (int b = 0, k = 0; k <= 25; k++) {
+        for (; b < STATS_BUCKETS && stats_bucket_end(b) <= 1UL << k; b++)
+            cumulative += latency[b];
+        stats_printf(&out, "nweb_request_duration_seconds_bucket{le=\"%g\"} %lu\n",
+                     (double)(1UL << k) / 1e6, cumulative);
+    }
+    stats_printf(&out,
+                 "nweb_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+                 "nweb_request_duration_seconds_sum %g\n"
+                 "nweb_request_duration_seconds_count %lu\n",
+                 count, sum / 1e6, count);
+    *len = out.len;
+    return out.buf;
+}
@@ -0,0 +1,72 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+//
+// Server metrics. Every thread counts into its own cache-line aligned
+// slot, so recording is a plain load and store with nothing shared between
+// threads; the slots are only summed when somebody reads them (the report
+// on exit, or a GET of STATS_PATH). Latencies go into a log-bucketed
+// histogram: STATS_SUB_BUCKETS buckets per power of two microseconds, so
+// every bucket is within 12.5% of the values in it.
+//
+
+#define STATS_PATH "/__stats" // ?format=json for JSON, else Prometheus text
+#define STATS_MAX_THREADS (1024)
+#define STATS_SUB_BITS (3)
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (40 * STATS_SUB_BUCKETS) // up to 2^40 us
+
+enum StatsCounter {
+    STAT_CONNECTIONS,        // accepted
+    STAT_CONNECTIONS_CLOSED,
+    STAT_REQUESTS,
+    STAT_STATUS_2XX,
+    STAT_STATUS_3XX,
+    STAT_STATUS_4XX,
+    STAT_STATUS_5XX,
+    STAT_BYTES, // response bytes queued, headers included
+    STAT_FILE_CACHE_HITS,
+    STAT_FILE_CACHE_MISSES,
+    STAT_RESPONSE_CACHE_HITS,
+    STAT_GZIP_CACHE_HITS,
+    STAT_CONNECTIONS_SHED,
+    STAT_REQUESTS_LIMITED,
+    STAT_COUNTERS
+};
+
+typedef struct {
+    unsigned long counters[STAT_COUNTERS];
+    unsigned long latency[STATS_BUCKETS];
+    unsigned long latency_sum; // us
+    int used;
+} __attribute__((aligned(64))) stats_thread_t;
+
+extern __thread stats_thread_t *stats_self;
+stats_thread_t *stats_register_thread(void);
+void stats_unregister_thread(void);
+
+// single writer per slot: no atomic read-modify-write needed, the relaxed
+// store only keeps readers from seeing a torn value
+static inline void stats_add(int counter, unsigned long n) {
+    if (stats_self == NULL)
+        stats_self = stats_register_thread();
+    __atomic_store_n(&stats_self->counters[counter],
+                     stats_self->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+// status code, size and time taken of one response
+void stats_record(int status, unsigned long long bytes, long usec);
+
+// totals over all threads
+unsigned long stats_sum(int counter);
+
+// A value read when the stats are, such as a queue depth
+typedef unsigned long (*stats_gauge_t)(void);
+void stats_add_gauge(const char *name, const char *help, stats_gauge_t read);
+
+// the stats as a Prometheus text or JSON document, malloc()ed
+char *stats_format(int json, size_t *len);
+
+#endif // __STATS_H__
@@ -0,0 +1,641 @@
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include "admit.h"
+#include "conn.h"
+#include "io_helper.h"
+#include "request.h"
+#include "server.h"
+#include "uring.h"
+
+//
+// io_uring engine, spoken to through the raw system calls. Every loop
+// thread owns a ring and its connections, like an epoll loop, and keeps a
+// multishot accept and one multishot receive per connection armed; it
+// only enters the kernel once per round, to submit what it queued and
+// wait for completions.
+//
+
+#define URING_ENTRIES (256)      // submission queue; completions get 4x
+#define URING_BUFS (256)         // provided receive buffers per loop
+#define URING_BUF_SIZE (4096)
+#define URING_SPLICE (64 * 1024) // file bytes per splice, a pipe's worth
+
+// input a client may send ahead of the responses it's waiting for
+#define URING_BACKLOG_MAX (64 * 1024)
+
+// what a completion is about: the low bits of its user_data, the rest
+// being the connection (NULL for accepts)
+enum UringOp { OP_ACCEPT, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_CANCEL };
+#define OP_MASK (7)
+
+// conn->ring_flags
+#define RING_RECV (1)    // multishot receive armed
+#define RING_EOF (2)     // client shut down its side
+#define RING_CLOSING (4) // freed once nothing of it is in flight
+
+// the sendmsg() in flight, kept with the connection until it completes
+typedef struct {
+    struct msghdr msg;
+    struct iovec iov[CONN_IOV];
+} uring_msg_t;
+
+typedef struct {
+    int listen_fd;
+    int accepting; // multishot accept armed
+    pthread_t thread;
+    time_t now; // refreshed once per round
+    conn_idle_t idle;
+
+    int ring_fd;
+    int enter_fd;         // ring_fd's registered index, or ring_fd
+    unsigned enter_flags; // IORING_ENTER_REGISTERED_RING if registered
+    void *rings;
+    size_t rings_size;
+
+    // submission queue: entries up to sq_tail are ours until submitted
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_ktail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail;
+
+    // completion queue
+    struct io_uring_cqe *cqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+
+    // receive buffers, handed to the kernel through a ring of their own
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+} uring_t;
+
+static void uring_serve(uring_t *r, conn_t *conn);
+static void uring_send(uring_t *r, conn_t *conn);
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz) {
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg,
+                   argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *uring_map(int fd, size_t size, off_t off) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, off);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// hand buffer bid (back) to the kernel; published with the next submit
+static void uring_buf_put(uring_t *r, unsigned short bid) {
+    struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    r->br_tail++;
+}
+
+//
+// Set up the calling thread's ring. DEFER_TASKRUN (6.1) makes completions
+// run only when we ask for them, in io_uring_enter(), rather than
+// interrupting the loop; SINGLE_ISSUER (6.0) lets the kernel skip locking.
+// Both hold because only this thread ever touches the ring. Returns -1
+// with errno; uring_destroy() cleans up what was set up.
+//
+static int uring_init(uring_t *r) {
+    struct io_uring_params p;
+    struct io_uring_rsrc_update reg_ring;
+    struct io_uring_buf_reg reg_bufs;
+    unsigned *array;
+    char *ring;
+    void *br;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+              IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    r->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (r->ring_fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                  IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+        p.cq_entries = URING_ENTRIES * 4;
+        r->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    // SINGLE_ISSUER came with multishot receive, so a kernel that refuses
+    // it couldn't run the loops anyway
+    if (r->ring_fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (r->rings_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        r->rings_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->rings = uring_map(r->ring_fd, r->rings_size, IORING_OFF_SQ_RING);
+    if (r->rings == NULL)
+        return -1;
+    r->sqes = uring_map(r->ring_fd, r->sqes_size, IORING_OFF_SQES);
+    if (r->sqes == NULL)
+        return -1;
+
+    ring = r->rings;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_ktail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_tail = *r->sq_ktail;
+    // entries are always used in ring order
+    array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // with the ring itself registered, io_uring_enter() skips the fd lookup
+    r->enter_fd = r->ring_fd;
+    r->enter_flags = 0;
+    memset(&reg_ring, 0, sizeof(reg_ring));
+    reg_ring.offset = -1U;
+    reg_ring.data = r->ring_fd;
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_RING_FDS, &reg_ring,
+                              1) == 1) {
+        r->enter_fd = reg_ring.offset;
+        r->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+
+    br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+        return -1;
+    r->br = br;
+    memset(&reg_bufs, 0, sizeof(reg_bufs));
+    reg_bufs.ring_addr = (uintptr_t)br;
+    reg_bufs.ring_entries = URING_BUFS;
+    reg_bufs.bgid = 0;
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_PBUF_RING, &reg_bufs,
+                              1) < 0)
+        return -1;
+    r->bufs = malloc_or_die((size_t)URING_BUFS * URING_BUF_SIZE);
+    for (int i = 0; i < URING_BUFS; i++)
+        uring_buf_put(r, i);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void uring_destroy(uring_t *r) {
+    struct io_uring_rsrc_update reg_ring;
+
+    if (r->enter_flags & IORING_ENTER_REGISTERED_RING) {
+        memset(&reg_ring, 0, sizeof(reg_ring));
+        reg_ring.offset = r->enter_fd;
+        sys_io_uring_register(r->ring_fd, IORING_UNREGISTER_RING_FDS,
+                              &reg_ring, 1);
+    }
+    if (r->br)
+        munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->rings)
+        munmap(r->rings, r->rings_size);
+    if (r->ring_fd >= 0)
+        close(r->ring_fd);
+    free(r->bufs);
+}
+
+//
+// Submit everything queued and, with wait, wait up to a second for at
+// least one completion (and run the completions' deferred work).
+//
+static void uring_submit(uring_t *r, int wait) {
+    struct __kernel_timespec ts = {.tv_sec = 1};
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+    unsigned flags = r->enter_flags;
+    unsigned queued;
+
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    queued = r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (wait)
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    else if (queued == 0)
+        return;
+    if (sys_io_uring_enter(r->enter_fd, queued, wait, flags,
+                           wait ? &arg : NULL, wait ? sizeof(arg) : 0) < 0 &&
+        errno != EINTR && errno != ETIME) {
+        perror("io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// room for n more submissions, submitting what is queued if need be
+static void uring_reserve(uring_t *r, unsigned n) {
+    while (r->sq_tail + n - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >
+           r->sq_entries)
+        uring_submit(r, 0);
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *r, conn_t *conn, int op) {
+    struct io_uring_sqe *sqe;
+
+    uring_reserve(r, 1);
+    sqe = &r->sqes[r->sq_tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)conn | op;
+    if (conn)
+        conn->ring_ops++;
+    return sqe;
+}
+
+static void uring_accept(uring_t *r) {
+    struct io_uring_sqe *sqe = uring_sqe(r, NULL, OP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    r->accepting = 1;
+}
+
+// receive into whichever provided buffer is next, until cancelled
+static void uring_recv(uring_t *r, conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(r, conn, OP_RECV);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    conn->ring_flags |= RING_RECV;
+}
+
+//
+// Stop everything in flight on the connection; the last completion frees
+// it. Freeing right away is the caller's business when nothing is.
+//
+static void uring_close(uring_t *r, conn_t *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->ring_flags & RING_CLOSING)
+        return;
+    conn->ring_flags |= RING_CLOSING;
+    conn_idle_remove(&r->idle, conn);
+    if (conn->ring_ops == 0)
+        return;
+    sqe = uring_sqe(r, conn, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+// close connections that have not made progress within the idle timeout
+static void uring_expire(uring_t *r) {
+    while (r->idle.head &&
+           r->now - r->idle.head->last_active >= conn_idle_timeout) {
+        conn_t *conn = r->idle.head;
+        uring_close(r, conn);
+        if (conn->ring_ops == 0)
+            conn_free(conn);
+    }
+}
+
+//
+// Keep received bytes: in the input buffer while there's room, the rest
+// waits in the backlog until the requests ahead of it are answered. The
+// buffer is left alone while a response is on its way, since making room
+// would move the request being answered.
+//
+static void uring_input(uring_t *r, conn_t *conn, const char *data,
+                        size_t len) {
+    size_t n = 0;
+
+    if (conn->state == CONN_READING && conn->backlog_len == 0)
+        n = conn_append(conn, data, len);
+
+    if (n == len)
+        return;
+    if (conn->backlog_len + len - n > URING_BACKLOG_MAX) {
+        uring_close(r, conn); // no client needs to be that far ahead
+        return;
+    }
+    if (conn->backlog == NULL)
+        conn->backlog = malloc_or_die(URING_BACKLOG_MAX);
+    memcpy(conn->backlog + conn->backlog_len, data + n, len - n);
+    conn->backlog_len += len - n;
+}
+
+static void uring_refill(conn_t *conn) {
+    size_t n;
+
+    if (conn->backlog_len == 0)
+        return;
+    n = conn_append(conn, conn->backlog, conn->backlog_len);
+    memmove(conn->backlog, conn->backlog + n, conn->backlog_len - n);
+    conn->backlog_len -= n;
+}
+
+// the response went out: on to the next request, if there may be one
+static void uring_done(uring_t *r, conn_t *conn) {
+    if (!conn->keep_alive) {
+        uring_close(r, conn);
+        return;
+    }
+    conn_next_request(conn);
+    conn->state = CONN_READING;
+    uring_serve(r, conn);
+}
+
+//
+// A file chunk goes through the connection's pipe: a splice from the file
+// into it, linked to one from it to the socket so both go in one
+// submission. If the first moves less than asked, the kernel cancels the
+// second and what did make it into the pipe goes out on its own.
+//
+static void uring_splice(uring_t *r, conn_t *conn, conn_chunk_t *chunk) {
+    struct io_uring_sqe *sqe;
+    size_t len = conn->pipe_len;
+
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        uring_close(r, conn);
+        return;
+    }
+    uring_reserve(r, 2); // a link must not be split across submits
+    if (len == 0) {
+        len = chunk->len - conn->chunk_sent;
+        if (len > URING_SPLICE)
+            len = URING_SPLICE;
+        sqe = uring_sqe(r, conn, OP_SPLICE_IN);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->splice_fd_in = chunk->file_fd;
+        sqe->splice_off_in = chunk->file_off + conn->chunk_sent;
+        sqe->fd = conn->pipefd[1];
+        sqe->off = -1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+    }
+    sqe = uring_sqe(r, conn, OP_SPLICE_OUT);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->pipefd[0];
+    sqe->splice_off_in = -1;
+    sqe->fd = conn->fd;
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+// send the next stretch of queued output, or finish the response
+static void uring_send(uring_t *r, conn_t *conn) {
+    struct io_uring_sqe *sqe;
+    conn_chunk_t *chunk;
+    uring_msg_t *m;
+
+    if (conn->chunk_pos == conn->nchunks) {
+        uring_done(r, conn);
+        return;
+    }
+    chunk = &conn->chunks[conn->chunk_pos];
+    if (chunk->file_fd >= 0) {
+        uring_splice(r, conn, chunk);
+        return;
+    }
+
+    // memory chunks, as many as gather() takes, in one sendmsg() that the
+    // kernel retries until all of it is sent (MSG_WAITALL)
+    if (conn->ring_msg == NULL)
+        conn->ring_msg = malloc_or_die(sizeof(uring_msg_t));
+    m = conn->ring_msg;
+    memset(&m->msg, 0, sizeof(m->msg));
+    m->msg.msg_iov = m->iov;
+    m->msg.msg_iovlen = conn_gather(conn, m->iov, CONN_IOV);
+    sqe = uring_sqe(r, conn, OP_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)&m->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+}
+
+// answer whatever complete requests are buffered
+static void uring_serve(uring_t *r, conn_t *conn) {
+    int ready;
+
+    uring_refill(conn);
+    ready = conn_request_ready(conn);
+    if (ready == 0) {
+        if (conn->ring_flags & RING_EOF)
+            uring_close(r, conn); // client is done with us
+        return;                   // wait for more input
+    }
+    if (ready < 0)
+        handle_bad_request(conn);
+    else
+        handle_requests(conn);
+    conn->state = CONN_WRITING;
+    uring_send(r, conn);
+}
+
+static void uring_accepted(uring_t *r, int res, unsigned flags) {
+    conn_t *conn;
+
+    if (!(flags & IORING_CQE_F_MORE))
+        r->accepting = 0; // armed again next round
+    if (res < 0) {
+        if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+            errno = -res;
+            perror("accept");
+        }
+        return;
+    }
+    conn = conn_new(res);
+    conn->evented = 1;
+    if (admit_conn(conn, NULL) < 0) {
+        admit_refuse(conn->fd); // nothing is in flight for it yet
+        conn_free(conn);
+        return;
+    }
+    conn_idle_touch(&r->idle, conn, r->now);
+    uring_recv(r, conn);
+}
+
+static void uring_received(uring_t *r, conn_t *conn, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->ring_flags &= ~RING_RECV;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !(conn->ring_flags & RING_CLOSING))
+            uring_input(r, conn, r->bufs + (size_t)bid * URING_BUF_SIZE, res);
+        uring_buf_put(r, bid); // copied out, the kernel can have it back
+    }
+    if (conn->ring_flags & RING_CLOSING)
+        return;
+    if (res < 0 && res != -ENOBUFS) {
+        uring_close(r, conn);
+        return;
+    }
+    if (res == 0) {
+        // answer what's already buffered before closing
+        conn->ring_flags |= RING_EOF;
+    } else {
+        if (res > 0)
+            conn_idle_touch(&r->idle, conn, r->now);
+        // a receive stops early when it runs out of buffers
+        if (!(conn->ring_flags & RING_RECV))
+            uring_recv(r, conn);
+    }
+    if (conn->state == CONN_READING)
+        uring_serve(r, conn);
+}
+
+static void uring_sent(uring_t *r, conn_t *conn, int res) {
+    if (conn->ring_flags & RING_CLOSING)
+        return;
+    if (res < 0) {
+        uring_close(r, conn); // e.g. the client went away
+        return;
+    }
+    conn_sent(conn, res);
+    conn_idle_touch(&r->idle, conn, r->now);
+    uring_send(r, conn);
+}
+
+static void uring_spliced_in(uring_t *r, conn_t *conn, int res) {
+    if (conn->ring_flags & RING_CLOSING)
+        return;
+    if (res <= 0) {
+        uring_close(r, conn); // read error, or the file shrank
+        return;
+    }
+    conn->pipe_len += res;
+}
+
+static void uring_spliced_out(uring_t *r, conn_t *conn, int res) {
+    if (conn->ring_flags & RING_CLOSING)
+        return;
+    if (res == -ECANCELED) {
+        uring_send(r, conn); // short splice in: send what the pipe holds
+        return;
+    }
+    if (res <= 0) {
+        uring_close(r, conn);
+        return;
+    }
+    conn->pipe_len -= res;
+    conn_sent(conn, res);
+    conn_idle_touch(&r->idle, conn, r->now);
+    uring_send(r, conn);
+}
+
+static void uring_complete(uring_t *r, uint64_t data, int res, unsigned flags) {
+    conn_t *conn = (conn_t *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+
+    if ((data & OP_MASK) == OP_ACCEPT) {
+        uring_accepted(r, res, flags);
+        return;
+    }
+    // a multishot request only ends with a completion that lacks F_MORE
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->ring_ops--;
+    switch (data & OP_MASK) {
+    case OP_RECV:
+        uring_received(r, conn, res, flags);
+        break;
+    case OP_SEND:
+        uring_sent(r, conn, res);
+        break;
+    case OP_SPLICE_IN:
+        uring_spliced_in(r, conn, res);
+        break;
+    case OP_SPLICE_OUT:
+        uring_spliced_out(r, conn, res);
+        break;
+    }
+    if ((conn->ring_flags & RING_CLOSING) && conn->ring_ops == 0)
+        conn_free(conn);
+}
+
+static void uring_reap(uring_t *r) {
+    unsigned head = *r->cq_head;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+        // the slot is free as soon as it's copied
+        __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+        uring_complete(r, cqe.user_data, cqe.res, cqe.flags);
+    }
+}
+
+static void *uring_thread(void *arg) {
+    uring_t *r = arg;
+
+    if (uring_init(r) < 0) {
+        perror("io_uring_setup");
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        if (!r->accepting)
+            uring_accept(r);
+        // recycled buffers go back with the submissions; wake up at least
+        // once a second to expire idle connections
+        __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+        uring_submit(r, 1);
+        r->now = time(NULL);
+        uring_reap(r);
+        uring_expire(r);
+    }
+    return NULL;
+}
+
+int uring_start(int listen_fd, int nloops, int cpu) {
+    uring_t probe, *loops;
+    pthread_attr_t attr;
+
+    // a throwaway ring set up exactly like the loops', so a kernel that
+    // can't is found out here rather than in every thread
+    memset(&probe, 0, sizeof(probe));
+    if (uring_init(&probe) < 0) {
+        uring_destroy(&probe);
+        return -1;
+    }
+    uring_destroy(&probe);
+
+    loops = calloc(nloops, sizeof(uring_t));
+    assert(loops != NULL);
+    server_raise_fd_limit();
+    server_pin_attr(&attr, cpu);
+    for (int i = 0; i < nloops; i++) {
+        uring_t *r = &loops[i];
+        r->listen_fd = listen_fd;
+        r->now = time(NULL);
+        if (pthread_create(&r->thread, &attr, uring_thread, r) != 0) {
+            perror("Failed to create io_uring loop thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(r->thread);
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+//
+// The io_uring engine: the same per-thread connection state machine as the
+// epoll engine, but each loop hands the kernel work instead of asking it
+// what is ready. Accepts and receives are multishot requests that keep
+// completing (received data lands in a ring of buffers the loop provides),
+// responses go out as sendmsg() and splice() requests, and one
+// io_uring_enter() per round submits everything queued and collects what
+// finished.
+//
+
+//
+// Start nloops io_uring loops accepting from listen_fd, pinned to cpu (-1:
+// not pinned). Returns -1 if this kernel can't run them (io_uring missing,
+// disabled or older than 6.0), so the caller can use the epoll engine.
+//
+int uring_start(int listen_fd, int nloops, int cpu);
+
+#endif // __URING_H__
@@ -0,0 +1,140 @@
+#!/bin/sh
+#
+# Range request checks, run by `make check`.
+#
+# Starts ./server on a scratch docroot holding a 1000-byte file and an
+# empty one, sends Range requests with curl and compares the status line,
+# Content-Range and body of every answer with what RFC 9110 asks for.
+#
+# usage: tests/range.sh
+#
+# Environment: CHECK_PORT (8198)
+#
+
+set -e
+set -f # Range values are not globs
+cd "$(dirname "$0")/.."
+
+PORT=${CHECK_PORT:-8198}
+OUT=tests/out
+DOCROOT=$OUT/docroot
+URL=http://127.0.0.1:$PORT
+FILE=$DOCROOT/data.txt
+failed=0
+
+server_pid=
+stop_server() {
+    if [ -n "$server_pid" ]; then
+        kill $server_pid 2>/dev/null || true
+        wait $server_pid 2>/dev/null || true
+    fi
+    server_pid=
+}
+trap stop_server EXIT INT TERM
+
+rm -rf $OUT
+mkdir -p $DOCROOT
+# 1000 bytes: 100 numbered lines of 10, so every slice is recognizable
+i=0
+while [ $i -lt 100 ]; do
+    printf 'line %03d.\n' $i
+    i=$((i + 1))
+done > $FILE
+: > $DOCROOT/empty.txt
+
+./server -p $PORT -d $DOCROOT -l /dev/null > $OUT/server.log 2>&1 &
+server_pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    curl -s -o /dev/null $URL/data.txt && break
+    sleep 0.2
+done
+
+# request path with Range value; leaves the headers and body in $OUT
+fetch() {
+    curl -s -D $OUT/headers -o $OUT/body -H "Range: $2" $URL/$1
+}
+
+header() {
+    sed -n "s/^$1: \(.*\)\r$/\1/ip" $OUT/headers
+}
+
+# after a check: ok unless it failed somewhere
+passed() {
+    [ $failed -ne $before ] || echo "ok   $name"
+}
+
+fail() {
+    echo "FAIL $name: $*"
+    failed=$((failed + 1))
+}
+
+# name path range status content_range [first-last of the body [more]]
+# (with more, the caller goes on checking and calls passed itself)
+check() {
+    name=$1
+    before=$failed
+    fetch $2 "$3"
+    status=$(sed -n '1s/^HTTP\/1.1 \([0-9]*\).*/\1/p' $OUT/headers)
+    [ "$status" = "$4" ] || fail "status $status, expected $4"
+    [ "$(header Content-Range)" = "$5" ] ||
+        fail "Content-Range '$(header Content-Range)', expected '$5'"
+    if [ -n "$6" ]; then
+        first=${6%-*}
+        last=${6#*-}
+        tail -c +$((first + 1)) $FILE | head -c $((last - first + 1)) > $OUT/expected
+        cmp -s $OUT/body $OUT/expected || fail "body is not bytes $6"
+    fi
+    [ "$(header Content-Length)" = "$(wc -c < $OUT/body | tr -d ' ')" ] ||
+        fail "Content-Length $(header Content-Length) for a body of $(wc -c < $OUT/body)"
+    [ -n "$7" ] || passed
+}
+
+check first_bytes    data.txt "bytes=0-9"        206 "bytes 0-9/1000"     0-9
+check open_ended     data.txt "bytes=990-"       206 "bytes 990-999/1000" 990-999
+check suffix         data.txt "bytes=-5"         206 "bytes 995-999/1000" 995-999
+check suffix_all     data.txt "bytes=-2000"      206 "bytes 0-999/1000"   0-999
+check suffix_zero    data.txt "bytes=-0"         416 "bytes */1000"
+check end_past_eof   data.txt "bytes=990-2000"   206 "bytes 990-999/1000" 990-999
+check start_past_eof data.txt "bytes=1000-1010"  416 "bytes */1000"
+check merge_adjacent data.txt "bytes=0-0,1-1"    206 "bytes 0-1/1000"     0-1
+check merge_overlap  data.txt "bytes=10-29,20-39,0-15" 206 "bytes 0-39/1000" 0-39
+check unsatisfiable_dropped data.txt "bytes=2000-,5-9" 206 "bytes 5-9/1000" 5-9
+check bad_syntax     data.txt "bytes=9-5"        200 ""                   0-999
+check other_unit     data.txt "items=0-5"        200 ""                   0-999
+check empty_file     empty.txt "bytes=0-"        416 "bytes */0"
+check empty_suffix   empty.txt "bytes=-5"        416 "bytes */0"
+
+# disjoint slices: multipart/byteranges, rebuilt here part by part
+check multipart      data.txt "bytes=50-59,0-4,900-" 206 "" "" more
+boundary=$(header Content-Type | sed -n 's/^multipart\/byteranges; boundary=//p')
+[ -n "$boundary" ] || fail "Content-Type '$(header Content-Type)'"
+type=$(curl -s -o /dev/null -w '%{content_type}' $URL/data.txt)
+: > $OUT/expected
+for slice in 0-4 50-59 900-999; do
+    first=${slice%-*}
+    last=${slice#*-}
+    [ $first = 0 ] || printf '\r\n' >> $OUT/expected
+    printf -- '--%s\r\nContent-Type: %s\r\nContent-Range: bytes %s/1000\r\n\r\n' \
+        "$boundary" "$type" $slice >> $OUT/expected
+    tail -c +$((first + 1)) $FILE | head -c $((last - first + 1)) >> $OUT/expected
+done
+printf -- '\r\n--%s--\r\n' "$boundary" >> $OUT/expected
+cmp -s $OUT/body $OUT/expected || fail "multipart body differs from $OUT/expected"
+passed
+
+# more disjoint slices than RANGE_MAX (16): the whole file instead
+ranges=0-0
+i=1
+while [ $i -lt 17 ]; do
+    ranges="$ranges,$((i * 10))-$((i * 10))"
+    i=$((i + 1))
+done
+check too_many       data.txt "bytes=$ranges"    200 ""                   0-999
+check max_ranges     data.txt "bytes=${ranges%,*}" 206 ""
+
+stop_server
+if [ $failed -gt 0 ]; then
+    echo "$failed range check(s) failed"
+    exit 1
+fi
+echo "all range checks passed"